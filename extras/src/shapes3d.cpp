@@ -74,20 +74,10 @@ static bool clip(StandardFixedTranslationVector& a, StandardFixedTranslationVect
 
 static void drawClippedLine(DisplayList& displayList, Intensity intensity,
         const StandardFixedTranslationVector& viewA, const StandardFixedTranslationVector& viewB,
-        const DisplayListVector2& screenA, const DisplayListVector2& screenB,
-        uint16_t clipFlagsA, uint16_t clipFlagsB, bool previousEndMatch)
+        uint16_t clipFlagsA, uint16_t clipFlagsB)
 {
-    if((clipFlagsA == 0) && (clipFlagsB == 0))
-    {
-        // Both points are on the screen.  Happy days.
-        if(!previousEndMatch)
-        {
-            // Start a new line
-            displayList.PushVector(screenA, 0);
-        }
-        displayList.PushVector(screenB, intensity);
-        return;
-    }
+    // Lines that are entirely on screen are drawn by the caller
+    assert((clipFlagsA | clipFlagsB) != 0);
     if((clipFlagsA & clipFlagsB) != 0)
     {
         // Both points are clipped by the same plane, so definitely off screen
@@ -153,7 +143,12 @@ void Shape3D::Draw(DisplayList& displayList,
         }
     }
 
-    // Draw all the edges
+    // Draw all the edges.
+    // Runs of edges that join end-to-end, that are entirely on screen,
+    // are gathered up into polylines.
+    DisplayListVector2* polyline = (DisplayListVector2*) alloca(sizeof(DisplayListVector2) * (m_numEdges + 1));
+    uint32_t polylineCount = 0;
+    Intensity polylineIntensity = intensity;
     uint16_t previousPoint = 0xffff;
     Intensity edgeIntensity = intensity;
     for (uint32_t i = 0; i < m_numEdges; ++i)
@@ -164,11 +159,27 @@ void Shape3D::Draw(DisplayList& displayList,
         {
             edgeIntensity = m_edgeIntensities[i] * intensity;
         }
-        drawClippedLine(displayList, edgeIntensity,
-                        viewSpacePoints[a], viewSpacePoints[b],
-                        screenSpacePoints[a], screenSpacePoints[b],
-                        clipFlags[a], clipFlags[b],
-                        a == previousPoint);
+        if((clipFlags[a] == 0) && (clipFlags[b] == 0))
+        {
+            if((polylineCount == 0) || (a != previousPoint) || (edgeIntensity != polylineIntensity))
+            {
+                // Start a new polyline
+                displayList.PushPolyline(polyline, polylineCount, polylineIntensity, false);
+                polyline[0] = screenSpacePoints[a];
+                polylineCount = 1;
+                polylineIntensity = edgeIntensity;
+            }
+            polyline[polylineCount++] = screenSpacePoints[b];
+        }
+        else
+        {
+            displayList.PushPolyline(polyline, polylineCount, polylineIntensity, false);
+            polylineCount = 0;
+            drawClippedLine(displayList, edgeIntensity,
+                            viewSpacePoints[a], viewSpacePoints[b],
+                            clipFlags[a], clipFlags[b]);
+        }
         previousPoint = b;
     }
-}
\ No newline at end of file
+    displayList.PushPolyline(polyline, polylineCount, polylineIntensity, false);
+}
@@ -38,13 +38,64 @@ typedef FixedPoint<3, 12, int16_t, int32_t, false> Intensity;
 // Trade-off memory vs. DacOut performance.
 #define STEP_DIV_IN_DISPLAY_LIST 0
 
+// Divide the vectors into steps by multiplying with a table of reciprocals,
+// rather than doing two integer divisions per vector.
+#define STEP_RECIPROCAL_TABLE 1
+
+// Estimate the length of vectors (to within about 1.2%) when calculating
+// how many steps to draw them with, rather than doing a full square root.
+#define FAST_VECTOR_LENGTH 1
+
 typedef Vector2<DisplayListScalar> DisplayListVector2;
 
+// Static geometry (borders, titles, that kind of thing) that has been stepped
+// out into DAC words once, so that it can be drawn in later frames without
+// any of the per-step calculations.
+// Record one with DisplayList::BeginSegment and DisplayList::EndSegment, and draw
+// it with DisplayList::PushSegment.
+class DisplayListSegment
+{
+public:
+    DisplayListSegment() : m_pWords(nullptr), m_numWords(0), m_hash(0) {}
+
+    bool     IsRecorded() const { return m_numWords > 0; }
+    uint32_t GetNumWords() const { return m_numWords; }
+
+private:
+    friend class DisplayList;
+
+    uint32_t* m_pWords;
+    uint32_t  m_numWords;
+    uint32_t  m_hash; //< Of the words, so that DisplayLists can tell segments apart
+};
+
 class DisplayList
 {
 public:
+    // Everything that's pushed has a priority, which is set by SetPriority.
+    // OutputToDACs draws the high priority things first, and if the DisplayList
+    // fills up then the low priority things are thrown out to make room for more
+    // important ones.  So the player's ship is still drawn when there are too
+    // many particles.
+    // The vectors, points and raster displays are each drawn in priority order,
+    // but they're still drawn points first, then rasters, then vectors.
+    enum class Priority : uint8_t
+    {
+        eHigh,   //< The HUD, and the player
+        eNormal, //< Everything else in the game
+        eLow,    //< Decoration, like particles
+        eCount
+    };
+    // Applies to everything pushed from now on, until the next Clear.
+    // The default is eNormal.
+    void     SetPriority(Priority priority);
+    Priority GetPriority() const { return m_priority; }
+
     // Draw a line from the coordinates of the previous call to PushVector.
     // Use intensity=0 to move the 'cursor' without drawing anything.
+    // Zero-length vectors are dropped, back-to-back jumps are combined, and a
+    // vector that carries straight on from the previous one at the same intensity
+    // is merged into it.  So there's no need to worry about doing that yourself.
     void PushVector(DisplayListScalar x, DisplayListScalar y, Intensity intensity);
 
     // Convenience version
@@ -53,6 +104,12 @@ public:
         PushVector(coord.x, coord.y, intensity);
     }
 
+    // Jump to points[0], then draw lines through the rest of the points,
+    // and back to points[0] again if closed is true.
+    // This is quicker than calling PushVector for each point.  Zero-length lines
+    // are still dropped, and collinear lines are still merged.
+    void PushPolyline(const DisplayListVector2* points, uint32_t count, Intensity intensity, bool closed);
+
     // Draw a point.
     // Note that the intensity of points is brighter than vectors for the same value.
     // Why?  Because bright points look really cool and they're reasonably practical
@@ -67,6 +124,9 @@ public:
     }
 
     // *Experimental* Raster display
+    // The scanline callback is called for each scanline by OutputToDACs, and again
+    // by EstimateFrameDurationUs if that's used, so it can be called more than once
+    // per scanline per frame.  It should return the same pixels each time.
     typedef const uint8_t* (*RasterScanlineCallback)(uint32_t scanline, void* userData);
     struct RasterDisplay
     {
@@ -88,24 +148,174 @@ public:
         RasterScanlineCallback scanlineCallback;
         uint32_t horizontalScrollOffset = 0;
     };
+    // Each scanline has to fit in one DAC output buffer, so the width can't be
+    // more than 2 * (DAC_OUTPUT_ENTRIES_PER_BUFFER - 1).  Wider ones are cropped.
     void PushRasterDisplay(const RasterDisplay& rasterDisplay);
 
+    // The vectors pushed between BeginSegment and EndSegment are recorded into
+    // a DisplayListSegment, which is then pushed into this DisplayList in their place.
+    // Recording (re)allocates the segment's memory, so don't re-record a segment
+    // that might still be in a DisplayList that's waiting to be output.
+    // After EndSegment, the next PushVector carries on from the segment's last
+    // point.  If nothing was drawn between them, then nothing is recorded.
+    void BeginSegment();
+    void EndSegment(DisplayListSegment& outSegment);
+
+    // Draw a recorded segment.  The segment's DAC words are copied straight into the
+    // output buffers.  Segments are drawn before any of the DisplayList's vectors.
+    // The segment must stay alive until the DisplayList has been output.
+    void PushSegment(const DisplayListSegment& segment);
+
 public:
     DisplayList(uint32_t maxNumItems = 8192, uint32_t maxNumPoints = 4096);
 
     void OutputToDACs();
     void Clear()
     {
-        m_numDisplayListVectors = 0;
+        // Keep the first vector, at the origin, so that there's always
+        // a previous vector to draw from.
+        m_numDisplayListVectors = 1;
         m_numDisplayListPoints  = 0;
         m_numRasterDisplays = 0;
+        m_numSegments = 0;
+        m_firstMergeableVectorIdx = 1;
+        m_previousIntensity = 0;
+        m_contentHash = kContentHashSeed;
+        m_isReplayable = true;
+        m_numPreGeneratedWords = 0;
+        m_numPreGeneratedVectors = 0;
+        m_numVectorWords = 0;
+        m_numSegmentWords = 0;
+        m_numPointCycles = 0;
+        m_numRasterCycles = 0;
+        m_priority = Priority::eNormal;
+        m_isSortedByPriority = true;
     }
 
+    // Put everything into priority order, ready for OutputToDACs.
+    // Call this on the update core, after everything else, just before handing
+    // the DisplayList over to the DAC output core.
+    // Returns false if there wasn't the memory to do it, in which case
+    // OutputToDACs draws everything in the order it was pushed.
+    bool SortByPriority() { return sortByPriority(); }
+
+    // Optional pass to reorder the vectors to reduce the distance that the
+    // beam has to jump between disjoint strokes.
+    // Strokes can also be drawn backwards if that shortens the jump to them.
+    // Call this after the display list has been filled in, and before OutputToDACs.
+    // It's intended to be run on the update core, so it doesn't eat into the
+    // DAC output core's time.
+    void OptimiseBeamPath();
+
+    // For stats.  Jump lengths are the sum of the distances jumped between
+    // strokes, in DAC units (4096 is the full width of the display).
+    struct BeamPathStats
+    {
+        uint32_t numStrokes;
+        uint32_t jumpLengthBefore;
+        uint32_t jumpLengthAfter;
+    };
+    const BeamPathStats& GetBeamPathStats() const { return m_beamPathStats; }
+
+    // A hash of everything that has been pushed since the last Clear.
+    // If OutputToDACs sees the same hash as the previous frame, then it replays the
+    // previous frame's DAC output rather than generating it all again.
+    // Raster displays are drawn from callbacks, so frames with them can't be replayed.
+    uint32_t GetContentHash() const { return m_contentHash; }
+
+    // For stats.  How many frames have been output, and how many of those were replays.
+    struct FrameReuseStats
+    {
+        uint32_t numFrames;
+        uint32_t numReplayed;
+    };
+    static const FrameReuseStats& GetFrameReuseStats() { return s_frameReuseStats; }
+
+    // Optional pass to step out the vectors into DAC words now, rather than in
+    // OutputToDACs.  It's intended to be run on the update core, so that the DAC
+    // output core is left with little more than copying the words to the DMA buffers.
+    // Call it last, after the display list has been filled in and after OptimiseBeamPath.
+    // Only the first kMaxPreGeneratedWords steps are done, and OutputToDACs does the rest.
+    void PreGenerateVectors();
+    static constexpr uint32_t kMaxPreGeneratedWords = 8192;
+
+    // How long the DACs will take to draw everything that's been pushed so far.
+    // This is kept up to date as things are pushed, so it's cheap to call.
+    uint32_t GetPredictedBeamTimeUs() const;
+
+    // A more thorough version of GetPredictedBeamTimeUs, for deciding what to
+    // draw before the frame is submitted, or for checking that a demo fits its
+    // refresh rate.  It goes through everything that OutputToDACs will output,
+    // including the extra words it adds, and the actual holds of the raster
+    // pixels, so it calls the raster scanline callbacks an extra time.
+    // It doesn't include the time taken to switch between the PIO programs.
+    uint32_t EstimateFrameDurationUs() const;
+
+    // What ApplyFrameBudget does with a frame that won't fit in its budget
+    enum class FrameBudgetPolicy
+    {
+        // Nothing.  The frame takes longer, and the refresh rate drops.
+        eNone,
+        // Draw the vectors faster and the points shorter, so everything gets
+        // dimmer by about the same amount.
+        eScaleIntensity,
+        // Leave out the lowest priority points and then vectors, starting with
+        // the ones that were pushed last.
+        eDropItems,
+        // Cap the number of steps per vector.  The long bright vectors get drawn
+        // faster and more coarsely, but the short dim ones are left alone.
+        // Points aren't changed.
+        eReduceStepDensity,
+    };
+
+    // Optional pass to make sure that the frame can be drawn in budgetUs, so that
+    // the refresh rate doesn't drop when there's a lot going on.
+    // Call it after the display list has been filled in, and before OptimiseBeamPath
+    // and PreGenerateVectors.
+    // Segments and raster displays are never changed, only vectors and points.
+    void ApplyFrameBudget(uint32_t budgetUs, FrameBudgetPolicy policy);
+
+    // For stats.  The predicted beam time before and after ApplyFrameBudget.
+    struct FrameBudgetStats
+    {
+        uint32_t predictedUs;
+        uint32_t governedUs;
+    };
+    const FrameBudgetStats& GetFrameBudgetStats() const { return m_frameBudgetStats; }
+
     void DebugDump() const;
 
 private:
+    friend class Benchmarks;
+
     void terminateVectors();
     void terminatePoints();
+    bool startPriorityRun();
+    bool sortByPriority();
+    void evictVectors();
+    void evictPoints();
+    void generateWords(uint32_t first, uint32_t end, uint32_t* pOutput) const;
+    void hashContent(uint32_t word) { m_contentHash = (m_contentHash ^ word) * 16777619; }
+
+    static constexpr uint32_t kContentHashSeed = 2166136261;
+    static FrameReuseStats    s_frameReuseStats;
+
+    struct Stroke;
+    struct Vector;
+    static uint32_t calcNumSteps(Vector& vector, const Vector& previous, Intensity::IntermediateType intensitySquared);
+    static DisplayListScalar::IntermediateType exactLength(DisplayListScalar::IntermediateType dx,
+                                                           DisplayListScalar::IntermediateType dy);
+    static DisplayListScalar::IntermediateType approxLength(DisplayListScalar::IntermediateType dx,
+                                                            DisplayListScalar::IntermediateType dy);
+    static uint32_t pointDelayBits(Intensity brightness);
+    static uint32_t pointCycles(uint32_t delayBits);
+    uint32_t predictedBeamCycles() const;
+    void scaleIntensities(uint32_t budgetCycles);
+    void dropItems(uint32_t budgetCycles);
+    void reduceStepDensity(uint32_t budgetCycles);
+    const Vector& strokeStart(const Stroke& stroke) const;
+    const Vector& strokeEnd(const Stroke& stroke) const;
+    uint32_t      priorityGroupEnd(const Stroke* strokes, uint32_t numStrokes, uint32_t first) const;
 
     struct Vector
     {
@@ -113,7 +323,11 @@ private:
 #if STEP_DIV_IN_DISPLAY_LIST
         DisplayListIntermediate stepX, stepY;
 #endif
-        uint16_t numSteps;
+        uint16_t numSteps : 14;
+        // Every change of priority starts with a jump, so that runs of vectors
+        // with the same priority can be moved around by sortByPriority.
+        // The first vector has eCount, so that nothing can draw from it.
+        uint16_t priority : 2;
     };
 
     Vector*  m_pDisplayListVectors;
@@ -124,6 +338,7 @@ private:
     {
         DisplayListScalar x, y;
         Intensity         brightness;
+        Priority          priority;
     };
 
     Point*   m_pDisplayListPoints;
@@ -131,5 +346,47 @@ private:
     uint32_t m_maxDisplayListPoints;
 
     RasterDisplay* m_rasterDisplays;
+    Priority*      m_rasterPriorities;
     uint32_t m_numRasterDisplays;
+
+    const DisplayListSegment** m_segments;
+    uint32_t m_numSegments;
+
+    // PushVector won't merge into vectors before this one, so that a segment
+    // being recorded doesn't reach back into the vectors before it.
+    uint32_t m_firstMergeableVectorIdx;
+
+    // The intensity of the most recent PushVector, so we know if we can merge
+    // the next one into it.
+    Intensity m_previousIntensity;
+    // The first segment of the most recent vector, in DAC units, before
+    // anything was merged into it.  Only valid while m_previousIntensity is lit.
+    int32_t m_mergeRunDx;
+    int32_t m_mergeRunDy;
+
+    uint32_t m_contentHash;
+    bool     m_isReplayable;
+
+    Priority m_priority;
+    // False if anything has been pushed after something less important
+    bool     m_isSortedByPriority;
+
+    // Written by PreGenerateVectors.  Only allocated if it's used.
+    uint32_t* m_pPreGeneratedWords;
+    uint32_t  m_numPreGeneratedWords;
+    uint32_t  m_numPreGeneratedVectors;
+
+    // What we expect the DACs to spend on this frame, for ApplyFrameBudget.
+    uint32_t m_numVectorWords;  //< Steps and jumps
+    uint32_t m_numSegmentWords;
+    uint32_t m_numPointCycles;  //< points.pio cycles
+    uint32_t m_numRasterCycles; //< System clock cycles
+    FrameBudgetStats m_frameBudgetStats;
+
+    // Working memory for OptimiseBeamPath and sortByPriority.
+    // Only allocated if they're used.
+    Vector*       m_pScratchVectors;
+    Point*        m_pScratchPoints;
+    Stroke*       m_pBeamPathStrokes;
+    BeamPathStats m_beamPathStats;
 };
@@ -51,6 +51,7 @@
 
 #pragma once
 #include <cstdint>
+#include <type_traits>
 
 // Non-templatised sqrt, because it's quite large
 int32_t FixedPointSqrt(int32_t inValue, int32_t numFractionalBits);
@@ -183,6 +184,14 @@ public:
 
     constexpr FixedPoint() {}
 
+private:
+    struct NotAnInt {};
+    struct NotAUint {};
+    typedef typename std::conditional<std::is_same<StorageType, int>::value, NotAnInt, int>::type IntUnlessStorageType;
+    typedef typename std::conditional<std::is_same<StorageType, uint>::value, NotAUint, uint>::type UintUnlessStorageType;
+
+public:
+
     // Allow implicit construction from some other fixed point format
     template <int rhsNumWhole, int rhsNumFrac, typename rhsTStorage, typename rhsTIntermediateStorage, bool rhsDoClamping>
     constexpr FixedPoint(const FixedPoint<rhsNumWhole, rhsNumFrac, rhsTStorage, rhsTIntermediateStorage, rhsDoClamping>& rhs)
@@ -196,10 +205,19 @@ public:
     constexpr FixedPoint(float rhs) : m_storage(fromOtherFormat(rhs).getStorage()) {}
 
     // Allow implicit construction from int
-    constexpr FixedPoint(int rhs) : m_storage((StorageType)(int)((uint)rhs << kNumFractionalBits)) {}
+    constexpr FixedPoint(IntUnlessStorageType rhs) : m_storage((StorageType)(int)((uint)rhs << kNumFractionalBits)) {}
 
     // Allow implicit construction from uint
-    constexpr FixedPoint(uint rhs) : m_storage(rhs << kNumFractionalBits) {}
+    constexpr FixedPoint(UintUnlessStorageType rhs) : m_storage(rhs << kNumFractionalBits) {}
+
+    // With the Pico's toolchain, int32_t is a long, so the constructors from int
+    // and uint above don't clash with the one from the StorageType.  Where it's an
+    // int (like on the host), the StorageType wins for explicit construction, and
+    // these keep implicit construction from int and uint working as it does on the Pico.
+    template <typename T, typename std::enable_if<std::is_same<T, int>::value && std::is_same<T, StorageType>::value, int>::type = 0>
+    constexpr FixedPoint(T rhs) : m_storage((StorageType)(int)((uint)rhs << kNumFractionalBits)) {}
+    template <typename T, typename std::enable_if<std::is_same<T, uint>::value && std::is_same<T, StorageType>::value, int>::type = 0>
+    constexpr FixedPoint(T rhs) : m_storage(rhs << kNumFractionalBits) {}
 
     // Cast to float must be explicit, to prevent accidents
     explicit constexpr operator float() const { return toFloat(); }
@@ -211,13 +229,13 @@ public:
     template <typename T>
     constexpr IntermediateType operator+(const T& rhs) const
     {
-        return IntermediateType((IntermediateStorageType)getStorage() + IntermediateType(rhs).getStorage());
+        return IntermediateType((IntermediateStorageType)getStorage() + operand<IntermediateType>(rhs).getStorage());
     }
 
     template <typename T>
     constexpr IntermediateType operator-(const T& rhs) const
     {
-        return IntermediateType((IntermediateStorageType)getStorage() - IntermediateType(rhs).getStorage());
+        return IntermediateType((IntermediateStorageType)getStorage() - operand<IntermediateType>(rhs).getStorage());
     }
 
     constexpr IntermediateType operator-() const { return IntermediateType(-(IntermediateStorageType)getStorage()); }
@@ -287,31 +305,31 @@ public:
     template <typename T>
     constexpr bool operator<(const T& rhs) const
     {
-        return m_storage < FixedPoint(rhs).getStorage();
+        return m_storage < operand<FixedPoint>(rhs).getStorage();
     }
 
     template <typename T>
     constexpr bool operator<=(const T& rhs) const
     {
-        return m_storage <= FixedPoint(rhs).getStorage();
+        return m_storage <= operand<FixedPoint>(rhs).getStorage();
     }
 
     template <typename T>
     constexpr bool operator>(const T& rhs) const
     {
-        return m_storage > FixedPoint(rhs).getStorage();
+        return m_storage > operand<FixedPoint>(rhs).getStorage();
     }
 
     template <typename T>
     constexpr bool operator>=(const T& rhs) const
     {
-        return m_storage >= FixedPoint(rhs).getStorage();
+        return m_storage >= operand<FixedPoint>(rhs).getStorage();
     }
 
     template <typename T>
     constexpr bool operator!=(const T& rhs) const
     {
-        return m_storage != FixedPoint(rhs).getStorage();
+        return m_storage != operand<FixedPoint>(rhs).getStorage();
     }
 
     IntermediateType sqrt() const
@@ -370,6 +388,16 @@ public:
 
 
 private:
+    // The right hand side of an operator, converted to TFixed the same way on any
+    // toolchain.  An int or uint is copy-initialised, so that it's a value rather
+    // than the storage, even if the StorageType of TFixed is an int or uint.
+    template <typename TFixed, typename T>
+    static constexpr TFixed operand(const T& rhs) { return TFixed(rhs); }
+    template <typename TFixed>
+    static constexpr TFixed operand(int rhs) { return rhs; }
+    template <typename TFixed>
+    static constexpr TFixed operand(uint rhs) { return rhs; }
+
     // Specialisation to convert from a different fixed point format
     template <int rhsNumWhole, int rhsNumFrac, typename rhsTStorage, typename rhsTIntermediateStorage, bool rhsDoClamping>
     constexpr FixedPoint fromOtherFormat(
@@ -47,6 +47,36 @@ void PushShapeToDisplayList(DisplayList&            displayList,
                             const FixedTransform2D& transform,
                             BurnLength              burnLength = 0.f);
 
+// A box around a shape, in the shape's own coordinates.
+// Calculate it once with CalcShapeBounds, and then PushShapeToDisplayList
+// can skip the whole shape without transforming any of its points when it's
+// off screen.
+struct ShapeBounds
+{
+    ShapeVector2 min;
+    ShapeVector2 max;
+};
+void CalcShapeBounds(const ShapeVector2* points, uint32_t numPoints, ShapeBounds& outBounds);
+
+// Where a shape's bounds end up on the screen after the transform is applied
+enum class ShapeVisibility
+{
+    eOffScreen,
+    ePartlyOnScreen,
+    eOnScreen,
+};
+ShapeVisibility CalcShapeVisibility(const ShapeBounds& bounds, const FixedTransform2D& transform);
+
+// As above, but the shape is culled using its bounds first.
+void PushShapeToDisplayList(DisplayList&            displayList,
+                            const ShapeVector2*     points,
+                            uint32_t                numPoints,
+                            Intensity               intensity,
+                            bool                    closed,
+                            const FixedTransform2D& transform,
+                            const ShapeBounds&      bounds,
+                            BurnLength              burnLength = 0.f);
+
 // A Fragment is a piece of a shape.  Shapes can be 'fragmented' to
 // break them up from a list of points, to a list of disjoint Fragments.
 // The Fragments can then be drawn and animated individually.
@@ -0,0 +1,312 @@
+// Reordering of DisplayList vectors to shorten the beam's jumps.
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// The vectors in a DisplayList are a sequence of strokes, each one starting
+// with a jump (a vector with a single step).  Applications draw them in
+// whatever order is convenient, but the order doesn't matter for the final
+// image.  What does matter is how far the beam has to jump between the strokes,
+// because that's time the DACs spend not drawing anything.
+//
+// So here we...
+//   1. Split the vectors into strokes.
+//   2. Greedily pick the nearest stroke to draw next, from whichever of its
+//      ends is closest.
+//   3. Refine that with a single 2-opt pass, reversing runs of strokes where
+//      it shortens the jumps at either end of the run.
+//   4. Write the strokes out in their new order, flipping them where required.
+//
+// Strokes never move past strokes of a different priority, so that the more
+// important things are still drawn first.
+
+#include "displaylist.h"
+
+#include "pico/assert.h"
+
+#include <cstdlib>
+
+// The 2-opt pass is O(n^2) in the number of strokes, so don't let it get
+// out of hand.  Beyond this many strokes we just go with the greedy ordering.
+static constexpr uint32_t kMaxTwoOptStrokes = 256;
+
+struct DisplayList::Stroke
+{
+    uint16_t first;        //< Index of the jump to the start of the stroke
+    uint16_t count : 15;   //< Number of vectors in the stroke, including the jump
+    uint16_t reversed : 1; //< Draw it from the last vector back to the jump
+};
+
+// The X and Y DACs slew independently, so the time taken for the beam
+// to get somewhere is governed by the longer of the two axes.
+static inline uint32_t jumpLength(const DisplayListScalar& ax,
+                                  const DisplayListScalar& ay,
+                                  const DisplayListScalar& bx,
+                                  const DisplayListScalar& by)
+{
+    int32_t dx = abs((int32_t)ax.getStorage() - (int32_t)bx.getStorage());
+    int32_t dy = abs((int32_t)ay.getStorage() - (int32_t)by.getStorage());
+    return (uint32_t)((dx > dy) ? dx : dy);
+}
+
+static inline uint32_t toDacUnits(uint32_t length)
+{
+    return length >> (DisplayListScalar::kNumFractionalBits - 12);
+}
+
+const DisplayList::Vector& DisplayList::strokeStart(const Stroke& stroke) const
+{
+    return m_pDisplayListVectors[stroke.reversed ? (stroke.first + stroke.count - 1) : stroke.first];
+}
+
+const DisplayList::Vector& DisplayList::strokeEnd(const Stroke& stroke) const
+{
+    return m_pDisplayListVectors[stroke.reversed ? stroke.first : (stroke.first + stroke.count - 1)];
+}
+
+// One past the last of the strokes with the same priority as strokes[first]
+uint32_t DisplayList::priorityGroupEnd(const Stroke* strokes, uint32_t numStrokes, uint32_t first) const
+{
+    const uint32_t priority = m_pDisplayListVectors[strokes[first].first].priority;
+    uint32_t       end      = first + 1;
+    while ((end < numStrokes) && (m_pDisplayListVectors[strokes[end].first].priority == priority))
+    {
+        ++end;
+    }
+    return end;
+}
+
+void DisplayList::OptimiseBeamPath()
+{
+    // The output won't match an unoptimised frame with the same content
+    hashContent(0xffffffff);
+
+    m_beamPathStats = BeamPathStats();
+    const uint32_t numVectors = m_numDisplayListVectors;
+    if (numVectors < 3)
+    {
+        return;
+    }
+    // A single stroke could be every vector, and Stroke::count is only 15 bits
+    assert(m_maxDisplayListVectors < 32768);
+    if (m_pScratchVectors == nullptr)
+    {
+        m_pScratchVectors = (Vector*)malloc(m_maxDisplayListVectors * sizeof(Vector));
+    }
+    if (m_pBeamPathStrokes == nullptr)
+    {
+        m_pBeamPathStrokes = (Stroke*)malloc(m_maxDisplayListVectors * sizeof(Stroke));
+    }
+    if ((m_pScratchVectors == nullptr) || (m_pBeamPathStrokes == nullptr))
+    {
+        return;
+    }
+
+    // Strokes are only reordered amongst those with the same priority
+    sortByPriority();
+
+    // The first vector, and anything drawn from it before the first jump,
+    // stays where it is.  That's where the beam starts.
+    uint32_t numPinned = 1;
+    while ((numPinned < numVectors) && (m_pDisplayListVectors[numPinned].numSteps != 1))
+    {
+        ++numPinned;
+    }
+
+    // Split the rest into strokes
+    Stroke*  strokes    = m_pBeamPathStrokes;
+    uint32_t numStrokes = 0;
+    for (uint32_t i = numPinned; i < numVectors; ++i)
+    {
+        if (m_pDisplayListVectors[i].numSteps == 1)
+        {
+            Stroke& stroke  = strokes[numStrokes++];
+            stroke.first    = (uint16_t)i;
+            stroke.count    = 1;
+            stroke.reversed = 0;
+        }
+        else
+        {
+            ++strokes[numStrokes - 1].count;
+        }
+    }
+    m_beamPathStats.numStrokes = numStrokes;
+    if (numStrokes < 2)
+    {
+        return;
+    }
+
+    // After the final stroke, terminateVectors will send the beam back to the origin
+    const DisplayListScalar kOrigin = 0;
+
+    const Vector& pinnedEnd = m_pDisplayListVectors[numPinned - 1];
+    {
+        const Vector* previous = &pinnedEnd;
+        for (uint32_t i = 0; i < numStrokes; ++i)
+        {
+            const Vector& start = strokeStart(strokes[i]);
+            m_beamPathStats.jumpLengthBefore += jumpLength(previous->x, previous->y, start.x, start.y);
+            previous = &strokeEnd(strokes[i]);
+        }
+        m_beamPathStats.jumpLengthBefore += jumpLength(previous->x, previous->y, kOrigin, kOrigin);
+    }
+
+    // Greedy nearest-neighbour ordering.
+    // strokes[0, i) are in their final order, strokes[i, numStrokes) are yet to be placed.
+    const Vector* previous = &pinnedEnd;
+    uint32_t      groupEnd = 0;
+    for (uint32_t i = 0; i < numStrokes; ++i)
+    {
+        if (i == groupEnd)
+        {
+            groupEnd = priorityGroupEnd(strokes, numStrokes, i);
+        }
+        uint32_t bestIdx      = i;
+        uint32_t bestLength   = UINT32_MAX;
+        bool     bestReversed = false;
+        for (uint32_t j = i; j < groupEnd; ++j)
+        {
+            const Stroke& stroke = strokes[j];
+            const Vector& first  = m_pDisplayListVectors[stroke.first];
+            const Vector& last   = m_pDisplayListVectors[stroke.first + stroke.count - 1];
+            uint32_t      length = jumpLength(previous->x, previous->y, first.x, first.y);
+            if (length < bestLength)
+            {
+                bestIdx      = j;
+                bestLength   = length;
+                bestReversed = false;
+            }
+            length = jumpLength(previous->x, previous->y, last.x, last.y);
+            if (length < bestLength)
+            {
+                bestIdx      = j;
+                bestLength   = length;
+                bestReversed = true;
+            }
+            if (bestLength == 0)
+            {
+                break;
+            }
+        }
+        Stroke chosen       = strokes[bestIdx];
+        strokes[bestIdx]    = strokes[i];
+        chosen.reversed     = bestReversed ? 1 : 0;
+        strokes[i]          = chosen;
+        previous            = &strokeEnd(strokes[i]);
+    }
+
+    // 2-opt refinement.
+    // Reversing the run of strokes [i, j] (and flipping each of them) only changes
+    // the lengths of the jumps into and out of the run.
+    if (numStrokes <= kMaxTwoOptStrokes)
+    {
+        groupEnd = 0;
+        for (uint32_t i = 0; i < numStrokes; ++i)
+        {
+            if (i == groupEnd)
+            {
+                groupEnd = priorityGroupEnd(strokes, numStrokes, i);
+            }
+            const Vector& before = (i == 0) ? pinnedEnd : strokeEnd(strokes[i - 1]);
+            for (uint32_t j = i; j < groupEnd; ++j)
+            {
+                const Vector&     runStart = strokeStart(strokes[i]);
+                const Vector&     runEnd   = strokeEnd(strokes[j]);
+                DisplayListScalar afterX   = kOrigin;
+                DisplayListScalar afterY   = kOrigin;
+                if (j + 1 < numStrokes)
+                {
+                    const Vector& after = strokeStart(strokes[j + 1]);
+                    afterX              = after.x;
+                    afterY              = after.y;
+                }
+                const uint32_t currentLength = jumpLength(before.x, before.y, runStart.x, runStart.y)
+                                               + jumpLength(runEnd.x, runEnd.y, afterX, afterY);
+                const uint32_t reversedLength = jumpLength(before.x, before.y, runEnd.x, runEnd.y)
+                                                + jumpLength(runStart.x, runStart.y, afterX, afterY);
+                if (reversedLength < currentLength)
+                {
+                    for (uint32_t a = i, b = j; a < b; ++a, --b)
+                    {
+                        const Stroke temp = strokes[a];
+                        strokes[a]        = strokes[b];
+                        strokes[b]        = temp;
+                    }
+                    for (uint32_t k = i; k <= j; ++k)
+                    {
+                        strokes[k].reversed ^= 1;
+                    }
+                }
+            }
+        }
+    }
+
+    // Write the vectors out in their new order
+    Vector* pOut = m_pScratchVectors;
+    for (uint32_t i = 0; i < numPinned; ++i)
+    {
+        *(pOut++) = m_pDisplayListVectors[i];
+    }
+    for (uint32_t i = 0; i < numStrokes; ++i)
+    {
+        const Stroke& stroke  = strokes[i];
+        const Vector* pSource = m_pDisplayListVectors + stroke.first;
+        Vector*       pJump   = pOut;
+        if (!stroke.reversed)
+        {
+            for (uint32_t k = 0; k < stroke.count; ++k)
+            {
+                *(pOut++) = pSource[k];
+            }
+        }
+        else
+        {
+            // The jump goes to the end of the stroke, and each vector takes the
+            // step count of the one that used to lead to it.
+            *(pOut++)          = pSource[stroke.count - 1];
+            pJump->numSteps    = 1;
+            for (int32_t k = (int32_t)stroke.count - 2; k >= 0; --k)
+            {
+                Vector& vector  = *(pOut++);
+                vector          = pSource[k];
+                vector.numSteps = pSource[k + 1].numSteps;
+#if STEP_DIV_IN_DISPLAY_LIST
+                vector.stepX = -pSource[k + 1].stepX;
+                vector.stepY = -pSource[k + 1].stepY;
+#endif
+            }
+        }
+#if STEP_DIV_IN_DISPLAY_LIST
+        // The jump has come from somewhere else now
+        pJump->stepX = pJump->x - pJump[-1].x;
+        pJump->stepY = pJump->y - pJump[-1].y;
+#endif
+        const Vector& start = *pJump;
+        m_beamPathStats.jumpLengthAfter += jumpLength(pJump[-1].x, pJump[-1].y, start.x, start.y);
+    }
+    m_beamPathStats.jumpLengthAfter += jumpLength(pOut[-1].x, pOut[-1].y, kOrigin, kOrigin);
+    assert((uint32_t)(pOut - m_pScratchVectors) == numVectors);
+
+    m_beamPathStats.jumpLengthBefore = toDacUnits(m_beamPathStats.jumpLengthBefore);
+    m_beamPathStats.jumpLengthAfter  = toDacUnits(m_beamPathStats.jumpLengthAfter);
+
+    // Swap the buffers over rather than copying back
+    Vector* pTemp          = m_pDisplayListVectors;
+    m_pDisplayListVectors  = m_pScratchVectors;
+    m_pScratchVectors      = pTemp;
+}
@@ -0,0 +1,257 @@
+// Micro-benchmarks for the performance-critical paths
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+#include "benchmarks.h"
+
+#include "displaylist.h"
+#include "log.h"
+#include "pico/time.h"
+#include "stepreciprocal.h"
+#include "text.h"
+
+#include <cmath>
+#include <cstdlib>
+
+static LogChannel BenchmarkResults(true);
+
+// How many times to repeat each test, to get a measurable duration
+static constexpr uint32_t kNumRepeats = 1000;
+
+// Somewhere for the results to go, so that the compiler can't optimise the work away
+static volatile int32_t s_sink = 0;
+
+static uint32_t nsPerItem(uint64_t durationUs, uint32_t numItems)
+{
+    return (uint32_t)((durationUs * 1000) / numItems);
+}
+
+void Benchmarks::Run()
+{
+    LOG_INFO(BenchmarkResults, "Benchmarks...\n");
+
+    // Text is the worst case for per-vector overheads; lots of very short strokes
+    static DisplayList* s_pTextDisplayList = nullptr;
+    if (s_pTextDisplayList == nullptr)
+    {
+        s_pTextDisplayList = new DisplayList(2048, 16);
+    }
+    DisplayList& textDisplayList = *s_pTextDisplayList;
+    textDisplayList.Clear();
+    FixedTransform2D transform;
+    CalcTextTransform(DisplayListVector2(0.05f, 0.5f), 0.02f, transform);
+    TextPrint(textDisplayList, transform, "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG 0123456789", 1.f);
+
+    stepDivision(textDisplayList);
+    vectorLength(textDisplayList);
+    polyline(textDisplayList);
+
+    LOG_INFO(BenchmarkResults, "Benchmarks done\n");
+}
+
+// This mirrors the vector loop of DisplayList::OutputToDACs, but writes the
+// steps to memory rather than to the DAC output buffers.
+// If pSteps is null, then it only does the per-vector setup.
+template <bool kUseReciprocal>
+int32_t Benchmarks::stepVectors(const DisplayList& displayList, uint32_t* pSteps)
+{
+    const DisplayList::Vector* pVectors = displayList.m_pDisplayListVectors;
+    DisplayListIntermediate    x(0), y(0);
+    int32_t                    checksum = 0;
+    for (uint32_t i = 1; i < displayList.m_numDisplayListVectors; ++i)
+    {
+        const DisplayList::Vector& vector   = pVectors[i];
+        const uint32_t             numSteps = vector.numSteps;
+        DisplayListIntermediate    dx       = DisplayListIntermediate(vector.x - x);
+        DisplayListIntermediate    dy       = DisplayListIntermediate(vector.y - y);
+        if (numSteps > 1)
+        {
+            if (kUseReciprocal)
+            {
+                dx = StepReciprocal::Divide(dx, numSteps);
+                dy = StepReciprocal::Divide(dy, numSteps);
+            }
+            else
+            {
+                dx /= (int)numSteps;
+                dy /= (int)numSteps;
+            }
+        }
+        if (pSteps != nullptr)
+        {
+            for (uint32_t step = 0; step < numSteps; ++step)
+            {
+                x += dx;
+                y += dy;
+                pSteps[step] = ((x.getStorage() >> 16) & 0xfff) | (((y.getStorage() >> 16) & 0xfff) << 12);
+            }
+        }
+        checksum += dx.getStorage() + dy.getStorage();
+        x = vector.x;
+        y = vector.y;
+    }
+    return checksum;
+}
+
+void Benchmarks::stepDivision(const DisplayList& displayList)
+{
+    uint32_t numVectors = 0;
+    uint32_t numSteps   = 0;
+    for (uint32_t i = 1; i < displayList.m_numDisplayListVectors; ++i)
+    {
+        ++numVectors;
+        numSteps += displayList.m_pDisplayListVectors[i].numSteps;
+    }
+    if (numVectors == 0)
+    {
+        return;
+    }
+    uint32_t* pSteps = (uint32_t*)malloc(StepReciprocal::kNumReciprocals * sizeof(uint32_t));
+    if (pSteps == nullptr)
+    {
+        return;
+    }
+
+    uint64_t timings[4];
+    for (uint32_t test = 0; test < 4; ++test)
+    {
+        const bool      useReciprocal = (test & 1) != 0;
+        uint32_t* const pTestSteps    = (test & 2) ? pSteps : nullptr;
+        const uint64_t  start         = time_us_64();
+        for (uint32_t i = 0; i < kNumRepeats; ++i)
+        {
+            s_sink = useReciprocal ? stepVectors<true>(displayList, pTestSteps)
+                                   : stepVectors<false>(displayList, pTestSteps);
+        }
+        timings[test] = time_us_64() - start;
+    }
+    free(pSteps);
+
+    const uint32_t numTotalVectors = numVectors * kNumRepeats;
+    LOG_INFO(BenchmarkResults, "Step division: %d vectors, %d steps\n", numVectors, numSteps);
+    LOG_INFO(BenchmarkResults, "  divide:     %d ns/vector setup, %d ns/vector with steps\n",
+             nsPerItem(timings[0], numTotalVectors), nsPerItem(timings[2], numTotalVectors));
+    LOG_INFO(BenchmarkResults, "  reciprocal: %d ns/vector setup, %d ns/vector with steps\n",
+             nsPerItem(timings[1], numTotalVectors), nsPerItem(timings[3], numTotalVectors));
+}
+
+// Anything shorter than this (about 16 DAC units) is left out of the error measurements
+static constexpr float kMinLengthForError = 1.f / 256.f;
+
+void Benchmarks::vectorLength(const DisplayList& displayList)
+{
+    const DisplayList::Vector* pVectors   = displayList.m_pDisplayListVectors;
+    const uint32_t             numVectors = displayList.m_numDisplayListVectors - 1;
+    if (numVectors == 0)
+    {
+        return;
+    }
+
+    uint64_t timings[2];
+    for (uint32_t test = 0; test < 2; ++test)
+    {
+        const bool     approx = (test != 0);
+        const uint64_t start  = time_us_64();
+        for (uint32_t i = 0; i < kNumRepeats; ++i)
+        {
+            int32_t checksum = 0;
+            for (uint32_t j = 1; j <= numVectors; ++j)
+            {
+                const DisplayListScalar::IntermediateType dx = pVectors[j].x - pVectors[j - 1].x;
+                const DisplayListScalar::IntermediateType dy = pVectors[j].y - pVectors[j - 1].y;
+                checksum += approx ? DisplayList::approxLength(dx, dy).getStorage()
+                                   : DisplayList::exactLength(dx, dy).getStorage();
+            }
+            s_sink = checksum;
+        }
+        timings[test] = time_us_64() - start;
+    }
+
+    // And how far out they both are, compared to floating point, in tenths of a percent.
+    // Very short vectors are left out, because then it's all about the rounding.
+    int32_t worstErrors[2] = {0, 0};
+    for (uint32_t j = 1; j <= numVectors; ++j)
+    {
+        const DisplayListScalar::IntermediateType dx      = pVectors[j].x - pVectors[j - 1].x;
+        const DisplayListScalar::IntermediateType dy      = pVectors[j].y - pVectors[j - 1].y;
+        const float                               fdx     = (float)dx;
+        const float                               fdy     = (float)dy;
+        const float                               trueLen = sqrtf((fdx * fdx) + (fdy * fdy));
+        if (trueLen < kMinLengthForError)
+        {
+            continue;
+        }
+        const float lengths[2] = {(float)DisplayList::exactLength(dx, dy), (float)DisplayList::approxLength(dx, dy)};
+        for (uint32_t test = 0; test < 2; ++test)
+        {
+            const int32_t error = (int32_t)(fabsf(lengths[test] - trueLen) * 1000.f / trueLen);
+            worstErrors[test]   = (error > worstErrors[test]) ? error : worstErrors[test];
+        }
+    }
+
+    const uint32_t numTotalVectors = numVectors * kNumRepeats;
+    LOG_INFO(BenchmarkResults, "Vector length: %d vectors\n", numVectors);
+    LOG_INFO(BenchmarkResults, "  sqrt:   %d ns/vector, worst error %d.%d%%\n", nsPerItem(timings[0], numTotalVectors),
+             worstErrors[0] / 10, worstErrors[0] % 10);
+    LOG_INFO(BenchmarkResults, "  approx: %d ns/vector, worst error %d.%d%%\n", nsPerItem(timings[1], numTotalVectors),
+             worstErrors[1] / 10, worstErrors[1] % 10);
+}
+
+void Benchmarks::polyline(DisplayList& displayList)
+{
+    // A circle
+    constexpr uint32_t kNumPoints = 64;
+    DisplayListVector2 points[kNumPoints];
+    for (uint32_t i = 0; i < kNumPoints; ++i)
+    {
+        const float angle = kPi * 2.f * i / (float)kNumPoints;
+        points[i]         = DisplayListVector2(0.5f + (0.4f * cosf(angle)), 0.5f + (0.4f * sinf(angle)));
+    }
+    const Intensity intensity = 1.f;
+
+    uint64_t timings[2];
+    for (uint32_t test = 0; test < 2; ++test)
+    {
+        const uint64_t start = time_us_64();
+        for (uint32_t i = 0; i < kNumRepeats; ++i)
+        {
+            displayList.Clear();
+            if (test == 0)
+            {
+                displayList.PushVector(points[0], 0);
+                for (uint32_t j = 1; j < kNumPoints; ++j)
+                {
+                    displayList.PushVector(points[j], intensity);
+                }
+                displayList.PushVector(points[0], intensity);
+            }
+            else
+            {
+                displayList.PushPolyline(points, kNumPoints, intensity, true);
+            }
+        }
+        timings[test] = time_us_64() - start;
+    }
+    displayList.Clear();
+
+    const uint32_t numTotalVertices = kNumPoints * kNumRepeats;
+    LOG_INFO(BenchmarkResults, "Polyline: %d vertices\n", kNumPoints);
+    LOG_INFO(BenchmarkResults, "  PushVector:   %d ns/vertex\n", nsPerItem(timings[0], numTotalVertices));
+    LOG_INFO(BenchmarkResults, "  PushPolyline: %d ns/vertex\n", nsPerItem(timings[1], numTotalVertices));
+}
@@ -0,0 +1,51 @@
+// Micro-benchmarks for the performance-critical paths
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// This is an internal header for picovectorscope.
+//
+// Send a 'b' over serial to run these.  They run on the DisplayList update
+// core, so the display will stall for a moment while they do.
+
+#pragma once
+#include <cstdint>
+
+class DisplayList;
+
+class Benchmarks
+{
+public:
+    // Run all the benchmarks, logging the results
+    static void Run();
+
+private:
+    // Cost per vector of dividing it into steps, with and without the
+    // reciprocal table.
+    static void stepDivision(const DisplayList& displayList);
+    // Cost per vector of calculating its length to derive the number of steps,
+    // with a square root and with the approximation.
+    static void vectorLength(const DisplayList& displayList);
+
+    // Cost per vertex of pushing a shape with PushVector, and with PushPolyline.
+    // This uses the DisplayList as scratch space, so it must run last.
+    static void polyline(DisplayList& displayList);
+
+    template <bool kUseReciprocal>
+    static int32_t stepVectors(const DisplayList& displayList, uint32_t* pSteps);
+};
@@ -21,39 +21,62 @@
 
 #include "log.h"
 #include "dacout.h"
+#include "framecapture.h"
+#include "telemetry.h"
 #include "pico/time.h"
 #include "pico/sync.h"
+#include "hardware/irq.h"
+
+#include <cstring>
 
 const DacOutputPioSmConfig* DacOutput::s_currentPioConfig = nullptr;
 const DacOutputPioSmConfig* DacOutput::s_previousPioConfig = nullptr;
-int                DacOutput::s_dmaChainSpinChannelIdx;
-volatile uint32_t* DacOutput::s_dmaChainSpinCtrl;
-dma_channel_config DacOutput::s_dmaChainSpinConfigTemplate;
-DacOutput::DmaChannel DacOutput::s_dmaChannels[kNumBuffers];
-uint32_t DacOutput::s_buffers[kNumBuffers][kNumEntriesPerBuffer];
 uint32_t DacOutput::s_currentBufferIdx = 0;
 uint32_t DacOutput::s_currentEntryIdx = 0;
+uint32_t DacOutput::s_currentBufferSize = DacOutput::kNumEntriesPerBuffer;
 const DacOutputPioSmConfig* DacOutput::s_idlePioSmConfig = nullptr;
-uint32_t DacOutput::s_nextBufferIrq = 0;
-volatile uint32_t DacOutput::s_numDmaChannelsQueued = 0;
 uint64_t DacOutput::s_frameStartUs = 0;
+volatile uint32_t DacOutput::s_producerItem = 0;
+DacOutput::UnderrunStats DacOutput::s_underrunStats;
+uint64_t DacOutput::s_underrunStartUs = 0;
 uint64_t DacOutput::s_frameDurationUs = 0;
+uint32_t DacOutput::s_numPreviousFrameChunks = 0;
 
 static const DacOutputPioSmConfig* s_activePioSmConfig = nullptr;
+
+static DacOutput::WaitCallback s_waitCallback = nullptr;
+static void* s_waitCallbackUserData = nullptr;
+
+static LogChannel DacOutputSynchronisation(false);
+
+// The ring buffer version of everything below is in dacoutring.cpp
+#if !DAC_OUTPUT_RING_DMA
+
+int                DacOutput::s_dmaChainSpinChannelIdx;
+volatile uint32_t* DacOutput::s_dmaChainSpinCtrl;
+dma_channel_config DacOutput::s_dmaChainSpinConfigTemplate;
+DacOutput::DmaChannel DacOutput::s_dmaChannels[kNumBuffers];
+uint32_t DacOutput::s_buffers[kNumBuffers][kNumEntriesPerBuffer];
+uint32_t DacOutput::s_nextBufferIrq = 0;
+volatile uint32_t DacOutput::s_numBuffersFlushed = 0;
+volatile uint32_t DacOutput::s_numBuffersRetired = 0;
+DacOutput::FrameChunk DacOutput::s_frameChunks[kNumBuffers];
+uint32_t DacOutput::s_numFrameChunks = 0;
+DacOutput::FrameChunk DacOutput::s_previousFrameChunks[kNumBuffers];
+
 uint32_t s_chainSpinDmaRead = 0;
 uint32_t s_chainSpinDmaWrite = 0;
 
-static bool s_dmaIsRunning = false;
+// These are only written by checkDmaStatus
+static volatile bool s_dmaIsRunning = false;
 static uint32_t s_numBuffersToQueueBeforeKick;
 
-static mutex_t s_dmaMutex;
-
-static LogChannel DacOutputSynchronisation(false);
+// All the buffer DMA channels
+static uint32_t s_dmaIrqMask = 0;
 
 void DacOutput::Init(const DacOutputPioSmConfig& idleSm)
 {
     s_idlePioSmConfig = &idleSm;
-    mutex_init(&s_dmaMutex);
 
     s_dmaChainSpinChannelIdx = dma_claim_unused_channel(true);
     s_dmaChainSpinCtrl = &(dma_hw->ch[s_dmaChainSpinChannelIdx].ctrl_trig);
@@ -95,18 +118,27 @@ void DacOutput::Init(const DacOutputPioSmConfig& idleSm)
     dma_channel_start(s_dmaChannels[0].m_chainSpinChannelIdx);
     s_numBuffersToQueueBeforeKick = kNumBuffers - 1;
 
-    // Configure the processor to run dmaIrqHandler() when DMA IRQ 0 is asserted
-    //irq_set_exclusive_handler(DMA_IRQ_0, dmaIrqHandler);
-    //irq_set_enabled(DMA_IRQ_0, true);
+    // A buffer has finished when its channel's raw interrupt flag is set,
+    // whether or not the interrupt is enabled
+    for (uint32_t i = 0; i < kNumBuffers; ++i)
+    {
+        s_dmaIrqMask |= 1u << s_dmaChannels[i].m_channelIdx;
+    }
+    dma_hw->intr = s_dmaIrqMask;
 
-    s_dmaChannels[0].m_complete = false;
+#if DAC_OUTPUT_DMA_IRQ
+    // Configure the processor to run dmaIrqHandler() when DMA IRQ 0 is asserted
+    // by any of the buffer DMA channels finishing
+    dma_set_irq0_channel_mask_enabled(s_dmaIrqMask, true);
+    irq_set_exclusive_handler(DMA_IRQ_0, dmaIrqHandler);
+    irq_set_enabled(DMA_IRQ_0, true);
+#endif
 }
 
 void DacOutput::DmaChannel::Init(uint32_t* pBufferBase, const DacOutput::DmaChannel& chainTo)
 {
     m_pBufferBase = pBufferBase;
     m_config = dma_channel_get_default_config(m_channelIdx);
-    m_complete = true;
     m_isFinal = false;
 
     //
@@ -180,56 +212,94 @@ void DacOutput::DmaChannel::Configure(uint32_t numEntries, const DacOutputPioSmC
     dma_channel_set_write_addr(m_channelIdx, &(pioConfig.m_pio->txf[pioConfig.m_stateMachine]), false);
     m_liveChainSpinConfig = m_chainSpinSpinConfig;
     dma_channel_set_trans_count(m_channelIdx, numEntries, false);
-    m_complete = false;
     m_pDacOutputPioSmConfigToSet = nullptr;
 
 }
 
 void DacOutput::Flush(bool finalFlushForFrame)
+{
+    FlushWithoutWaiting(finalFlushForFrame);
+
+    // Wait for the DMA to finish with the new buffer
+    //LOG_INFO(DacOutputSynchronisation, "Wait [%d]\n", s_currentBufferIdx);
+    if(!tryAcquireBuffer())
+    {
+        const uint64_t waitStartUs = time_us_64();
+        while(!tryAcquireBuffer())
+        {
+            waitForDma();
+        }
+        Telemetry::AddFlushWaitUs((uint32_t)(time_us_64() - waitStartUs));
+    }
+    //LOG_INFO(DacOutputSynchronisation, "Done [%d]\n", s_currentBufferIdx);
+}
+
+void DacOutput::FlushWithoutWaiting(bool finalFlushForFrame)
 {
     if (s_currentEntryIdx == 0)
     {
         // Nothing to flush
+        if(finalFlushForFrame)
+        {
+            // But it's still the end of the frame
+            FrameCapture::RecordChunk(0, nullptr, 0, true);
+            s_numPreviousFrameChunks = 0;
+            s_numFrameChunks = 0;
+        }
         return;
     }
 
+    // Remember where this part of the frame is, in case it's replayed
+    if(s_numFrameChunks < kNumBuffers)
+    {
+        FrameChunk& chunk = s_frameChunks[s_numFrameChunks];
+        chunk.m_bufferIdx = s_currentBufferIdx;
+        chunk.m_numEntries = s_currentEntryIdx;
+        chunk.m_pPioConfig = s_currentPioConfig;
+    }
+    ++s_numFrameChunks;
+    FrameCapture::RecordChunk(s_currentPioConfig->m_id, s_buffers[s_currentBufferIdx], s_currentEntryIdx, finalFlushForFrame);
+
     //LOG_INFO(DacOutputSynchronisation, "Flush [%d, %d]\n", s_currentBufferIdx, s_currentEntryIdx);
     // Our new buffer is filled up and ready to go, so let's configure its DMA
     DmaChannel& dmaChannel = s_dmaChannels[s_currentBufferIdx];
     dmaChannel.Configure(s_currentEntryIdx, *s_currentPioConfig);
     dmaChannel.m_isFinal = finalFlushForFrame;
 
-    mutex_enter_blocking(&s_dmaMutex);
-    ++s_numDmaChannelsQueued;
+    const bool isChained = (s_currentPioConfig == s_previousPioConfig);
+    if(!isChained)
+    {
+        // We can't chain it, because it requires a change in PIO SM program.
+        // checkDmaStatus will kick it off once the buffer before it has finished.
+        LOG_INFO(DacOutputSynchronisation, "Flush Break %d\n", s_currentBufferIdx);
+        dmaChannel.m_pDacOutputPioSmConfigToSet = s_currentPioConfig;
+        s_previousPioConfig = s_currentPioConfig;
+    }
+
+    // Hand the buffer over to checkDmaStatus.  It has to be queued before
+    // it's enabled, so that it can't finish before it can be retired.
+    __dmb();
+    s_numBuffersFlushed = s_numBuffersFlushed + 1;
 
-    if(s_currentPioConfig == s_previousPioConfig)
+    if(isChained)
     {
         // This buffer is a continuation of the previous one, so we can enable it straight away
-        // so that it chains automatically
+        // so that it chains automatically.  If the previous one has already finished then
+        // the DMA is spinning, waiting for this, so it will start straight away.
         LOG_INFO(DacOutputSynchronisation, "Flush Chained %d\n", s_currentBufferIdx);
         dmaChannel.Enable();
-        s_chainSpinDmaRead = s_currentBufferIdx;
-    }
-    else
-    {
-        // We can't chain it, because it requires a change in PIO SM program
-        LOG_INFO(DacOutputSynchronisation, "Flush Break %d\n", s_currentBufferIdx);
-        dmaChannel.m_pDacOutputPioSmConfigToSet = s_currentPioConfig;
-        s_previousPioConfig = s_currentPioConfig;
     }
 
-    if(!s_dmaIsRunning && (finalFlushForFrame || (s_numDmaChannelsQueued >= s_numBuffersToQueueBeforeKick)))
+    if(!s_dmaIsRunning)
     {
-        // The DMA isn't currently running (well, it's spinning actually)
-        // So we kick it off here
-        const uint32_t kickBufferIdx = (s_currentBufferIdx + kNumBuffers - s_numDmaChannelsQueued + 1) % kNumBuffers;
-        LOG_INFO(DacOutputSynchronisation, "Flush Kick %d\n", kickBufferIdx);
-        configurePioAndStartDma(s_dmaChannels[kickBufferIdx]);
-        s_chainSpinDmaRead = kickBufferIdx;
-        s_dmaIsRunning = true;
-        s_numBuffersToQueueBeforeKick = 1; // Don't wait anymore for multiple buffers to be filled
+        // The DMA isn't currently running (well, it's spinning actually),
+        // so checkDmaStatus needs to decide whether to kick it off
+#if DAC_OUTPUT_DMA_IRQ
+        irq_set_pending(DMA_IRQ_0);
+#else
+        checkDmaStatus();
+#endif
     }
-    mutex_exit(&s_dmaMutex);
     
     // Move on to the next buffer for filling in
     if (++s_currentBufferIdx == kNumBuffers)
@@ -237,56 +307,139 @@ void DacOutput::Flush(bool finalFlushForFrame)
         s_currentBufferIdx = 0;
     }
     s_currentEntryIdx = 0;
-    // Wait for the DMA to complete on this new buffer.
-    DmaChannel& nextDmaChannel = s_dmaChannels[s_currentBufferIdx];
-    //LOG_INFO(DacOutputSynchronisation, "Wait [%d]\n", s_currentBufferIdx);
-    while(!nextDmaChannel.m_complete)
-    {
-        tight_loop_contents();
-        checkDmaStatus();
-    }
-    //LOG_INFO(DacOutputSynchronisation, "Done [%d]\n", s_currentBufferIdx);
+    // It can't be filled in until tryAcquireBuffer says it's free
+    s_currentBufferSize = 0;
 
     if(finalFlushForFrame)
     {
         // Let's make sure that we always assert the correct PIO SM program
         // for the first flush of the next frame
         s_previousPioConfig = nullptr;
-        s_numBuffersToQueueBeforeKick = kNumBuffers - 1;
+
+        // If this frame's buffers haven't been recycled during the frame, then it can be replayed
+        s_numPreviousFrameChunks = (s_numFrameChunks <= kNumBuffers) ? s_numFrameChunks : 0;
+        for(uint32_t i = 0; i < s_numPreviousFrameChunks; ++i)
+        {
+            s_previousFrameChunks[i] = s_frameChunks[i];
+        }
+        s_numFrameChunks = 0;
     }
 }
 
-void DacOutput::checkDmaStatus()
+bool DacOutput::tryAcquireBuffer()
 {
-    if(!s_dmaIsRunning)
+    if(s_currentBufferSize == 0)
     {
-        return;
+        // The buffer is free once it's no longer queued, which is when
+        // there's a free slot in the queue.
+        if(getNumBuffersQueued() == kNumBuffers)
+        {
+            return false;
+        }
+        s_currentBufferSize = kNumEntriesPerBuffer;
     }
-    DmaChannel& dmaChannel = s_dmaChannels[s_nextBufferIrq];
-    if(dma_hw->ch[dmaChannel.m_channelIdx].transfer_count > 0)
+    return true;
+}
+
+bool DacOutput::tryMakeSpace(uint32_t numEntries)
+{
+#if !DAC_OUTPUT_DMA_IRQ
+    checkDmaStatus();
+#endif
+    if((s_currentEntryIdx > 0) && (numEntries > (s_currentBufferSize - s_currentEntryIdx)))
     {
-        return;
+        FlushWithoutWaiting();
+    }
+    return tryAcquireBuffer();
+}
+
+void DacOutput::ReplayPreviousFrame()
+{
+    // Take a copy, because the Flushes will replace it as we go
+    const uint32_t numChunks = s_numPreviousFrameChunks;
+    FrameChunk chunks[kNumBuffers];
+    for(uint32_t i = 0; i < numChunks; ++i)
+    {
+        chunks[i] = s_previousFrameChunks[i];
+    }
+
+    // The buffers are filled in the same order that they were for the previous frame,
+    // so none of the previous frame's buffers are overwritten before they're copied.
+    // If the previous frame used all the buffers, then every chunk lands back where
+    // it already is, and there's nothing to copy at all.
+    for(uint32_t i = 0; i < numChunks; ++i)
+    {
+        const FrameChunk& chunk = chunks[i];
+        SetCurrentPioSm(*chunk.m_pPioConfig);
+        uint32_t* pOutput = AllocateBufferSpace(chunk.m_numEntries);
+        const uint32_t* pSource = s_buffers[chunk.m_bufferIdx];
+        if(pOutput != pSource)
+        {
+            memcpy(pOutput, pSource, chunk.m_numEntries * sizeof(uint32_t));
+        }
+        Flush(i == (numChunks - 1));
     }
+}
 
+bool DacOutput::checkDmaStatus()
+{
+    // This is the only place that buffers are retired, or the DMA is kicked
+    // off.  It runs either from the DMA IRQ, or from polling on the same
+    // core as Flush, so it never runs concurrently with itself.
+    bool hasRetired = false;
+    while((getNumBuffersQueued() > 0) && ((dma_hw->intr & (1u << s_dmaChannels[s_nextBufferIrq].m_channelIdx)) != 0))
+    {
+        retireDma();
+        hasRetired = true;
+    }
+
+    if(!s_dmaIsRunning)
+    {
+        // Wait for a few buffers to be queued up at the start of the frame,
+        // unless the whole frame has already been queued.
+        const uint32_t numBuffersQueued = getNumBuffersQueued();
+        bool shouldKick = (numBuffersQueued > 0) && (numBuffersQueued >= s_numBuffersToQueueBeforeKick);
+        for(uint32_t i = 0; i < numBuffersQueued; ++i)
+        {
+            shouldKick |= s_dmaChannels[(s_nextBufferIrq + i) % kNumBuffers].m_isFinal;
+        }
+        if(shouldKick)
+        {
+            DAC_OUTPUT_IRQ_LOG_INFO(DacOutputSynchronisation, "Flush Kick %d\n", s_nextBufferIrq);
+            endUnderrun();
+            configurePioAndStartDma(s_dmaChannels[s_nextBufferIrq]);
+            s_dmaIsRunning = true;
+            s_numBuffersToQueueBeforeKick = 1; // Don't wait anymore for multiple buffers to be filled
+        }
+    }
+    return hasRetired;
+}
+
+void DacOutput::retireDma()
+{
     // This DMA channel has completed.
     // Prevent it from running again until we enable it
+    DmaChannel& dmaChannel = s_dmaChannels[s_nextBufferIrq];
+    dma_hw->intr = 1u << dmaChannel.m_channelIdx;
     dmaChannel.Disable();
-    assert(!dmaChannel.m_complete);
 
-    mutex_enter_blocking(&s_dmaMutex);
     bool makeIdle = false;
     if(dmaChannel.m_isFinal)
     {
-        dmaChannel.m_isFinal = false;
         s_frameDurationUs = time_us_64() - s_frameStartUs;
         s_frameStartUs = 0;
+        Telemetry::EndDmaFrame((uint32_t)s_frameDurationUs);
         makeIdle = true;
     }
 
     const uint32_t completedBufferIdx = s_nextBufferIrq;
     s_nextBufferIrq = (s_nextBufferIrq + 1) % kNumBuffers;
 
-    if((--s_numDmaChannelsQueued > 0))
+    // Handing the buffer back allows it to be refilled
+    __dmb();
+    s_numBuffersRetired = s_numBuffersRetired + 1;
+
+    if(getNumBuffersQueued() > 0)
     {
         // There are more buffers queued.  Let's look at the next one...
         DmaChannel& nextDmaChannel = s_dmaChannels[s_nextBufferIrq];
@@ -295,37 +448,44 @@ void DacOutput::checkDmaStatus()
             // There's a change in PIO SM program, so the next buffer is currently
             // disabled.  We can kick it off now though.
             assert(!nextDmaChannel.IsEnabled());
-            LOG_INFO(DacOutputSynchronisation, "Kick %d\n", s_nextBufferIrq);
+            DAC_OUTPUT_IRQ_LOG_INFO(DacOutputSynchronisation, "Kick %d\n", s_nextBufferIrq);
             configurePioAndStartDma(nextDmaChannel);
             makeIdle = false;
         }
         else
         {
-            // The next buffer is already enabled (chained), so we don't need
-            // to do anything
-            assert(nextDmaChannel.IsEnabled());
-            LOG_INFO(DacOutputSynchronisation, "Chained %d->%d\n", completedBufferIdx, s_nextBufferIrq);
+            // The next buffer is chained, so Flush enables it, and the DMA
+            // will start it without any help from us.  That might not
+            // have happened quite yet though.
+            DAC_OUTPUT_IRQ_LOG_INFO(DacOutputSynchronisation, "Chained %d->%d\n", completedBufferIdx, s_nextBufferIrq);
         }
     }
     else
     {
         // There are no more buffers queued, so the DMA has been drained.
         // It will be restarted at the next Flush
-        LOG_INFO(DacOutputSynchronisation, "Drained %d\n", completedBufferIdx);
+        DAC_OUTPUT_IRQ_LOG_INFO(DacOutputSynchronisation, "Drained %d\n", completedBufferIdx);
         s_dmaIsRunning = false;
+        if(!dmaChannel.m_isFinal)
+        {
+            // ...which is too soon
+            beginUnderrun();
+        }
     }
 
     if(makeIdle)
     {
         // Activate the idle SM
-        LOG_INFO(DacOutputSynchronisation, "Setting idle\n");
+        DAC_OUTPUT_IRQ_LOG_INFO(DacOutputSynchronisation, "Setting idle\n");
         setActivePioSm(*s_idlePioSmConfig);
         s_numBuffersToQueueBeforeKick = kNumBuffers - 1;
     }
-    
-    // Marking this channel as complete allows its buffer to be refilled
-    dmaChannel.m_complete = true;
-    mutex_exit(&s_dmaMutex);
+}
+
+void DacOutput::dmaIrqHandler()
+{
+    // Each buffer's interrupt is acknowledged as it's retired
+    checkDmaStatus();
 }
 
 void DacOutput::Poll()
@@ -333,11 +493,88 @@ void DacOutput::Poll()
     checkDmaStatus();
 }
 
+void DacOutput::configurePioAndStartDma(DmaChannel& dmaChannel)
+{
+    if(s_frameStartUs == 0)
+    {
+        s_frameStartUs = time_us_64();
+    }
+    if(dmaChannel.m_pDacOutputPioSmConfigToSet != nullptr)
+    {
+        setActivePioSm(*dmaChannel.m_pDacOutputPioSmConfigToSet);
+    }
+    dmaChannel.Enable();
+}
+
+#endif // !DAC_OUTPUT_RING_DMA
+
+void DacOutput::SetWaitCallback(WaitCallback waitCallback, void* userData)
+{
+    s_waitCallback = waitCallback;
+    s_waitCallbackUserData = userData;
+}
+
+void DacOutput::beginUnderrun()
+{
+    s_underrunStartUs = time_us_64();
+    const uint32_t producerItem = s_producerItem;
+    s_underrunStats.lastStage = (ProducerStage)(producerItem >> 24);
+    s_underrunStats.lastItemIdx = producerItem & 0xffffff;
+    ++s_underrunStats.numUnderruns;
+    // No logging here, because this can be in the IRQ handler.  The stats
+    // are reported from the main loop instead.
+}
+
+void DacOutput::endUnderrun()
+{
+    if(s_underrunStartUs != 0)
+    {
+        const uint32_t starvedUs = (uint32_t)(time_us_64() - s_underrunStartUs);
+        s_underrunStartUs = 0;
+        s_underrunStats.totalStarvedUs += starvedUs;
+        if(starvedUs > s_underrunStats.longestStarvedUs)
+        {
+            s_underrunStats.longestStarvedUs = starvedUs;
+        }
+        Telemetry::AddStarvedUs(starvedUs);
+    }
+}
+
+const char* DacOutput::GetProducerStageName(ProducerStage stage)
+{
+    switch(stage)
+    {
+    case ProducerStage::eNone:         return "nothing";
+    case ProducerStage::ePoints:       return "points";
+    case ProducerStage::eRaster:       return "raster";
+    case ProducerStage::eSegments:     return "segments";
+    case ProducerStage::ePreGenerated: return "pre-generated vectors";
+    case ProducerStage::eVectors:      return "vectors";
+    case ProducerStage::eReplay:       return "replay";
+    }
+    return "?";
+}
+
+void DacOutput::waitForDma()
+{
+#if !DAC_OUTPUT_DMA_IRQ
+    checkDmaStatus();
+#endif
+    if(s_waitCallback != nullptr)
+    {
+        s_waitCallback(s_waitCallbackUserData);
+    }
+    else
+    {
+        tight_loop_contents();
+    }
+}
+
 void DacOutput::setActivePioSm(const DacOutputPioSmConfig& config)
 {
     if(s_activePioSmConfig != &config)
     {
-        LOG_INFO(DacOutputSynchronisation, "Switch SM: %d\n", config.m_id);
+        DAC_OUTPUT_IRQ_LOG_INFO(DacOutputSynchronisation, "Switch SM: %d\n", config.m_id);
         if(s_activePioSmConfig != nullptr)
         {
             // Wait for the current PIO SM to drain its FIFO
@@ -352,23 +589,11 @@ void DacOutput::setActivePioSm(const DacOutputPioSmConfig& config)
         // Turn on the new PIO SM
         config.SetEnabled(true);
         s_activePioSmConfig = &config;
+        Telemetry::CountPioSwitch();
         //LOG_INFO(DacOutputSynchronisation, "Done Switch SM: %d\n", config.m_id);
     }
 }
 
-void DacOutput::configurePioAndStartDma(DmaChannel& dmaChannel)
-{
-    if(s_frameStartUs == 0)
-    {
-        s_frameStartUs = time_us_64();
-    }
-    if(dmaChannel.m_pDacOutputPioSmConfigToSet != nullptr)
-    {
-        setActivePioSm(*dmaChannel.m_pDacOutputPioSmConfigToSet);
-    }
-    dmaChannel.Enable();
-}
-
 void DacOutput::SetCurrentPioSm(const DacOutputPioSmConfig& config)
 {
     if(s_currentPioConfig == &config)
@@ -376,6 +601,7 @@ void DacOutput::SetCurrentPioSm(const DacOutputPioSmConfig& config)
         // No change.  Don't do anything
         return;
     }
-    Flush();
+    // The next AllocateBufferSpace waits for the next buffer, if it needs to
+    FlushWithoutWaiting();
     s_currentPioConfig = &config;
 }
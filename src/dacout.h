@@ -28,9 +28,58 @@
 #include "hardware/dma.h"
 #include <cstdint>
 
+// The number and size of the output buffers can be set per application, by
+// defining these in its CMakeLists.txt with target_compile_definitions.
+// The buffers take DAC_OUTPUT_NUM_BUFFERS * DAC_OUTPUT_ENTRIES_PER_BUFFER * 4
+// bytes of RAM, which is 48KB with the defaults.  More buffers let more of the
+// frame be queued up ahead of the DMA, which helps raster-heavy scenes, and
+// a whole frame that fits in the buffers can be replayed without regenerating
+// it.  Bigger buffers also allow longer vectors, up to kMaxStepsPerVector.
+#if !defined(DAC_OUTPUT_NUM_BUFFERS)
+#define DAC_OUTPUT_NUM_BUFFERS 3
+#endif
+#if !defined(DAC_OUTPUT_ENTRIES_PER_BUFFER)
+#define DAC_OUTPUT_ENTRIES_PER_BUFFER 4096
+#endif
+
+// When this is 1, finished DMA buffers are retired by the DMA_IRQ_0 handler,
+// so the next buffer (and any change of PIO SM program) is started as soon
+// as the previous one finishes, without anyone needing to poll.
+// Set it to 0 to go back to polling, from AllocateBufferSpace, Flush and Poll.
+#if !defined(DAC_OUTPUT_DMA_IRQ)
+#define DAC_OUTPUT_DMA_IRQ 1
+#endif
+
+// For logging from anything that can be called from the DMA IRQ handler.
+// The log takes a mutex that the interrupted code could be holding, so
+// these do nothing unless DacOutput is polled (DAC_OUTPUT_DMA_IRQ is 0).
+#if DAC_OUTPUT_DMA_IRQ
+#define DAC_OUTPUT_IRQ_LOG_INFO(...) if(false) LOG_INFO(__VA_ARGS__)
+#else
+#define DAC_OUTPUT_IRQ_LOG_INFO(...) LOG_INFO(__VA_ARGS__)
+#endif
+
+// When this is 1, the output goes through a single ring buffer instead of
+// DAC_OUTPUT_NUM_BUFFERS separate buffers (see dacoutring.cpp).  The DMA wraps
+// its read address around the ring, so it only needs one DMA channel, and
+// the producer only ever waits for as much space as it's asking for.
+// DAC_OUTPUT_ENTRIES_PER_BUFFER is then the most that's sent in one go.
+// DAC_OUTPUT_RING_ENTRIES must be a power of two, no more than 8192.
+// The ring takes (DAC_OUTPUT_RING_ENTRIES + DAC_OUTPUT_ENTRIES_PER_BUFFER) * 4
+// bytes, and it's aligned to DAC_OUTPUT_RING_ENTRIES * 4 bytes, so there can
+// be up to that much padding before it too, which is 32KB with the defaults.
+#if !defined(DAC_OUTPUT_RING_DMA)
+#define DAC_OUTPUT_RING_DMA 0
+#endif
+#if !defined(DAC_OUTPUT_RING_ENTRIES)
+#define DAC_OUTPUT_RING_ENTRIES 8192
+#endif
+
 class DacOutput
 {
 public:
+    // This needs to be called on the core that does the output, because
+    // that's the core that will handle the DMA interrupts.
     static void Init(const DacOutputPioSmConfig& idleSm);
 
     // Try to allocate some entries in the FIFO.
@@ -39,7 +88,7 @@ public:
     {
         uint32_t* pBufferSpace;
         // Do we have room in the current buffer?
-        const uint32_t numEntriesAvailable = (kNumEntriesPerBuffer - s_currentEntryIdx);
+        const uint32_t numEntriesAvailable = (s_currentBufferSize - s_currentEntryIdx);
         if (numEntriesAvailable >= numEntriesRequested)
         {
             // Yes we do.  Happy days!
@@ -56,9 +105,14 @@ public:
             Flush();
             outNumEntriesAllocated = (numEntriesRequested > kNumEntriesPerBuffer) ? kNumEntriesPerBuffer : numEntriesRequested;
         }
-        pBufferSpace = s_buffers[s_currentBufferIdx] + s_currentEntryIdx;
+        pBufferSpace = currentBuffer() + s_currentEntryIdx;
+#if DAC_OUTPUT_RING_DMA
+        waitForRingSpace(outNumEntriesAllocated);
+#endif
         s_currentEntryIdx += outNumEntriesAllocated;
+#if !DAC_OUTPUT_DMA_IRQ
         checkDmaStatus();
+#endif
         return pBufferSpace;
     }
 
@@ -68,12 +122,29 @@ public:
     static inline uint32_t* AllocateBufferSpace(uint32_t numEntries)
     {
         // Do we have room in the current buffer?
-        if (numEntries > (kNumEntriesPerBuffer - s_currentEntryIdx))
+        if (numEntries > (s_currentBufferSize - s_currentEntryIdx))
         {
             // Let's move to the next buffer
             Flush();
         }
-        uint32_t* pBufferSpace = s_buffers[s_currentBufferIdx] + s_currentEntryIdx;
+        uint32_t* pBufferSpace = currentBuffer() + s_currentEntryIdx;
+#if DAC_OUTPUT_RING_DMA
+        waitForRingSpace(numEntries);
+#endif
+        s_currentEntryIdx += numEntries;
+        return pBufferSpace;
+    }
+
+    // Like the one above, but rather than waiting for the DMA to free up
+    // some space, it returns nullptr straight away.  So the caller can get on
+    // with something else useful in the meantime, and try again later.
+    static inline uint32_t* TryAllocateBufferSpace(uint32_t numEntries)
+    {
+        if (!hasSpaceFor(numEntries) && !tryMakeSpace(numEntries))
+        {
+            return nullptr;
+        }
+        uint32_t* pBufferSpace = currentBuffer() + s_currentEntryIdx;
         s_currentEntryIdx += numEntries;
         return pBufferSpace;
     }
@@ -91,8 +162,32 @@ public:
     // for an entire frame, to make sure that the last bits of data in
     // the FIFOs don't wait until their buffers are full when the next frame
     // comes along.
+    // Once it's handed the data over, this waits for the DMA to finish with
+    // the next buffer, so that it's ready to be filled in.
     static void Flush(bool finalFlushForFrame = false);
 
+    // The same as Flush, except that it doesn't wait for the next buffer.
+    // The next AllocateBufferSpace waits for it instead, if it needs to.
+    // With DAC_OUTPUT_RING_DMA, it only waits if there are a lot of tiny
+    // flushes queued up.
+    static void FlushWithoutWaiting(bool finalFlushForFrame = false);
+
+    // While DacOutput is waiting for the DMA, it calls this over and over
+    // until it's done, instead of just spinning.  It's called on the output
+    // core, and mustn't use DacOutput itself.  nullptr turns it off.
+    typedef void (*WaitCallback)(void* userData);
+    static void SetWaitCallback(WaitCallback waitCallback, void* userData);
+
+    // The buffers used by the most recent frame are remembered, so if the next
+    // frame is identical then it can be replayed without regenerating it.
+    // That's only possible if the whole frame fitted in kNumBuffers buffers.
+    static bool CanReplayPreviousFrame() { return s_numPreviousFrameChunks > 0; }
+    static void ReplayPreviousFrame();
+
+    // Stop the next frame from being replayed, because something other than
+    // the DisplayList has been sent since.
+    static void ForgetPreviousFrame() { s_numPreviousFrameChunks = 0; }
+
     // Change the PIO SM program that we're using.
     // Subsequent data put into the FIFO will use this program.
     static void SetCurrentPioSm(const DacOutputPioSmConfig& config);
@@ -100,13 +195,67 @@ public:
     // For stats.  How much time was spent with active DMA.
     static uint64_t GetFrameDurationUs() {return s_frameDurationUs;}
 
+    // What the producer is in the middle of generating, so that an underrun
+    // can be blamed on it.
+    enum class ProducerStage : uint8_t
+    {
+        eNone,
+        ePoints,       //< The item is the index of the first point in the batch
+        eRaster,       //< The item is the scanline
+        eSegments,
+        ePreGenerated,
+        eVectors,
+        eReplay,
+    };
+    static inline void SetProducerItem(ProducerStage stage, uint32_t itemIdx)
+    {
+        // All in one word, so the IRQ handler never sees half of it
+        s_producerItem = ((uint32_t)stage << 24) | (itemIdx & 0xffffff);
+    }
+    static const char* GetProducerStageName(ProducerStage stage);
+
+    // An underrun is when the DMA runs out of data in the middle of a frame,
+    // because the producer has fallen behind.  The beam sits still until it
+    // catches up, which shows up as a bright dot.
+    struct UnderrunStats
+    {
+        uint32_t      numUnderruns     = 0;
+        uint64_t      totalStarvedUs   = 0;
+        uint32_t      longestStarvedUs = 0;
+        // What the producer was generating when the most recent one started
+        ProducerStage lastStage        = ProducerStage::eNone;
+        uint32_t      lastItemIdx      = 0;
+    };
+    static const UnderrunStats& GetUnderrunStats() { return s_underrunStats; }
+
     // After the frame's final Flush, this should be called frequently
-    // to enable the remaining pending buffers to be sent to the DACs
+    // to enable the remaining pending buffers to be sent to the DACs.
+    // Unless DAC_OUTPUT_DMA_IRQ is set, in which case it isn't needed.
     static void Poll();
 
-    constexpr static uint32_t kNumEntriesPerBuffer = 4096;
+    constexpr static uint32_t kNumEntriesPerBuffer = DAC_OUTPUT_ENTRIES_PER_BUFFER;
+    constexpr static uint32_t kNumBuffers = DAC_OUTPUT_NUM_BUFFERS;
+
+    // A vector's steps have to fit in one buffer, along with a nominal
+    // allowance for its pre and post steps.  And DisplayList only has 14 bits
+    // for the step count.
+    constexpr static uint32_t kMaxStepsPerVector
+        = ((kNumEntriesPerBuffer - 32) < 0x3fff) ? (kNumEntriesPerBuffer - 32) : 0x3fff;
+
+    // Each buffer uses two DMA channels, and there's one more for the chain
+    // spinning, out of the 12 that the RP2040 has.
+    static_assert((kNumBuffers >= 2) && (kNumBuffers <= 5), "DAC_OUTPUT_NUM_BUFFERS must be from 2 to 5");
+    static_assert(kNumEntriesPerBuffer >= 256, "DAC_OUTPUT_ENTRIES_PER_BUFFER must be at least 256");
+
+#if DAC_OUTPUT_RING_DMA
+    constexpr static uint32_t kNumRingEntries = DAC_OUTPUT_RING_ENTRIES;
+    // The DMA can only wrap reads within 32KB
+    static_assert(((kNumRingEntries & (kNumRingEntries - 1)) == 0) && (kNumRingEntries <= 8192),
+                  "DAC_OUTPUT_RING_ENTRIES must be a power of two, no more than 8192");
+    static_assert(kNumEntriesPerBuffer < (kNumRingEntries - 1), "DAC_OUTPUT_ENTRIES_PER_BUFFER must be smaller than the ring");
+#endif
+
 private:
-    constexpr static uint32_t kNumBuffers = 3;
 
     // We have one DmaChannel per buffer, but each one uses two actual
     // DMA channels in order to allow chaining.
@@ -124,7 +273,6 @@ private:
         dma_channel_config m_chainSpinSpinConfig;
         // If the live one is this config, then we'll chain to the actual buffer DMA
         dma_channel_config m_chainSpinEnableConfig;
-        volatile bool m_complete;
         bool m_isFinal;
 
         void Init(uint32_t* pBufferBase, const DmaChannel& chainTo);
@@ -145,10 +293,65 @@ private:
     };
     friend struct DmaChannel;
 
+    // Each Flush sends one buffer to the DACs.  This is what's needed to send it again.
+    struct FrameChunk
+    {
+        uint32_t                    m_bufferIdx;
+        uint32_t                    m_numEntries;
+        const DacOutputPioSmConfig* m_pPioConfig;
+    };
+
 private:
+#if DAC_OUTPUT_RING_DMA
+    // s_currentBufferIdx is where the current chunk starts in the ring.
+    // A chunk can run off the end of the ring, into the extra entries after
+    // it.  Those are copied back to the start of the ring when it's flushed.
+    static uint32_t* currentBuffer() { return s_ring + s_currentBufferIdx; }
+
+    static uint32_t getNumRingEntriesFree()
+    {
+        // The DMA's read address is always at the oldest entry that hasn't been sent
+        const uint32_t readIdx = (uint32_t)((const uint32_t*)dma_hw->ch[s_ringDmaChannelIdx].read_addr - s_ring);
+        const uint32_t numEntriesUsed = (s_currentBufferIdx + s_currentEntryIdx - readIdx) & (kNumRingEntries - 1);
+        // One entry is always left free, so that a full ring doesn't look empty
+        return kNumRingEntries - 1 - numEntriesUsed;
+    }
+    static bool hasSpaceFor(uint32_t numEntries)
+    {
+        return (numEntries <= (s_currentBufferSize - s_currentEntryIdx)) && (getNumRingEntriesFree() >= numEntries);
+    }
+    static inline void waitForRingSpace(uint32_t numEntries)
+    {
+        if (getNumRingEntriesFree() < numEntries)
+        {
+            waitForRingSpaceSlow(numEntries);
+        }
+    }
+    static void waitForRingSpaceSlow(uint32_t numEntries);
+#else
+    static uint32_t* currentBuffer() { return s_buffers[s_currentBufferIdx]; }
+    static bool hasSpaceFor(uint32_t numEntries) { return numEntries <= (s_currentBufferSize - s_currentEntryIdx); }
+    // Returns true if the current buffer is free to be filled in
+    static bool tryAcquireBuffer();
+#endif
+    // Flushes if it needs to, and returns true if there's now space for
+    // numEntries, but never waits for the DMA
+    static bool tryMakeSpace(uint32_t numEntries);
+    static void waitForDma();
+
+    // Called by checkDmaStatus when the DMA runs dry mid-frame, and when it's
+    // restarted
+    static void beginUnderrun();
+    static void endUnderrun();
+
     static void setActivePioSm(const DacOutputPioSmConfig& config);
     static void configurePioAndStartDma(DmaChannel& previousDmaChannel);
-    static void checkDmaStatus();
+    // Returns true if a buffer had finished, and has been retired
+    static bool checkDmaStatus();
+    static void retireDma();
+    static void dmaIrqHandler();
+
+    static uint32_t getNumBuffersQueued() { return s_numBuffersFlushed - s_numBuffersRetired; }
 
 private:
     static const DacOutputPioSmConfig* s_currentPioConfig;
@@ -160,9 +363,27 @@ private:
     static uint32_t     s_buffers[kNumBuffers][kNumEntriesPerBuffer];
     static uint32_t     s_currentBufferIdx;
     static uint32_t     s_currentEntryIdx;
+    // How many entries the current buffer can take.  This is 0 after
+    // FlushWithoutWaiting, until the DMA has finished with the buffer.
+    static uint32_t     s_currentBufferSize;
     static const DacOutputPioSmConfig* s_idlePioSmConfig;
     static uint32_t     s_nextBufferIrq;
-    static volatile uint32_t s_numDmaChannelsQueued;
+    // The buffers form a single-producer single-consumer ring.  Flush is the
+    // only thing that writes s_numBuffersFlushed, and checkDmaStatus is the
+    // only thing that writes s_numBuffersRetired, so they don't need a lock.
+    static volatile uint32_t s_numBuffersFlushed;
+    static volatile uint32_t s_numBuffersRetired;
     static uint64_t     s_frameStartUs;
+    static volatile uint32_t s_producerItem;
+    static UnderrunStats s_underrunStats;
+    static uint64_t     s_underrunStartUs;
     static uint64_t     s_frameDurationUs;
+    static FrameChunk   s_frameChunks[kNumBuffers];
+    static uint32_t     s_numFrameChunks;
+    static FrameChunk   s_previousFrameChunks[kNumBuffers];
+    static uint32_t     s_numPreviousFrameChunks;
+#if DAC_OUTPUT_RING_DMA
+    alignas(kNumRingEntries * sizeof(uint32_t)) static uint32_t s_ring[kNumRingEntries + kNumEntriesPerBuffer];
+    static int          s_ringDmaChannelIdx;
+#endif
 };
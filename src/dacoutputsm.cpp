@@ -19,14 +19,25 @@
 // oli.wright.github@gmail.com
 
 #include "dacoutputsm.h"
+#include "dacouttiming.h"
 #include "log.h"
 
-// The headers for each individual PIO program
+#include "hardware/gpio.h"
+
 #include "idle.pio.h"
 #include "vector.pio.h"
 #include "points.pio.h"
 #include "raster.pio.h"
 
+// When this is 1, DacOutputPioSm tries to keep all the programs loaded at once,
+// each on its own state machine, spread over both PIOs if need be.  Then
+// switching program is just a matter of switching state machine, rather than
+// reloading PIO instruction memory.  It falls back to loading them on demand
+// if they don't fit alongside whatever else the application has on the PIOs.
+#if !defined(DAC_OUTPUT_RESIDENT_PIO_PROGRAMS)
+#define DAC_OUTPUT_RESIDENT_PIO_PROGRAMS 1
+#endif
+
 DacOutputPioSmConfig DacOutputPioSm::s_configs[(int)DacOutputPioSm::SmID::eCount] = {};
 
 struct ProgramInfo
@@ -38,46 +49,27 @@ struct ProgramInfo
     uint16_t m_clockDivider;
 };
 static const ProgramInfo s_programInfo[] = {
-    {&idle_program,   idle_wrap_target,   idle_wrap,   2, 8},
-    {&vector_program, vector_wrap_target, vector_wrap, 3, 4},
-    {&points_program, points_wrap_target, points_wrap, 2, 32},
-    {&raster_program, raster_wrap_target, raster_wrap, 2, 1},
+    {&idle_program,   idle_wrap_target,   idle_wrap,   2, DacOutTiming::kIdleClockDivider},
+    {&vector_program, vector_wrap_target, vector_wrap, 3, DacOutTiming::kVectorClockDivider},
+    {&points_program, points_wrap_target, points_wrap, 2, DacOutTiming::kPointsClockDivider},
+    {&raster_program, raster_wrap_target, raster_wrap, 2, DacOutTiming::kRasterClockDivider},
 };
 
 static uint s_overloadedStateMachine;
 static uint s_overloadedProgramOffset = 0;
 
+// Which PIO the DAC and latch pins are currently connected to
+static PIO s_pinsPio = pio0;
+static constexpr uint32_t kDacOutPinMask = (((1u << kNumDacOutDacPins) - 1) << kDacOutBaseDacPin)
+                                         | (((1u << kNumDacOutLatchPins) - 1) << kDacOutBaseLatchPin);
+
+static LogChannel PioPrograms(true);
+
 void DacOutputPioSm::configureSm(SmID smID)
 {
     const ProgramInfo& programInfo = s_programInfo[(int)smID];
     DacOutputPioSmConfig& outConfig = s_configs[(int)smID];
 
-    outConfig.m_pio = pio0;
-    outConfig.m_pProgram = programInfo.m_pProgram;
-    outConfig.m_id = (uint32_t) smID;
-
-    if(smID == SmID::eIdle)
-    {
-        // Find a free state machine on our chosen PIO (erroring if there are
-        // none). Configure it to run our program, and start it, using the
-        // helper function we included in our .s_pio file.
-        outConfig.m_stateMachine = pio_claim_unused_sm(outConfig.m_pio, true);
-
-        // We're going to load the idle program at the top of PIO instruction memory
-        outConfig.m_programOffset = PIO_INSTRUCTION_COUNT - programInfo.m_pProgram->length;
-        pio_add_program_at_offset(outConfig.m_pio, outConfig.m_pProgram, outConfig.m_programOffset);
-        outConfig.m_overloaded = false;
-    }
-    else
-    {
-        // All other programs will be loaded on demand, at the beginning of PIO instruction memory
-        outConfig.m_stateMachine = s_overloadedStateMachine;
-        outConfig.m_programOffset = s_overloadedProgramOffset;
-        outConfig.m_overloaded = true;
-        assert(pio_can_add_program_at_offset(outConfig.m_pio, outConfig.m_pProgram, outConfig.m_programOffset));
-    }
-
-
     // Set the pin direction to output at the PIO
     pio_sm_set_consecutive_pindirs(outConfig.m_pio, outConfig.m_stateMachine, kDacOutBaseDacPin, kNumDacOutDacPins, true);
     pio_sm_set_consecutive_pindirs(outConfig.m_pio, outConfig.m_stateMachine, kDacOutBaseLatchPin, programInfo.m_numSidesetPins, true);
@@ -100,13 +92,105 @@ void DacOutputPioSm::configureSm(SmID smID)
     // The OSR register shifts to the right, disable auto-pull
     sm_config_set_out_shift(&outConfig.m_config, true, true, 0);
 
-    if(!outConfig.m_overloaded)
+    if(smID == SmID::eIdle)
     {
         // Load our configuration, and jump to the start of the program
         pio_sm_init(outConfig.m_pio, outConfig.m_stateMachine, outConfig.m_programOffset, &outConfig.m_config);
     }
 }
 
+void DacOutputPioSm::placeIdle()
+{
+    const ProgramInfo& programInfo = s_programInfo[(int)SmID::eIdle];
+    DacOutputPioSmConfig& outConfig = s_configs[(int)SmID::eIdle];
+
+    // Find a free state machine on our chosen PIO (erroring if there are
+    // none). Configure it to run our program, and start it, using the
+    // helper function we included in our .s_pio file.
+    outConfig.m_pio = pio0;
+    outConfig.m_stateMachine = pio_claim_unused_sm(outConfig.m_pio, true);
+
+    // We're going to load the idle program at the top of PIO instruction memory
+    outConfig.m_programOffset = PIO_INSTRUCTION_COUNT - programInfo.m_pProgram->length;
+    pio_add_program_at_offset(outConfig.m_pio, programInfo.m_pProgram, outConfig.m_programOffset);
+    outConfig.m_overloaded = false;
+}
+
+bool DacOutputPioSm::placeResident()
+{
+    // Biggest first, so that the small ones can fill in the gaps
+    SmID order[(int)SmID::eCount - 1];
+    uint32_t numPrograms = 0;
+    for(uint32_t i = (uint32_t)SmID::eVector; i < (uint32_t)SmID::eCount; ++i)
+    {
+        uint32_t insertIdx = numPrograms++;
+        while((insertIdx > 0) && (s_programInfo[(int)order[insertIdx - 1]].m_pProgram->length < s_programInfo[i].m_pProgram->length))
+        {
+            order[insertIdx] = order[insertIdx - 1];
+            --insertIdx;
+        }
+        order[insertIdx] = (SmID)i;
+    }
+
+    // Each one goes on the first PIO that has room for it, and a state machine to run it
+    static const PIO kPios[] = {pio0, pio1};
+    uint32_t numPlaced = 0;
+    for(; numPlaced < numPrograms; ++numPlaced)
+    {
+        const pio_program_t* pProgram = s_programInfo[(int)order[numPlaced]].m_pProgram;
+        DacOutputPioSmConfig& outConfig = s_configs[(int)order[numPlaced]];
+        bool isPlaced = false;
+        for(PIO pio : kPios)
+        {
+            if(pio_can_add_program(pio, pProgram))
+            {
+                const int stateMachine = pio_claim_unused_sm(pio, false);
+                if(stateMachine >= 0)
+                {
+                    outConfig.m_pio = pio;
+                    outConfig.m_stateMachine = (uint)stateMachine;
+                    outConfig.m_programOffset = pio_add_program(pio, pProgram);
+                    outConfig.m_overloaded = false;
+                    isPlaced = true;
+                    break;
+                }
+            }
+        }
+        if(!isPlaced)
+        {
+            break;
+        }
+    }
+
+    if(numPlaced < numPrograms)
+    {
+        // They don't all fit, so put everything back the way it was
+        while(numPlaced > 0)
+        {
+            const DacOutputPioSmConfig& config = s_configs[(int)order[--numPlaced]];
+            pio_remove_program(config.m_pio, s_programInfo[(int)order[numPlaced]].m_pProgram, config.m_programOffset);
+            pio_sm_unclaim(config.m_pio, config.m_stateMachine);
+        }
+        return false;
+    }
+    return true;
+}
+
+void DacOutputPioSm::placeOverloaded()
+{
+    // All other programs will be loaded on demand, at the beginning of PIO instruction memory
+    s_overloadedStateMachine = pio_claim_unused_sm(pio0, true);
+    for(uint32_t i = (uint32_t)SmID::eVector; i < (uint32_t)SmID::eCount; ++i)
+    {
+        DacOutputPioSmConfig& outConfig = s_configs[i];
+        outConfig.m_pio = pio0;
+        outConfig.m_stateMachine = s_overloadedStateMachine;
+        outConfig.m_programOffset = s_overloadedProgramOffset;
+        outConfig.m_overloaded = true;
+        assert(pio_can_add_program_at_offset(outConfig.m_pio, s_programInfo[i].m_pProgram, outConfig.m_programOffset));
+    }
+}
+
 void DacOutputPioSm::Init()
 {
     // Associate all the pins we're going to use with the PIO
@@ -120,11 +204,25 @@ void DacOutputPioSm::Init()
         pio_gpio_init(pio0, kDacOutBaseLatchPin + i);
         //pio_gpio_init(pio1, kDacOutBaseLatchPin + i);
     }
+    s_pinsPio = pio0;
 
-    s_overloadedStateMachine = pio_claim_unused_sm(pio0, true);
+    placeIdle();
+#if DAC_OUTPUT_RESIDENT_PIO_PROGRAMS
+    const bool isResident = placeResident();
+#else
+    const bool isResident = false;
+#endif
+    if(!isResident)
+    {
+        placeOverloaded();
+    }
+    LOG_INFO(PioPrograms, "PIO programs resident: %b\n", isResident);
 
     for(uint32_t i = 0; i < (uint32_t) SmID::eCount; ++i)
     {
+        DacOutputPioSmConfig& config = s_configs[i];
+        config.m_pProgram = s_programInfo[i].m_pProgram;
+        config.m_id = i;
         configureSm((SmID)i);
     }
 }
@@ -140,6 +238,21 @@ void DacOutputPioSmConfig::SetEnabled(bool enabled) const
             pio_add_program_at_offset(m_pio, m_pProgram, m_programOffset);
         }
         pio_sm_init(m_pio, m_stateMachine, m_programOffset, &m_config);
+        if(s_pinsPio != m_pio)
+        {
+            // Take the pins over from the other PIO at the levels they're already at,
+            // so that nothing gets latched on the way.
+            pio_sm_set_pins_with_mask(m_pio, m_stateMachine, gpio_get_all(), kDacOutPinMask);
+            const gpio_function function = (m_pio == pio0) ? GPIO_FUNC_PIO0 : GPIO_FUNC_PIO1;
+            for(uint pin = 0; pin < 32; ++pin)
+            {
+                if((kDacOutPinMask & (1u << pin)) != 0)
+                {
+                    gpio_set_function(pin, function);
+                }
+            }
+            s_pinsPio = m_pio;
+        }
         pio_sm_set_enabled(m_pio, m_stateMachine, true);
     }
     else
@@ -31,6 +31,9 @@ public:
     static const DacOutputPioSmConfig& Points() { return s_configs[(int) SmID::ePoints]; }
     static const DacOutputPioSmConfig& Raster() { return s_configs[(int) SmID::eRaster]; }
 
+    // From its DacOutputPioSmConfig::m_id, or null if there isn't one
+    static const DacOutputPioSmConfig* FromId(uint32_t id) { return (id < (uint32_t) SmID::eCount) ? &s_configs[id] : nullptr; }
+
 private:
     enum class SmID
     {
@@ -42,6 +45,11 @@ private:
         eCount
     };
 
+    // Deciding where each program lives in PIO instruction memory
+    static void placeIdle();
+    static bool placeResident();
+    static void placeOverloaded();
+
     static void configureSm(SmID smID);
 
 private:
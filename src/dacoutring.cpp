@@ -0,0 +1,330 @@
+// DacOutput's ring buffer backend, used when DAC_OUTPUT_RING_DMA is 1
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// Instead of a few separate buffers, each with their own DMA channels,
+// everything goes through one ring buffer with one DMA channel.  The DMA
+// wraps its read address around the ring in hardware, so the DMA's read
+// address is always the oldest entry that hasn't been sent yet, and the
+// producer only has to wait for as many entries as it's asking for.
+//
+// Each Flush queues up a chunk of the ring, along with the PIO SM program
+// it's for.  Consecutive chunks for the same program are sent in one DMA
+// transfer.  A change of program, or the end of the frame, waits for the
+// transfer before it to finish, just as it does with separate buffers.
+//
+// Frames can't be replayed, because the ring is constantly being reused.
+
+#include "log.h"
+#include "dacout.h"
+#include "framecapture.h"
+#include "telemetry.h"
+#include "pico/time.h"
+#include "pico/sync.h"
+#include "hardware/irq.h"
+
+#include <cstring>
+
+#if DAC_OUTPUT_RING_DMA
+
+alignas(DacOutput::kNumRingEntries * sizeof(uint32_t)) uint32_t DacOutput::s_ring[kNumRingEntries + kNumEntriesPerBuffer];
+int DacOutput::s_ringDmaChannelIdx = 0;
+
+// Each Flush queues up one of these
+struct RingChunk
+{
+    uint32_t                    m_numEntries;
+    const DacOutputPioSmConfig* m_pPioConfig;
+    bool                        m_isFinal;
+};
+static constexpr uint32_t kMaxRingChunks = 32;
+static RingChunk s_ringChunks[kMaxRingChunks];
+
+// Like the buffers in dacout.cpp, the chunks are a single-producer
+// single-consumer ring.  Flush is the only thing that writes s_numChunksFlushed,
+// and checkDmaStatus is the only thing that writes everything else.
+static volatile uint32_t s_numChunksFlushed = 0;
+static volatile uint32_t s_numChunksRetired = 0;
+static uint32_t s_numChunksStarted = 0;
+static volatile bool s_dmaIsRunning = false;
+static bool s_transferIsFinal = false;
+
+static bool isChunkQueueFull()
+{
+    return (s_numChunksFlushed - s_numChunksRetired) == kMaxRingChunks;
+}
+
+// At the start of a frame, this much is queued up before the DMA is started,
+// so it doesn't immediately run dry.  It has to leave room for a whole chunk
+// in the rest of the ring, otherwise the producer could be left waiting for
+// space that the DMA will never free up.
+static constexpr uint32_t kNumEntriesToQueueAtFrameStart
+    = ((DacOutput::kNumRingEntries / 2) < (DacOutput::kNumRingEntries - 1 - DacOutput::kNumEntriesPerBuffer))
+    ? (DacOutput::kNumRingEntries / 2) : (DacOutput::kNumRingEntries - 1 - DacOutput::kNumEntriesPerBuffer);
+static uint32_t s_numEntriesToQueueBeforeKick = kNumEntriesToQueueAtFrameStart;
+
+// The size of the ring in bytes, as a power of two, for the DMA's read address wrapping
+static constexpr uint kRingSizeBits = __builtin_ctz(DacOutput::kNumRingEntries * sizeof(uint32_t));
+
+static dma_channel_config s_ringDmaConfig;
+
+static LogChannel DacOutputSynchronisation(false);
+
+void DacOutput::Init(const DacOutputPioSmConfig& idleSm)
+{
+    s_idlePioSmConfig = &idleSm;
+
+    s_ringDmaChannelIdx = dma_claim_unused_channel(true);
+    s_ringDmaConfig = dma_channel_get_default_config(s_ringDmaChannelIdx);
+
+    // Transfer 32 bits each time
+    channel_config_set_transfer_data_size(&s_ringDmaConfig, DMA_SIZE_32);
+    // Increment read address
+    channel_config_set_read_increment(&s_ringDmaConfig, true);
+    // Write to the same address (the PIO SM TX FIFO)
+    channel_config_set_write_increment(&s_ringDmaConfig, false);
+    // Wrap the read address around the ring
+    channel_config_set_ring(&s_ringDmaConfig, false, kRingSizeBits);
+    dma_channel_set_irq0_enabled(s_ringDmaChannelIdx, false);
+
+    // Every transfer carries on reading from where the last one stopped
+    dma_channel_configure(s_ringDmaChannelIdx, &s_ringDmaConfig,
+                          nullptr, // The PIO TX FIFO is set for each transfer
+                          s_ring,
+                          0,
+                          false // don't start yet
+    );
+
+    // A transfer has finished when the channel's raw interrupt flag is set,
+    // whether or not the interrupt is enabled
+    dma_hw->intr = 1u << s_ringDmaChannelIdx;
+
+#if DAC_OUTPUT_DMA_IRQ
+    // Configure the processor to run dmaIrqHandler() when DMA IRQ 0 is asserted
+    dma_channel_set_irq0_enabled(s_ringDmaChannelIdx, true);
+    irq_set_exclusive_handler(DMA_IRQ_0, dmaIrqHandler);
+    irq_set_enabled(DMA_IRQ_0, true);
+#endif
+}
+
+void DacOutput::Flush(bool finalFlushForFrame)
+{
+    // There's no next buffer to wait for.  AllocateBufferSpace waits for
+    // as much of the ring as it needs.
+    FlushWithoutWaiting(finalFlushForFrame);
+}
+
+void DacOutput::FlushWithoutWaiting(bool finalFlushForFrame)
+{
+    if (s_currentEntryIdx == 0)
+    {
+        // Nothing to flush
+        if(finalFlushForFrame)
+        {
+            // But it's still the end of the frame
+            FrameCapture::RecordChunk(0, nullptr, 0, true);
+        }
+        return;
+    }
+    FrameCapture::RecordChunk(s_currentPioConfig->m_id, currentBuffer(), s_currentEntryIdx, finalFlushForFrame);
+
+    // Anything that ran off the end of the ring is copied back to the start,
+    // which is where the DMA will look for it.  That space was free when it
+    // was allocated.
+    const uint32_t endIdx = s_currentBufferIdx + s_currentEntryIdx;
+    if(endIdx > kNumRingEntries)
+    {
+        memcpy(s_ring, s_ring + kNumRingEntries, (endIdx - kNumRingEntries) * sizeof(uint32_t));
+    }
+
+    // Wait for room in the queue.  This is only likely if there are lots
+    // of tiny chunks.
+    if(isChunkQueueFull())
+    {
+        const uint64_t waitStartUs = time_us_64();
+        while(isChunkQueueFull())
+        {
+            waitForDma();
+        }
+        Telemetry::AddFlushWaitUs((uint32_t)(time_us_64() - waitStartUs));
+    }
+
+    //LOG_INFO(DacOutputSynchronisation, "Flush [%d, %d]\n", s_currentBufferIdx, s_currentEntryIdx);
+    RingChunk& chunk = s_ringChunks[s_numChunksFlushed % kMaxRingChunks];
+    chunk.m_numEntries = s_currentEntryIdx;
+    chunk.m_pPioConfig = s_currentPioConfig;
+    chunk.m_isFinal = finalFlushForFrame;
+
+    // Hand the chunk over to checkDmaStatus
+    __dmb();
+    s_numChunksFlushed = s_numChunksFlushed + 1;
+
+    if(!s_dmaIsRunning)
+    {
+        // checkDmaStatus needs to decide whether to start the DMA
+#if DAC_OUTPUT_DMA_IRQ
+        irq_set_pending(DMA_IRQ_0);
+#else
+        checkDmaStatus();
+#endif
+    }
+
+    // The next chunk carries on from the end of this one
+    s_currentBufferIdx = endIdx & (kNumRingEntries - 1);
+    s_currentEntryIdx = 0;
+}
+
+void DacOutput::waitForRingSpaceSlow(uint32_t numEntries)
+{
+    // The DMA frees up the space as it goes
+    const uint64_t waitStartUs = time_us_64();
+    while(getNumRingEntriesFree() < numEntries)
+    {
+        waitForDma();
+    }
+    Telemetry::AddFlushWaitUs((uint32_t)(time_us_64() - waitStartUs));
+}
+
+bool DacOutput::tryMakeSpace(uint32_t numEntries)
+{
+#if !DAC_OUTPUT_DMA_IRQ
+    checkDmaStatus();
+#endif
+    if(numEntries > (s_currentBufferSize - s_currentEntryIdx))
+    {
+        if(isChunkQueueFull())
+        {
+            return false;
+        }
+        FlushWithoutWaiting();
+    }
+    return getNumRingEntriesFree() >= numEntries;
+}
+
+void DacOutput::ReplayPreviousFrame()
+{
+    // s_numPreviousFrameChunks is always 0, so there's never anything to replay
+}
+
+bool DacOutput::checkDmaStatus()
+{
+    // This is the only place that transfers are retired or started.  It runs
+    // either from the DMA IRQ, or from polling on the same core as Flush, so
+    // it never runs concurrently with itself.
+    bool hasRetired = false;
+    bool hasFinishedFrame = false;
+    const uint32_t channelMask = 1u << s_ringDmaChannelIdx;
+    if(s_dmaIsRunning && ((dma_hw->intr & channelMask) != 0))
+    {
+        dma_hw->intr = channelMask;
+        if(s_transferIsFinal)
+        {
+            s_frameDurationUs = time_us_64() - s_frameStartUs;
+            s_frameStartUs = 0;
+            Telemetry::EndDmaFrame((uint32_t)s_frameDurationUs);
+            hasFinishedFrame = true;
+        }
+        // Handing the chunks back allows more to be queued
+        __dmb();
+        s_numChunksRetired = s_numChunksStarted;
+        s_dmaIsRunning = false;
+        hasRetired = true;
+    }
+    if(s_dmaIsRunning)
+    {
+        return hasRetired;
+    }
+
+    // See what's queued up
+    const uint32_t numChunksQueued = s_numChunksFlushed - s_numChunksStarted;
+    uint32_t numEntriesQueued = 0;
+    bool isFinalQueued = false;
+    for(uint32_t i = 0; i < numChunksQueued; ++i)
+    {
+        const RingChunk& chunk = s_ringChunks[(s_numChunksStarted + i) % kMaxRingChunks];
+        numEntriesQueued += chunk.m_numEntries;
+        isFinalQueued |= chunk.m_isFinal;
+    }
+
+    // Wait for enough to be queued up at the start of the frame,
+    // unless the whole frame has already been queued.
+    if((numChunksQueued > 0) && (isFinalQueued || (numEntriesQueued >= s_numEntriesToQueueBeforeKick)))
+    {
+        // Send as many chunks as we can in one go, as long as they're all
+        // for the same PIO SM program, and in the same frame.
+        const DacOutputPioSmConfig& pioConfig = *s_ringChunks[s_numChunksStarted % kMaxRingChunks].m_pPioConfig;
+        uint32_t numChunks = 0;
+        uint32_t numEntries = 0;
+        bool isFinal = false;
+        while((numChunks < numChunksQueued) && !isFinal)
+        {
+            const RingChunk& chunk = s_ringChunks[(s_numChunksStarted + numChunks) % kMaxRingChunks];
+            if(chunk.m_pPioConfig != &pioConfig)
+            {
+                break;
+            }
+            numEntries += chunk.m_numEntries;
+            isFinal = chunk.m_isFinal;
+            ++numChunks;
+        }
+
+        DAC_OUTPUT_IRQ_LOG_INFO(DacOutputSynchronisation, "Kick %d chunks, %d entries\n", numChunks, numEntries);
+        endUnderrun();
+        if(s_frameStartUs == 0)
+        {
+            s_frameStartUs = time_us_64();
+        }
+        setActivePioSm(pioConfig);
+        channel_config_set_dreq(&s_ringDmaConfig, pio_get_dreq(pioConfig.m_pio, pioConfig.m_stateMachine, true));
+        dma_channel_set_config(s_ringDmaChannelIdx, &s_ringDmaConfig, false);
+        dma_channel_set_write_addr(s_ringDmaChannelIdx, &(pioConfig.m_pio->txf[pioConfig.m_stateMachine]), false);
+        // The read address is already where the last transfer finished
+        dma_channel_set_trans_count(s_ringDmaChannelIdx, numEntries, true);
+
+        s_numChunksStarted += numChunks;
+        s_transferIsFinal = isFinal;
+        s_dmaIsRunning = true;
+        s_numEntriesToQueueBeforeKick = 0; // Don't wait anymore for the rest of the frame
+    }
+    else if(hasFinishedFrame)
+    {
+        // Activate the idle SM
+        DAC_OUTPUT_IRQ_LOG_INFO(DacOutputSynchronisation, "Setting idle\n");
+        setActivePioSm(*s_idlePioSmConfig);
+        s_numEntriesToQueueBeforeKick = kNumEntriesToQueueAtFrameStart;
+    }
+    else if(hasRetired)
+    {
+        // The DMA has run dry before the end of the frame
+        beginUnderrun();
+    }
+    return hasRetired;
+}
+
+void DacOutput::dmaIrqHandler()
+{
+    checkDmaStatus();
+}
+
+void DacOutput::Poll()
+{
+    checkDmaStatus();
+}
+
+#endif // DAC_OUTPUT_RING_DMA
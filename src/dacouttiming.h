@@ -0,0 +1,82 @@
+// How long the PIO programs take to send each word to the DACs
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// This is an internal header for picovectorscope.
+//
+// The clock dividers that the PIO programs run at, and how many PIO cycles
+// they spend on each word.  The cycle counts come from the .pio sources, so
+// if you change one of those, then change the numbers here too.
+// tools/piosim runs the programs and checks them against these numbers.
+
+#pragma once
+#include <cstdint>
+
+class DacOutTiming
+{
+public:
+    // We run at the SDK's default system clock
+    static constexpr uint32_t kSysClockHz = 125000000;
+    static constexpr uint32_t kSysCyclesPerUs = kSysClockHz / 1000000;
+
+    static constexpr uint32_t kIdleClockDivider   = 8;
+    static constexpr uint32_t kVectorClockDivider = 4;
+    static constexpr uint32_t kPointsClockDivider = 32;
+    static constexpr uint32_t kRasterClockDivider = 1;
+
+    // vector.pio: One step per word, plus a bit more if the Z value changes.
+    static constexpr uint32_t kVectorCyclesPerWord    = 8;
+    static constexpr uint32_t kVectorCyclesPerZChange = 4;
+
+    // points.pio: A fixed cost per point, and then the delay that's encoded in
+    // the top 8 bits of the word.  The delay loop runs one more time than the
+    // count, and is either short (2 cycles per loop) or long (16 cycles per
+    // loop, plus 1 to jump back to the start).
+    static constexpr uint32_t kPointsCyclesPerWord       = 11;
+    static constexpr uint32_t kPointsCyclesPerShortDelay = 2;
+    static constexpr uint32_t kPointsCyclesPerLongDelay  = 16;
+    static constexpr uint32_t kPointsCyclesLongDelayExit = 1;
+
+    // raster.pio: Each pixel is 8 cycles with no hold, or 6 cycles plus 6 per hold.
+    // Each scanline costs about another 32 cycles to move the beam down and back.
+    static constexpr uint32_t kRasterCyclesPerPixel    = 8;
+    static constexpr uint32_t kRasterCyclesPerHold     = 6;
+    static constexpr uint32_t kRasterCyclesPerScanline = 32;
+
+    // In system clock cycles
+    static constexpr uint32_t kSysCyclesPerVectorWord = kVectorCyclesPerWord * kVectorClockDivider;
+
+    // How many points.pio cycles a point takes, given the top 8 bits of its word
+    static constexpr uint32_t PointCycles(uint32_t delayBits)
+    {
+        return (delayBits & (1 << 24))
+                   ? (kPointsCyclesPerWord + (((delayBits >> 25) + 1) * kPointsCyclesPerLongDelay)
+                      + kPointsCyclesLongDelayExit)
+                   : (kPointsCyclesPerWord + (((delayBits >> 25) + 1) * kPointsCyclesPerShortDelay));
+    }
+
+    // How many raster.pio cycles a pixel takes
+    static constexpr uint32_t RasterPixelCycles(uint32_t hold)
+    {
+        return (hold == 0) ? kRasterCyclesPerPixel : (kRasterCyclesPerHold * (hold + 1));
+    }
+
+    static constexpr uint32_t SysCyclesToUs(uint32_t sysCycles) { return sysCycles / kSysCyclesPerUs; }
+    static constexpr uint32_t UsToSysCycles(uint32_t us) { return us * kSysCyclesPerUs; }
+};
@@ -33,15 +33,26 @@
 
 #include "dacout.h"
 #include "dacoutputsm.h"
+#include "dacouttiming.h"
 #include "log.h"
 #include "pico/assert.h"
+#include "stepreciprocal.h"
 
+#include <alloca.h>
 #include <cstdlib>
+#include <cstring>
 
 
 #define SPEED_CONSTANT 2048
 
 static const uint kMaxRasterDisplays = 4;
+static const uint kMaxSegments = 16;
+
+DisplayList::FrameReuseStats DisplayList::s_frameReuseStats = {};
+
+// The content hash of the most recent DisplayList to be output.
+// Zero if it couldn't be replayed.
+static uint32_t s_previousOutputContentHash = 0;
 
 static LogChannel DisplayListSynchronisation(false);
 static LogChannel RasterInfo(false);
@@ -68,7 +79,30 @@ DisplayList::DisplayList(uint32_t maxNumItems, uint32_t maxNumPoints)
       m_numDisplayListPoints(0),
       m_maxDisplayListPoints(maxNumPoints),
       m_rasterDisplays((RasterDisplay*)malloc(kMaxRasterDisplays * sizeof(RasterDisplay))),
-      m_numRasterDisplays(0)
+      m_rasterPriorities((Priority*)malloc(kMaxRasterDisplays * sizeof(Priority))),
+      m_numRasterDisplays(0),
+      m_segments((const DisplayListSegment**)malloc(kMaxSegments * sizeof(DisplayListSegment*))),
+      m_numSegments(0),
+      m_firstMergeableVectorIdx(1),
+      m_previousIntensity(0),
+      m_mergeRunDx(0),
+      m_mergeRunDy(0),
+      m_contentHash(kContentHashSeed),
+      m_isReplayable(true),
+      m_priority(Priority::eNormal),
+      m_isSortedByPriority(true),
+      m_pPreGeneratedWords(nullptr),
+      m_numPreGeneratedWords(0),
+      m_numPreGeneratedVectors(0),
+      m_numVectorWords(0),
+      m_numSegmentWords(0),
+      m_numPointCycles(0),
+      m_numRasterCycles(0),
+      m_frameBudgetStats(),
+      m_pScratchVectors(nullptr),
+      m_pScratchPoints(nullptr),
+      m_pBeamPathStrokes(nullptr),
+      m_beamPathStats()
 {
 #if !STEP_DIV_IN_DISPLAY_LIST
     static_assert(sizeof(Vector) == 6, "");
@@ -79,6 +113,7 @@ DisplayList::DisplayList(uint32_t maxNumItems, uint32_t maxNumPoints)
     vector.x        = 0.f;
     vector.y        = 0.f;
     vector.numSteps = 1;
+    vector.priority = (uint16_t)Priority::eCount;
 #if STEP_DIV_IN_DISPLAY_LIST
     vector.stepX = 0.f;
     vector.stepY = 0.f;
@@ -94,55 +129,321 @@ DisplayList::DisplayList(uint32_t maxNumItems, uint32_t maxNumPoints)
 static DisplayListVector2 s_calibrationScale(0.875f, 0.875f);
 static DisplayListVector2 s_calibrationBias(0.0625f, 0.0625f);
 
+// How far (in DAC units) the vertices of vectors that have been merged can
+// stray from the line that's drawn in their place.
+static constexpr int32_t kCollinearTolerance = 1;
+
+static inline int32_t toDacUnits(DisplayListScalar::IntermediateType v)
+{
+    return v.getStorage() >> (DisplayListScalar::kNumFractionalBits - 12);
+}
+
+// Whether a point can be merged into a run of vectors.  (runDx, runDy) is the
+// first segment of the run, (offsetX, offsetY) is the point relative to the start
+// of the run, and (dx, dy) is relative to the end of it.  All in DAC units.
+//
+// Every vertex of the run is kept within half the tolerance of the first segment's
+// line, and so is the new end.  So none of them can end up more than the tolerance
+// away from the line that's actually drawn, however long the run gets.
+static inline bool extendsMergeRun(int32_t runDx, int32_t runDy, int32_t offsetX, int32_t offsetY, int32_t dx, int32_t dy)
+{
+    const int32_t cross = (runDx * offsetY) - (runDy * offsetX);
+    const int32_t dot   = (runDx * dx) + (runDy * dy);
+    // |cross| / |run| is how far off the line we are.
+    // Chebyshev length is an under-estimate of |run|, so this errs on the safe side.
+    const int32_t runLength = (abs(runDx) > abs(runDy)) ? abs(runDx) : abs(runDy);
+    return (dot > 0) && ((2 * abs(cross)) <= (kCollinearTolerance * runLength));
+}
+
+DisplayListScalar::IntermediateType DisplayList::exactLength(DisplayListScalar::IntermediateType dx,
+                                                             DisplayListScalar::IntermediateType dy)
+{
+    return ((dx * dx) + (dy * dy)).sqrt();
+}
+
+// Alpha max plus beta min, taking the larger of two linear estimates so that
+// it stays accurate in all directions.
+// Measured error is within +/-1.2% (plus up to 2 LSBs of truncation), which is
+// plenty for a step count.  It's much cheaper than FixedPointSqrt, which loops over
+// the bits, and it's more accurate for short vectors, where dx * dx underflows.
+DisplayListScalar::IntermediateType DisplayList::approxLength(DisplayListScalar::IntermediateType dx,
+                                                              DisplayListScalar::IntermediateType dy)
+{
+    const int32_t absDx     = abs(dx.getStorage());
+    const int32_t absDy     = abs(dy.getStorage());
+    const int32_t maxAxis   = (absDx > absDy) ? absDx : absDy;
+    const int32_t minAxis   = (absDx > absDy) ? absDy : absDx;
+    const int32_t estimate0 = maxAxis + ((minAxis * 5) >> 5);
+    const int32_t estimate1 = ((maxAxis * 27) >> 5) + ((minAxis * 71) >> 7);
+    return DisplayListScalar::IntermediateType((estimate0 > estimate1) ? estimate0 : estimate1);
+}
+
+uint32_t DisplayList::calcNumSteps(Vector& vector, const Vector& previous, Intensity::IntermediateType intensitySquared)
+{
+    DisplayListScalar::IntermediateType dx = vector.x - previous.x;
+    DisplayListScalar::IntermediateType dy = vector.y - previous.y;
+
+#if FAST_VECTOR_LENGTH
+    Intensity::IntermediateType length = approxLength(dx, dy);
+#else
+    Intensity::IntermediateType length = exactLength(dx, dy);
+#endif
+    Intensity::IntermediateType time   = intensitySquared * length;
+
+    uint32_t numSteps = (time * SPEED_CONSTANT).getIntegerPart() + 1;
+    const uint32_t kMaxSteps = DacOutput::kMaxStepsPerVector; //< TODO: Make the pre and post step allowance more rigorous
+    vector.numSteps   = (numSteps > kMaxSteps) ? kMaxSteps : (uint16_t)numSteps;
+#if STEP_DIV_IN_DISPLAY_LIST
+    vector.stepX = divideBySteps(dx, vector.numSteps);
+    vector.stepY = divideBySteps(dy, vector.numSteps);
+#endif
+    return numSteps;
+}
+
 void DisplayList::PushVector(DisplayListScalar x, DisplayListScalar y, Intensity intensity)
 {
+    hashContent((uint16_t)x.getStorage() | ((uint32_t)(uint16_t)y.getStorage() << 16));
+    hashContent((uint16_t)intensity.getStorage());
+
+    if (m_numDisplayListVectors >= (m_maxDisplayListVectors - 2))
+    {
+        // Nearly full.  Make room if there's anything less important than this.
+        evictVectors();
+    }
+
+    const DisplayListScalar calibratedX = (x * s_calibrationScale.x) + s_calibrationBias.x;
+    const DisplayListScalar calibratedY = (y * s_calibrationScale.y) + s_calibrationBias.y;
+    Vector& previous = m_pDisplayListVectors[m_numDisplayListVectors - 1];
+    const int32_t dx = toDacUnits(calibratedX - previous.x);
+    const int32_t dy = toDacUnits(calibratedY - previous.y);
+    if ((dx == 0) && (dy == 0))
+    {
+        // Zero-length.  Whether it's a draw or a jump, it won't do anything.
+        return;
+    }
+
+    const bool samePriority = (previous.priority == (uint32_t)m_priority);
+    if (intensity > 0)
+    {
+        if ((intensity.getStorage() == m_previousIntensity.getStorage()) && samePriority
+            && (m_numDisplayListVectors > m_firstMergeableVectorIdx))
+        {
+            // The previous vector was drawn at the same intensity.  If this one
+            // carries on in the same direction, then we can just extend it.
+            const Vector& previousStart = m_pDisplayListVectors[m_numDisplayListVectors - 2];
+            if (extendsMergeRun(m_mergeRunDx, m_mergeRunDy, toDacUnits(calibratedX - previousStart.x),
+                                toDacUnits(calibratedY - previousStart.y), dx, dy))
+            {
+                Vector extended = previous;
+                extended.x      = calibratedX;
+                extended.y      = calibratedY;
+                const uint32_t numSteps = calcNumSteps(extended, previousStart, intensity * intensity);
+                if (numSteps == extended.numSteps)
+                {
+                    // Not clamped to the max number of steps, so the brightness
+                    // will be the same as drawing the two separately.
+                    m_numVectorWords += extended.numSteps - previous.numSteps;
+                    previous = extended;
+                    return;
+                }
+            }
+        }
+    }
+    else if ((m_previousIntensity <= 0) && samePriority && (m_numDisplayListVectors > m_firstMergeableVectorIdx))
+    {
+        // Back-to-back jumps.  Only the last one matters.
+        previous.x = calibratedX;
+        previous.y = calibratedY;
+#if STEP_DIV_IN_DISPLAY_LIST
+        const Vector& previousStart = m_pDisplayListVectors[m_numDisplayListVectors - 2];
+        previous.stepX = previous.x - previousStart.x;
+        previous.stepY = previous.y - previousStart.y;
+#endif
+        return;
+    }
+
+    if ((intensity > 0) && !samePriority && !startPriorityRun())
+    {
+        return;
+    }
     if (m_numDisplayListVectors >= (m_maxDisplayListVectors - 1)) // Leave space for the Terminator
     {
         return;
     }
+    if ((m_numDisplayListVectors > 1)
+        && ((uint32_t)m_priority < m_pDisplayListVectors[m_numDisplayListVectors - 1].priority))
+    {
+        m_isSortedByPriority = false;
+    }
     Vector&       vector                   = m_pDisplayListVectors[m_numDisplayListVectors++];
-    vector.x                               = (x * s_calibrationScale.x) + s_calibrationBias.x;
-    vector.y                               = (y * s_calibrationScale.y) + s_calibrationBias.y;
+    vector.x                               = calibratedX;
+    vector.y                               = calibratedY;
     vector.numSteps = 1;
+    vector.priority = (uint16_t)m_priority;
     if(intensity > 0)
     {
-        const Vector& previous                 = m_pDisplayListVectors[m_numDisplayListVectors - 2];
-        DisplayListScalar::IntermediateType dx = vector.x - previous.x;
-        DisplayListScalar::IntermediateType dy = vector.y - previous.y;
+        calcNumSteps(vector, previous, intensity * intensity);
+        m_mergeRunDx = dx;
+        m_mergeRunDy = dy;
+    }
+#if STEP_DIV_IN_DISPLAY_LIST
+    else
+    {
+        vector.stepX = vector.x - previous.x;
+        vector.stepY = vector.y - previous.y;
+    }
+#endif
+    m_numVectorWords += vector.numSteps;
+    m_previousIntensity = intensity;
+}
+
+void DisplayList::PushPolyline(const DisplayListVector2* points, uint32_t count, Intensity intensity, bool closed)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    // The jump goes through PushVector, so it gets combined with any jump before it
+    PushVector(points[0], 0);
+    if (intensity <= 0)
+    {
+        PushVector(points[closed ? 0 : (count - 1)], 0);
+        return;
+    }
 
-        Intensity::IntermediateType length = ((dx * dx) + (dy * dy)).sqrt();
-        Intensity::IntermediateType time   = intensity * intensity * length;
+    // The jump won't have been pushed if the beam was already there
+    if ((m_pDisplayListVectors[m_numDisplayListVectors - 1].priority != (uint32_t)m_priority) && !startPriorityRun())
+    {
+        return;
+    }
+
+    // Reserve the space up front, leaving room for the Terminator
+    const uint32_t numLines = closed ? count : (count - 1);
+    if ((m_maxDisplayListVectors - 1 - m_numDisplayListVectors) < numLines)
+    {
+        evictVectors();
+    }
+    const uint32_t numAvailable = m_maxDisplayListVectors - 1 - m_numDisplayListVectors;
+    const uint32_t numToPush    = (numLines > numAvailable) ? numAvailable : numLines;
 
-        uint32_t numSteps = (time * SPEED_CONSTANT).getIntegerPart() + 1;
-        const uint32_t kMaxSteps = DacOutput::kNumEntriesPerBuffer - 32; //< Minus nominal value for pre and post steps.
-                                                                         //  TODO: Make more rigorous
-        vector.numSteps   = (numSteps > kMaxSteps) ? kMaxSteps : (uint16_t)numSteps;
-    #if STEP_DIV_IN_DISPLAY_LIST
-        vector.stepX = DisplayListIntermediate(dx) / (int) vector.numSteps;
-        vector.stepY = DisplayListIntermediate(dy) / (int) vector.numSteps;
-    #endif
+    hashContent((uint16_t)intensity.getStorage() | (closed ? 0x10000 : 0));
+    const Intensity::IntermediateType intensitySquared = intensity * intensity;
+    Vector*       pPrevious = m_pDisplayListVectors + m_numDisplayListVectors - 1;
+    Vector*       pVector   = pPrevious + 1;
+    const Vector* pFirst    = pVector;
+    int32_t       runDx     = 0;
+    int32_t       runDy     = 0;
+    for (uint32_t i = 1; i <= numToPush; ++i)
+    {
+        const DisplayListVector2& point = points[(i == count) ? 0 : i];
+        hashContent((uint16_t)point.x.getStorage() | ((uint32_t)(uint16_t)point.y.getStorage() << 16));
+        pVector->x = (point.x * s_calibrationScale.x) + s_calibrationBias.x;
+        pVector->y = (point.y * s_calibrationScale.y) + s_calibrationBias.y;
+        pVector->priority = (uint16_t)m_priority;
+        const int32_t dx = toDacUnits(pVector->x - pPrevious->x);
+        const int32_t dy = toDacUnits(pVector->y - pPrevious->y);
+        if ((dx == 0) && (dy == 0))
+        {
+            // Zero-length.  Overwrite it with the next one.
+            continue;
+        }
+        if (pPrevious >= pFirst)
+        {
+            // If it carries on in the same direction as the line before it, then
+            // extend that instead, the same as PushVector does.
+            const Vector& previousStart = pPrevious[-1];
+            if (extendsMergeRun(runDx, runDy, toDacUnits(pVector->x - previousStart.x),
+                                toDacUnits(pVector->y - previousStart.y), dx, dy))
+            {
+                Vector extended = *pPrevious;
+                extended.x      = pVector->x;
+                extended.y      = pVector->y;
+                if (calcNumSteps(extended, previousStart, intensitySquared) == extended.numSteps)
+                {
+                    m_numVectorWords += extended.numSteps - pPrevious->numSteps;
+                    *pPrevious = extended;
+                    continue;
+                }
+            }
+        }
+        calcNumSteps(*pVector, *pPrevious, intensitySquared);
+        m_numVectorWords += pVector->numSteps;
+        runDx     = dx;
+        runDy     = dy;
+        pPrevious = pVector++;
+    }
+    m_numDisplayListVectors = pVector - m_pDisplayListVectors;
+    if (pVector != pFirst)
+    {
+        m_previousIntensity = intensity;
+        m_mergeRunDx        = runDx;
+        m_mergeRunDy        = runDy;
     }
 }
 
 void DisplayList::PushPoint(DisplayListScalar x, DisplayListScalar y, Intensity intensity)
 {
+    hashContent((uint16_t)x.getStorage() | ((uint32_t)(uint16_t)y.getStorage() << 16));
+    hashContent((uint16_t)intensity.getStorage() | 0x10000);
+    if (m_numDisplayListPoints >= m_maxDisplayListPoints)
+    {
+        evictPoints();
+    }
     if (m_numDisplayListPoints < m_maxDisplayListPoints)
     {
+        if ((m_numDisplayListPoints > 0) && (m_priority < m_pDisplayListPoints[m_numDisplayListPoints - 1].priority))
+        {
+            m_isSortedByPriority = false;
+        }
         Point& dst = m_pDisplayListPoints[m_numDisplayListPoints++];
+        dst.priority = m_priority;
         dst.x      = (x * s_calibrationScale.x) + s_calibrationBias.x;
         dst.y      = (y * s_calibrationScale.y) + s_calibrationBias.y;
 
         dst.brightness = intensity;
+        m_numPointCycles += pointCycles(pointDelayBits(intensity));
     }
 }
 
+// We don't know the holds until the callback gives us the pixels, so assume none
+static uint32_t rasterCycles(const DisplayList::RasterDisplay& rasterDisplay)
+{
+    const uint32_t scanlineCycles = DacOutTiming::kRasterCyclesPerScanline
+                                    + (rasterDisplay.width * DacOutTiming::kRasterCyclesPerPixel);
+    return rasterDisplay.height * scanlineCycles * DacOutTiming::kRasterClockDivider;
+}
+
 void DisplayList::PushRasterDisplay(const RasterDisplay& rasterDisplay)
 {
     if (m_numRasterDisplays >= kMaxRasterDisplays)
     {
-        return;
+        // Full.  Throw out the least important one, if it's less important than this.
+        if (m_rasterPriorities[m_numRasterDisplays - 1] <= m_priority)
+        {
+            return;
+        }
+        m_numRasterCycles -= rasterCycles(m_rasterDisplays[--m_numRasterDisplays]);
+    }
+    // Keep them in priority order as they're pushed
+    uint32_t idx = m_numRasterDisplays++;
+    for (; (idx > 0) && (m_rasterPriorities[idx - 1] > m_priority); --idx)
+    {
+        m_rasterDisplays[idx]   = m_rasterDisplays[idx - 1];
+        m_rasterPriorities[idx] = m_rasterPriorities[idx - 1];
     }
-    m_rasterDisplays[m_numRasterDisplays++] = rasterDisplay;
+    m_rasterDisplays[idx]   = rasterDisplay;
+    m_rasterPriorities[idx] = m_priority;
+    // Each scanline goes out in one DAC output buffer, as a word for every two
+    // pixels, plus one more.  Anything wider is cropped.
+    constexpr uint32_t kMaxWidth = (DacOutput::kNumEntriesPerBuffer - 1) * 2;
+    assert(rasterDisplay.width <= kMaxWidth);
+    if (rasterDisplay.width > kMaxWidth)
+    {
+        m_rasterDisplays[idx].width = kMaxWidth;
+    }
+    m_numRasterCycles += rasterCycles(m_rasterDisplays[idx]);
+    // We've no idea what the callback will give us
+    m_isReplayable = false;
 }
 
 void DisplayList::terminateVectors()
@@ -154,6 +455,7 @@ void DisplayList::terminateVectors()
     vector.x        = 0;
     vector.y        = 0;
     vector.numSteps = 1;
+    vector.priority = (uint16_t)Priority::eCount;
 #if STEP_DIV_IN_DISPLAY_LIST
     const Vector& previous = m_pDisplayListVectors[m_numDisplayListVectors - 2];
     vector.stepX           = vector.x - previous.x;
@@ -170,6 +472,7 @@ void DisplayList::terminatePoints()
     point.x          = 0;
     point.y          = 0;
     point.brightness = 0;
+    point.priority   = Priority::eCount;
 }
 
 void DisplayList::DebugDump() const
@@ -208,12 +511,413 @@ static inline uint32_t calcDacOutputValue(DisplayListIntermediate x, DisplayList
     return bitsX | (bitsY << 12); // The z value would take up the top 8 bits if we were using it | (255 << 24);
 }
 
+void DisplayList::generateWords(uint32_t first, uint32_t end, uint32_t* pOutput) const
+{
+    // The same stepping as OutputToDACs
+    DisplayListIntermediate x(0), y(0);
+    if (first > 0)
+    {
+        x = m_pDisplayListVectors[first - 1].x;
+        y = m_pDisplayListVectors[first - 1].y;
+    }
+    for (uint32_t i = first; i < end; ++i)
+    {
+        const Vector&  vector   = m_pDisplayListVectors[i];
+        const uint32_t numSteps = vector.numSteps;
+#if STEP_DIV_IN_DISPLAY_LIST
+        DisplayListIntermediate dx = vector.stepX;
+        DisplayListIntermediate dy = vector.stepY;
+#else
+        DisplayListIntermediate dx = DisplayListIntermediate(vector.x - x);
+        DisplayListIntermediate dy = DisplayListIntermediate(vector.y - y);
+        if (numSteps > 1)
+        {
+            dx = divideBySteps(dx, numSteps);
+            dy = divideBySteps(dy, numSteps);
+        }
+#endif
+        for (uint32_t step = 0; step < numSteps; ++step)
+        {
+            x += dx;
+            y += dy;
+            *(pOutput++) = calcDacOutputValue(x, y);
+        }
+        // Snap to the true end of the vector
+        x = vector.x;
+        y = vector.y;
+    }
+}
+
+// The top 8 bits of a point's DAC word, which set how long points.pio holds the beam there
+uint32_t DisplayList::pointDelayBits(Intensity brightness)
+{
+    // Get Z in terms of how many points.pio cycles do we want the point to be held
+    // for. The max time we can have is 2044 cycles, so let's go with 11-bits for
+    // now
+    int32_t cycles = (int32_t)(brightness * brightness).getStorage() >> (brightness.kNumFractionalBits - 11);
+    // Subtract the per-point constant
+    cycles -= DacOutTiming::PointCycles(0);
+    uint32_t bits = 0;
+    uint32_t bitsZ;
+    if (cycles > 254)
+    {
+        // We need to use the long delay loop to accomplish this length of delay
+        bits |= (1 << 24);
+
+        bitsZ = cycles >> 4;
+        if (bitsZ > 127)
+        {
+            bitsZ = 127;
+        }
+    }
+    else
+    {
+        // Short delay is good
+        bitsZ = (cycles < 0) ? 0 : (cycles >> 1);
+    }
+    return bits | (bitsZ << 25);
+}
+
+// How many points.pio cycles a point takes, given its delay bits
+uint32_t DisplayList::pointCycles(uint32_t delayBits)
+{
+    return DacOutTiming::PointCycles(delayBits);
+}
+
+static void calcRasterSteps(const DisplayList::RasterDisplay& rasterDisplay,
+                            DisplayListVector2&                outTopLeft,
+                            DisplayListIntermediate&           outDx,
+                            DisplayListIntermediate&           outDy)
+{
+    outTopLeft.x = (rasterDisplay.topLeft.x * s_calibrationScale.x) + s_calibrationBias.x;
+    outTopLeft.y = (rasterDisplay.topLeft.y * s_calibrationScale.y) + s_calibrationBias.y;
+    DisplayListVector2 bottomRight;
+    bottomRight.x = (rasterDisplay.bottomRight.x * s_calibrationScale.x) + s_calibrationBias.x;
+    bottomRight.y = (rasterDisplay.bottomRight.y * s_calibrationScale.y) + s_calibrationBias.y;
+    outDx = (bottomRight.x - outTopLeft.x) / (int)rasterDisplay.width;
+    outDy = (bottomRight.y - outTopLeft.y) / (int)rasterDisplay.height;
+}
+
+// Writes the raster.pio commands for one scanline, and returns the end of them.
+// There's space needed for ((width + 1) / 2) + 1 32-bit words.
+static uint16_t* encodeRasterScanline(const DisplayList::RasterDisplay& rasterDisplay,
+                                      uint32_t                          scanlineIdx,
+                                      DisplayListIntermediate           x,
+                                      DisplayListIntermediate           dx,
+                                      DisplayListIntermediate           y,
+                                      uint16_t*                         pOutput)
+{
+    typedef DisplayList::RasterDisplay RasterDisplay;
+    uint16_t* const pOutputStart = pOutput;
+    *(pOutput++)                 = 0;
+    *(pOutput++)                 = scalarTo12bit(y);
+
+    switch (rasterDisplay.mode)
+    {
+    case RasterDisplay::Mode::e1Bit:
+    {
+        const uint8_t* pixel
+            = rasterDisplay.scanlineCallback(scanlineIdx, rasterDisplay.userData);
+        const uint8_t* end      = pixel + ((rasterDisplay.width + 7 + rasterDisplay.horizontalScrollOffset) >> 3);
+        const uint16_t holdBits = 15 << 12;
+        uint bitStart = rasterDisplay.horizontalScrollOffset;
+        uint bytesWithoutOutput = 0;
+        for (; pixel != end; ++pixel)
+        {
+            uint8_t pixelBlock = *pixel;
+            ++bytesWithoutOutput;
+            for (uint bitIdx = bitStart; bitIdx < 8; ++bitIdx)
+            {
+                x += dx;
+                if ((pixelBlock & (0x80 >> bitIdx)) != 0)
+                {
+                    *(pOutput++) = scalarTo12bitNoWrap(x) | holdBits;
+                    bytesWithoutOutput = 0;
+                }
+            }
+            bitStart = 0;
+
+            if(bytesWithoutOutput == 2)
+            {
+                bytesWithoutOutput = 0;
+                *(pOutput++) = scalarTo12bitNoWrap(x);
+            }
+        }
+        break;
+    }
+
+    case RasterDisplay::Mode::e4BitLinear:
+    {
+        const uint8_t* pixel
+            = rasterDisplay.scanlineCallback(scanlineIdx, rasterDisplay.userData);
+        const uint8_t* end = pixel + rasterDisplay.width;
+        for (; pixel != end; ++pixel)
+        {
+            x += dx;
+            uint32_t hold = *pixel; // s_pixelToHold[*pixel];
+            if (hold != 0)
+            {
+                *(pOutput++) = scalarTo12bitNoWrap(x) | ((hold - 1) << 12);
+            }
+        }
+        break;
+    }
+
+    case RasterDisplay::Mode::e8BitGamma:
+    {
+        const uint8_t* pixel
+            = rasterDisplay.scanlineCallback(scanlineIdx, rasterDisplay.userData);
+        const uint8_t* end = pixel + rasterDisplay.width;
+        for (; pixel != end; ++pixel)
+        {
+            x += dx;
+            uint32_t hold = s_pixelToHold[*pixel];
+            if (hold != 0)
+            {
+                *(pOutput++) = scalarTo12bitNoWrap(x) | ((hold - 1) << 12);
+            }
+        }
+        break;
+    }
+    }
+
+    if ((pOutput - pOutputStart) & 1)
+    {
+        // We used an odd number.  Add an inert output to make it even.
+        *(pOutput++) = 1;
+    }
+    return pOutput;
+}
+
+// Somewhere to encode a scanline while OutputToDACs is waiting for the DMA.
+// That's enough for 510 pixels.
+static constexpr uint32_t kMaxScanlineScratchEntries = 256;
+static uint32_t s_scanlineScratch[kMaxScanlineScratchEntries];
+
+// How many raster.pio cycles the commands for a scanline take
+static uint32_t rasterScanlineCycles(const uint16_t* pCommand, const uint16_t* pEnd)
+{
+    uint32_t cycles = 0;
+    while (pCommand != pEnd)
+    {
+        const uint16_t command = *(pCommand++);
+        if (command == 0)
+        {
+            // Followed by the Y
+            cycles += DacOutTiming::kRasterCyclesPerScanline;
+            ++pCommand;
+        }
+        else
+        {
+            cycles += DacOutTiming::RasterPixelCycles(command >> 12);
+        }
+    }
+    return cycles;
+}
+
+// In system clock cycles
+uint32_t DisplayList::predictedBeamCycles() const
+{
+    return ((m_numVectorWords + m_numSegmentWords) * DacOutTiming::kSysCyclesPerVectorWord)
+           + (m_numPointCycles * DacOutTiming::kPointsClockDivider) + m_numRasterCycles;
+}
+
+uint32_t DisplayList::GetPredictedBeamTimeUs() const
+{
+    return DacOutTiming::SysCyclesToUs(predictedBeamCycles());
+}
+
+uint32_t DisplayList::EstimateFrameDurationUs() const
+{
+    // In system clock cycles
+    uint64_t cycles = 0;
+
+    if ((m_numDisplayListVectors > 1) || (m_numSegments > 0))
+    {
+        // Plus the jump back to the origin at the end, and the Z register
+        // starts off different to the Z in our words.
+        cycles += (uint64_t)(m_numVectorWords + m_numSegmentWords + 1) * DacOutTiming::kSysCyclesPerVectorWord;
+        cycles += DacOutTiming::kVectorCyclesPerZChange * DacOutTiming::kVectorClockDivider;
+    }
+
+    if (m_numDisplayListPoints > 0)
+    {
+        // Plus the point back at the origin at the end
+        cycles += (uint64_t)(m_numPointCycles + pointCycles(pointDelayBits(0)))
+                  * DacOutTiming::kPointsClockDivider;
+    }
+
+    // The rasters have to be generated to find out how many pixels there are,
+    // and how long they're held for.
+    for (uint32_t i = 0; i < m_numRasterDisplays; ++i)
+    {
+        const RasterDisplay&    rasterDisplay = m_rasterDisplays[i];
+        DisplayListVector2      topLeft;
+        DisplayListIntermediate dx, dy;
+        calcRasterSteps(rasterDisplay, topLeft, dx, dy);
+        DisplayListIntermediate y = topLeft.y;
+        uint16_t* pCommands = (uint16_t*)alloca((((rasterDisplay.width + 1) >> 1) + 1) * sizeof(uint32_t));
+        for (uint32_t scanlineIdx = 0; scanlineIdx < rasterDisplay.height; ++scanlineIdx)
+        {
+            const uint16_t* pCommandsEnd = encodeRasterScanline(rasterDisplay, scanlineIdx, topLeft.x, dx, y, pCommands);
+            cycles += rasterScanlineCycles(pCommands, pCommandsEnd) * DacOutTiming::kRasterClockDivider;
+            y += dy;
+        }
+    }
+
+    return DacOutTiming::SysCyclesToUs((uint32_t)cycles);
+}
+
+static void copyToDacOutput(const uint32_t* pWords, uint32_t numWords)
+{
+    while (numWords)
+    {
+        uint32_t  numWordsInBatch;
+        uint32_t* pOutput = DacOutput::AllocateBufferSpace(numWords, numWordsInBatch);
+        memcpy(pOutput, pWords, numWordsInBatch * sizeof(uint32_t));
+        pWords += numWordsInBatch;
+        numWords -= numWordsInBatch;
+    }
+}
+
+void DisplayList::PreGenerateVectors()
+{
+    m_numPreGeneratedVectors = 0;
+    sortByPriority();
+    if (m_pPreGeneratedWords == nullptr)
+    {
+        m_pPreGeneratedWords = (uint32_t*)malloc(kMaxPreGeneratedWords * sizeof(uint32_t));
+        if (m_pPreGeneratedWords == nullptr)
+        {
+            return;
+        }
+    }
+
+    // As many vectors as will fit.  OutputToDACs will do the rest.
+    uint32_t numVectors = 0;
+    uint32_t numWords   = 0;
+    while ((numVectors < m_numDisplayListVectors)
+           && ((numWords + m_pDisplayListVectors[numVectors].numSteps) <= kMaxPreGeneratedWords))
+    {
+        numWords += m_pDisplayListVectors[numVectors++].numSteps;
+    }
+    generateWords(0, numVectors, m_pPreGeneratedWords);
+    m_numPreGeneratedVectors = numVectors;
+    m_numPreGeneratedWords   = numWords;
+
+    // Don't let PushVector change what we've just generated
+    m_firstMergeableVectorIdx = m_numDisplayListVectors;
+}
+
+void DisplayList::BeginSegment()
+{
+    m_firstMergeableVectorIdx = m_numDisplayListVectors;
+}
+
+void DisplayList::EndSegment(DisplayListSegment& outSegment)
+{
+    const uint32_t segmentEnd = m_numDisplayListVectors;
+    // The segment starts from wherever the beam was when it began, unless
+    // it starts with a jump anyway.
+    uint32_t segmentStart = m_firstMergeableVectorIdx - 1;
+    if ((segmentStart + 1 < segmentEnd) && (m_pDisplayListVectors[segmentStart + 1].numSteps == 1))
+    {
+        ++segmentStart;
+    }
+
+    // A word for the jump to the start, and then a word for each step
+    uint32_t numWords = 1;
+    for (uint32_t i = segmentStart + 1; i < segmentEnd; ++i)
+    {
+        numWords += m_pDisplayListVectors[i].numSteps;
+    }
+
+    free(outSegment.m_pWords);
+    if (numWords == 1)
+    {
+        // Nothing was drawn, so there's nothing to record.  Any jump stays in
+        // the DisplayList as it is.
+        outSegment.m_pWords       = nullptr;
+        outSegment.m_numWords     = 0;
+        m_firstMergeableVectorIdx = 1;
+        return;
+    }
+    outSegment.m_pWords   = (uint32_t*)malloc(numWords * sizeof(uint32_t));
+    outSegment.m_numWords = (outSegment.m_pWords != nullptr) ? numWords : 0;
+    if (outSegment.m_pWords != nullptr)
+    {
+        uint32_t* pOutput = outSegment.m_pWords;
+        *(pOutput++) = calcDacOutputValue(m_pDisplayListVectors[segmentStart].x, m_pDisplayListVectors[segmentStart].y);
+        generateWords(segmentStart + 1, segmentEnd, pOutput);
+
+        uint32_t hash = kContentHashSeed;
+        for (uint32_t i = 0; i < numWords; ++i)
+        {
+            hash = (hash ^ outSegment.m_pWords[i]) * 16777619;
+        }
+        outSegment.m_hash = hash;
+    }
+
+    // The vectors are replaced by the segment.  Its words are the steps of those
+    // vectors, plus a jump to the start if they didn't begin with one.
+    m_numVectorWords -= (segmentStart == m_firstMergeableVectorIdx) ? numWords : (numWords - 1);
+    const Vector segmentLast  = m_pDisplayListVectors[segmentEnd - 1];
+    m_numDisplayListVectors   = m_firstMergeableVectorIdx;
+    m_firstMergeableVectorIdx = 1;
+    m_previousIntensity       = 0;
+
+    // Leave the cursor where the segment finished, so that the next PushVector
+    // carries on from there.  This is a jump in place of the segment's vectors,
+    // so there's always room for it.
+    const Vector& previous = m_pDisplayListVectors[m_numDisplayListVectors - 1];
+    if ((segmentLast.x != previous.x) || (segmentLast.y != previous.y))
+    {
+        Vector& jump  = m_pDisplayListVectors[m_numDisplayListVectors++];
+        jump          = segmentLast;
+        jump.numSteps = 1;
+#if STEP_DIV_IN_DISPLAY_LIST
+        jump.stepX = jump.x - previous.x;
+        jump.stepY = jump.y - previous.y;
+#endif
+        ++m_numVectorWords;
+    }
+    PushSegment(outSegment);
+}
+
+void DisplayList::PushSegment(const DisplayListSegment& segment)
+{
+    if ((m_numSegments >= kMaxSegments) || !segment.IsRecorded())
+    {
+        return;
+    }
+    m_segments[m_numSegments++] = &segment;
+    m_numSegmentWords += segment.m_numWords;
+    hashContent(segment.m_hash);
+    hashContent(segment.m_numWords);
+}
 
 void DisplayList::OutputToDACs()
 {
     LOG_INFO(DisplayListSynchronisation, "DL: %d, %d\n", m_numDisplayListVectors,
              m_numDisplayListPoints);
 
+    // If nothing has changed since the previous frame, then just send the same
+    // DAC output again.
+    ++s_frameReuseStats.numFrames;
+    const uint32_t contentHash = m_isReplayable ? m_contentHash : 0;
+    if ((contentHash != 0) && (contentHash == s_previousOutputContentHash) && DacOutput::CanReplayPreviousFrame())
+    {
+        ++s_frameReuseStats.numReplayed;
+        DacOutput::SetProducerItem(DacOutput::ProducerStage::eReplay, 0);
+        DacOutput::ReplayPreviousFrame();
+        DacOutput::SetProducerItem(DacOutput::ProducerStage::eNone, 0);
+        return;
+    }
+    s_previousOutputContentHash = contentHash;
+
+    // SortByPriority is done on the update core.  If it couldn't be done, then
+    // everything is drawn in the order it was pushed instead, which is fine.
+
     // We do the points first, because they're time-consuming to output to the DACs, but
     // very lightweight from the CPU-side, filling in the output buffers.
     // So if there are any points to draw, then it gives us a head start in filling
@@ -232,6 +936,7 @@ void DisplayList::OutputToDACs()
 
             while (numPointsRemaining)
             {
+                DacOutput::SetProducerItem(DacOutput::ProducerStage::ePoints, m_numDisplayListPoints - numPointsRemaining);
                 uint32_t  numPointsInBatch;
                 uint32_t* pOutput
                     = DacOutput::AllocateBufferSpace(numPointsRemaining, numPointsInBatch);
@@ -243,33 +948,7 @@ void DisplayList::OutputToDACs()
                     const Point& point = *pPoint;
                     uint32_t     bitsX = point.x.getStorage() >> (point.x.kNumFractionalBits - 12);
                     uint32_t     bitsY = point.y.getStorage() >> (point.y.kNumFractionalBits - 12);
-                    uint32_t     bits  = bitsX | (bitsY << 12);
-
-                    // Get Z in terms of how many points.pio cycles do we want the point to be held
-                    // for. The max time we can have is 2044 cycles, so let's go with 11-bits for
-                    // now
-                    int32_t cycles = (int32_t)(point.brightness * point.brightness).getStorage()
-                                     >> (point.brightness.kNumFractionalBits - 11);
-                    // Subtract the 12 cycle per-point constant
-                    cycles -= 12;
-                    uint32_t bitsZ;
-                    if (cycles > 254)
-                    {
-                        // We need to use the long delay loop to accomplish this length of delay
-                        bits |= (1 << 24);
-
-                        bitsZ = cycles >> 4;
-                        if (bitsZ > 127)
-                        {
-                            bitsZ = 127;
-                        }
-                    }
-                    else
-                    {
-                        // Short delay is good
-                        bitsZ = (cycles < 0) ? 0 : (cycles >> 1);
-                    }
-                    bits |= (bitsZ << 25);
+                    uint32_t     bits  = bitsX | (bitsY << 12) | pointDelayBits(point.brightness);
                     *pOutput = bits;
                 }
                 numPointsRemaining -= numPointsInBatch;
@@ -282,121 +961,67 @@ void DisplayList::OutputToDACs()
     {
         DacOutput::SetCurrentPioSm(DacOutputPioSm::Raster());
 
-        const RasterDisplay& rasterDisplay = m_rasterDisplays[i];
-        DisplayListVector2   topLeft;
-        topLeft.x = (rasterDisplay.topLeft.x * s_calibrationScale.x) + s_calibrationBias.x;
-        topLeft.y = (rasterDisplay.topLeft.y * s_calibrationScale.y) + s_calibrationBias.y;
-        DisplayListVector2 bottomRight;
-        bottomRight.x = (rasterDisplay.bottomRight.x * s_calibrationScale.x) + s_calibrationBias.x;
-        bottomRight.y = (rasterDisplay.bottomRight.y * s_calibrationScale.y) + s_calibrationBias.y;
-        DisplayListIntermediate dx = (bottomRight.x - topLeft.x) / (int)rasterDisplay.width;
-        DisplayListIntermediate dy = (bottomRight.y - topLeft.y) / (int)rasterDisplay.height;
-        DisplayListIntermediate y  = topLeft.y;
+        const RasterDisplay&    rasterDisplay = m_rasterDisplays[i];
+        DisplayListVector2      topLeft;
+        DisplayListIntermediate dx, dy;
+        calcRasterSteps(rasterDisplay, topLeft, dx, dy);
+        DisplayListIntermediate y = topLeft.y;
         const uint32_t num32BitEntriesToAllocatePerScanline = ((rasterDisplay.width + 1) >> 1) + 1;
-        // LOG_INFO(RasterInfo, "dx: %f, dy: %f, x12: %d\n", (float) dx, (float) dy,
-        // scalarTo12bit(bottomRight.x));
         for (uint32_t scanlineIdx = 0; scanlineIdx < rasterDisplay.height; ++scanlineIdx)
         {
+            DacOutput::SetProducerItem(DacOutput::ProducerStage::eRaster, scanlineIdx);
             uint16_t* pOutputStart
-                = (uint16_t*)DacOutput::AllocateBufferSpace(num32BitEntriesToAllocatePerScanline);
-            uint16_t* pOutput = pOutputStart;
-            // uint16_t* pEnd = pOutput + (numEntriesToAllocatePerScanline * 2);
-            DisplayListIntermediate x = topLeft.x;
-            *(pOutput++)              = 0;
-            *(pOutput++)              = scalarTo12bit(y);
-
-            switch (rasterDisplay.mode)
-            {
-            case RasterDisplay::Mode::e1Bit:
-            {
-                const uint8_t* pixel
-                    = rasterDisplay.scanlineCallback(scanlineIdx, rasterDisplay.userData);
-                const uint8_t* end      = pixel + ((rasterDisplay.width + 7 + rasterDisplay.horizontalScrollOffset) >> 3);
-                const uint16_t holdBits = 15 << 12;
-                uint bitStart = rasterDisplay.horizontalScrollOffset;
-                uint bytesWithoutOutput = 0;
-                for (; pixel != end; ++pixel)
-                {
-                    uint8_t pixelBlock = *pixel;
-                    ++bytesWithoutOutput;
-                    for (uint bitIdx = bitStart; bitIdx < 8; ++bitIdx)
-                    {
-                        x += dx;
-                        if ((pixelBlock & (0x80 >> bitIdx)) != 0)
-                        {
-                            *(pOutput++) = scalarTo12bitNoWrap(x) | holdBits;
-                            bytesWithoutOutput = 0;
-                        }
-                    }
-                    bitStart = 0;
-
-                    if(bytesWithoutOutput == 2)
-                    {
-                        bytesWithoutOutput = 0;
-                        *(pOutput++) = scalarTo12bitNoWrap(x);
-                    }
-                }
-                break;
-            }
-
-            case RasterDisplay::Mode::e4BitLinear:
+                = (uint16_t*)DacOutput::TryAllocateBufferSpace(num32BitEntriesToAllocatePerScanline);
+            if ((pOutputStart == nullptr) && (num32BitEntriesToAllocatePerScanline <= kMaxScanlineScratchEntries))
             {
-                const uint8_t* pixel
-                    = rasterDisplay.scanlineCallback(scanlineIdx, rasterDisplay.userData);
-                const uint8_t* end = pixel + rasterDisplay.width;
-                for (; pixel != end; ++pixel)
-                {
-                    x += dx;
-                    uint32_t hold = *pixel; // s_pixelToHold[*pixel];
-                    if (hold != 0)
-                    {
-                        *(pOutput++) = scalarTo12bitNoWrap(x) | ((hold - 1) << 12);
-                    }
-                }
-                break;
+                // The DMA hasn't made room yet.  Rather than wait for it, get on with
+                // this scanline (and its callback) in the meantime, and copy it over after.
+                uint16_t* pScratch    = (uint16_t*)s_scanlineScratch;
+                uint16_t* pScratchEnd = encodeRasterScanline(rasterDisplay, scanlineIdx, topLeft.x, dx, y, pScratch);
+                const uint32_t numEntries = (uint32_t)(pScratchEnd - pScratch) >> 1;
+                memcpy(DacOutput::AllocateBufferSpace(numEntries), s_scanlineScratch, numEntries * sizeof(uint32_t));
             }
-
-            case RasterDisplay::Mode::e8BitGamma:
+            else
             {
-                const uint8_t* pixel
-                    = rasterDisplay.scanlineCallback(scanlineIdx, rasterDisplay.userData);
-                const uint8_t* end = pixel + rasterDisplay.width;
-                for (; pixel != end; ++pixel)
+                if (pOutputStart == nullptr)
                 {
-                    x += dx;
-                    uint32_t hold = s_pixelToHold[*pixel];
-                    if (hold != 0)
-                    {
-                        *(pOutput++) = scalarTo12bitNoWrap(x) | ((hold - 1) << 12);
-                    }
+                    // Too wide for the scratch space, so it'll have to wait
+                    pOutputStart = (uint16_t*)DacOutput::AllocateBufferSpace(num32BitEntriesToAllocatePerScanline);
                 }
-                break;
-            }
+                uint16_t* pOutputEnd = encodeRasterScanline(rasterDisplay, scanlineIdx, topLeft.x, dx, y, pOutputStart);
+                DacOutput::GiveBackUnusedEntries(num32BitEntriesToAllocatePerScanline
+                                                 - ((pOutputEnd - pOutputStart) >> 1));
             }
-
-            uint32_t num16BitEntriesUsed = pOutput - pOutputStart;
-            if (num16BitEntriesUsed & 1)
-            {
-                // We used an odd number.  Add an inert output to make it even.
-                *(pOutput++) = 1;
-                ++num16BitEntriesUsed;
-            }
-            DacOutput::GiveBackUnusedEntries(num32BitEntriesToAllocatePerScanline
-                                             - (num16BitEntriesUsed >> 1));
-
             y += dy;
         }
     }
 
 
-    if (m_numDisplayListVectors > 1)
+    if ((m_numDisplayListVectors > 1) || (m_numSegments > 0))
     {
+        DacOutput::SetCurrentPioSm(DacOutputPioSm::Vector());
+
+        // Recorded segments go first.  They're already in DAC words.
+        for (uint32_t i = 0; i < m_numSegments; ++i)
+        {
+            DacOutput::SetProducerItem(DacOutput::ProducerStage::eSegments, i);
+            copyToDacOutput(m_segments[i]->m_pWords, m_segments[i]->m_numWords);
+        }
+
+        // Then any vectors that were stepped out by PreGenerateVectors
+        DacOutput::SetProducerItem(DacOutput::ProducerStage::ePreGenerated, 0);
+        copyToDacOutput(m_pPreGeneratedWords, m_numPreGeneratedWords);
+
         terminateVectors();
-        Vector*                 pItem = m_pDisplayListVectors;
-        Vector*                 pEnd  = pItem + m_numDisplayListVectors;
+        Vector*                 pItem = m_pDisplayListVectors + m_numPreGeneratedVectors;
+        Vector*                 pEnd  = m_pDisplayListVectors + m_numDisplayListVectors;
         DisplayListIntermediate x(0), y(0);
+        if (m_numPreGeneratedVectors > 0)
+        {
+            x = pItem[-1].x;
+            y = pItem[-1].y;
+        }
 
-        DacOutput::SetCurrentPioSm(DacOutputPioSm::Vector());
         DisplayListIntermediate dx;
         DisplayListIntermediate dy;
         bool previousVectorWasJump = true;
@@ -404,6 +1029,7 @@ void DisplayList::OutputToDACs()
         {
             const Vector& vector = *pItem;
             const uint32_t numSteps = vector.numSteps;
+            DacOutput::SetProducerItem(DacOutput::ProducerStage::eVectors, (uint32_t)(pItem - m_pDisplayListVectors));
 #if STEP_DIV_IN_DISPLAY_LIST
             dx = vector.stepX;
             dy = vector.stepY;
@@ -412,8 +1038,8 @@ void DisplayList::OutputToDACs()
             dy = DisplayListIntermediate(vector.y - y);
             if(numSteps > 1)
             {
-                dx /= (int) numSteps;
-                dy /= (int) numSteps;
+                dx = divideBySteps(dx, numSteps);
+                dy = divideBySteps(dy, numSteps);
             }
 #endif
             const bool thisVectorIsJump = (numSteps == 1);
@@ -483,5 +1109,8 @@ void DisplayList::OutputToDACs()
         // LOG_INFO("Out Vectors End\n");
     }
 
-    DacOutput::Flush(true);
+    // Nothing else is output until the next frame, so there's no need to
+    // wait for the next buffer now
+    DacOutput::FlushWithoutWaiting(true);
+    DacOutput::SetProducerItem(DacOutput::ProducerStage::eNone, 0);
 }
@@ -0,0 +1,212 @@
+// Keeping DisplayLists within the time available for a frame
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// The DACs can only take so many words per second.  If a frame has more steps
+// than that at the demo's refresh rate, then it just runs long, and the
+// refresh rate drops, which makes everything flicker.
+//
+// So we keep a running total of how long the DACs will take as things are
+// pushed, and ApplyFrameBudget cuts the frame down to size before it's output.
+
+#include "displaylist.h"
+
+#include "dacouttiming.h"
+#include "pico/assert.h"
+#include "stepreciprocal.h"
+
+#include <cmath>
+
+// Drawn vectors keep at least this many steps, so that they can't be mistaken
+// for jumps.
+static constexpr uint32_t kMinDrawnSteps = 2;
+
+void DisplayList::ApplyFrameBudget(uint32_t budgetUs, FrameBudgetPolicy policy)
+{
+    // The vectors aren't allowed to change once they've been generated
+    assert(m_numPreGeneratedVectors == 0);
+
+    const uint32_t predictedUs     = GetPredictedBeamTimeUs();
+    m_frameBudgetStats.predictedUs = predictedUs;
+    m_frameBudgetStats.governedUs  = predictedUs;
+    if ((policy == FrameBudgetPolicy::eNone) || (predictedUs <= budgetUs))
+    {
+        return;
+    }
+
+    // The output won't match the same content drawn within budget
+    hashContent(0xfffffffe);
+    hashContent(budgetUs ^ ((uint32_t)policy << 24));
+
+    const uint32_t budgetCycles = DacOutTiming::UsToSysCycles(budgetUs);
+    switch (policy)
+    {
+    case FrameBudgetPolicy::eNone:
+        break;
+    case FrameBudgetPolicy::eScaleIntensity:
+        scaleIntensities(budgetCycles);
+        break;
+    case FrameBudgetPolicy::eDropItems:
+        dropItems(budgetCycles);
+        break;
+    case FrameBudgetPolicy::eReduceStepDensity:
+        reduceStepDensity(budgetCycles);
+        break;
+    }
+    m_frameBudgetStats.governedUs = GetPredictedBeamTimeUs();
+}
+
+void DisplayList::scaleIntensities(uint32_t budgetCycles)
+{
+    // Only the steps of drawn vectors beyond the minimum, and the point delays,
+    // can be scaled.  Everything else costs the same whatever we do.
+    uint32_t numScalableSteps = 0;
+    for (uint32_t i = 1; i < m_numDisplayListVectors; ++i)
+    {
+        const uint32_t numSteps = m_pDisplayListVectors[i].numSteps;
+        if (numSteps > kMinDrawnSteps)
+        {
+            numScalableSteps += numSteps - kMinDrawnSteps;
+        }
+    }
+    const uint32_t pointDelayCycles = m_numPointCycles - (m_numDisplayListPoints * DacOutTiming::PointCycles(0));
+    const uint64_t scalableCycles   = ((uint64_t)numScalableSteps * DacOutTiming::kSysCyclesPerVectorWord)
+                                    + ((uint64_t)pointDelayCycles * DacOutTiming::kPointsClockDivider);
+    const uint64_t fixedCycles      = predictedBeamCycles() - scalableCycles;
+    if (scalableCycles == 0)
+    {
+        return;
+    }
+
+    // 16.16 fraction of the scalable time that we can afford
+    const uint32_t scale
+        = (fixedCycles >= budgetCycles) ? 0 : (uint32_t)(((budgetCycles - fixedCycles) << 16) / scalableCycles);
+
+    // Beam time is proportional to the number of steps, so scale those directly.
+    for (uint32_t i = 1; i < m_numDisplayListVectors; ++i)
+    {
+        Vector& vector = m_pDisplayListVectors[i];
+        if (vector.numSteps > kMinDrawnSteps)
+        {
+            const uint32_t numSteps = kMinDrawnSteps + (((vector.numSteps - kMinDrawnSteps) * scale) >> 16);
+            m_numVectorWords -= vector.numSteps - numSteps;
+            vector.numSteps = (uint16_t)numSteps;
+#if STEP_DIV_IN_DISPLAY_LIST
+            vector.stepX = divideBySteps(DisplayListIntermediate(vector.x - m_pDisplayListVectors[i - 1].x), numSteps);
+            vector.stepY = divideBySteps(DisplayListIntermediate(vector.y - m_pDisplayListVectors[i - 1].y), numSteps);
+#endif
+        }
+    }
+
+    // Point delays are proportional to the square of the brightness.
+    // This ignores the rounding of the delays, so it's only approximate.
+    if (pointDelayCycles > 0)
+    {
+        const Intensity pointScale = sqrtf((float)scale * (1.f / 65536.f));
+        // Anything brighter than this gets the longest delay anyway
+        const Intensity maxBrightness = 1.f;
+        m_numPointCycles              = 0;
+        for (uint32_t i = 0; i < m_numDisplayListPoints; ++i)
+        {
+            Point& point     = m_pDisplayListPoints[i];
+            point.brightness = ((point.brightness > maxBrightness) ? maxBrightness : point.brightness) * pointScale;
+            m_numPointCycles += pointCycles(pointDelayBits(point.brightness));
+        }
+    }
+}
+
+void DisplayList::dropItems(uint32_t budgetCycles)
+{
+    // Least important first.  Within each priority, the points and then the
+    // vectors that were pushed last.
+    sortByPriority();
+    uint32_t predictedCycles = predictedBeamCycles();
+    for (int32_t priority = (int32_t)Priority::eCount - 1; (priority >= 0) && (predictedCycles > budgetCycles); --priority)
+    {
+        while ((predictedCycles > budgetCycles) && (m_numDisplayListPoints > 0)
+               && ((int32_t)m_pDisplayListPoints[m_numDisplayListPoints - 1].priority == priority))
+        {
+            const Point&   point  = m_pDisplayListPoints[--m_numDisplayListPoints];
+            const uint32_t cycles = pointCycles(pointDelayBits(point.brightness));
+            m_numPointCycles -= cycles;
+            predictedCycles -= cycles * DacOutTiming::kPointsClockDivider;
+        }
+
+        // Keeping the first vector at the origin
+        while ((predictedCycles > budgetCycles) && (m_numDisplayListVectors > 1)
+               && ((int32_t)m_pDisplayListVectors[m_numDisplayListVectors - 1].priority == priority))
+        {
+            const uint32_t numSteps = m_pDisplayListVectors[--m_numDisplayListVectors].numSteps;
+            m_numVectorWords -= numSteps;
+            predictedCycles -= numSteps * DacOutTiming::kSysCyclesPerVectorWord;
+        }
+    }
+    m_previousIntensity = 0;
+}
+
+void DisplayList::reduceStepDensity(uint32_t budgetCycles)
+{
+    // Everything but the vectors stays as it is
+    const uint32_t vectorCycles = m_numVectorWords * DacOutTiming::kSysCyclesPerVectorWord;
+    const uint32_t otherCycles  = predictedBeamCycles() - vectorCycles;
+    const uint32_t budgetWords
+        = (otherCycles >= budgetCycles) ? 0 : ((budgetCycles - otherCycles) / DacOutTiming::kSysCyclesPerVectorWord);
+
+    // Binary search for the biggest cap on the steps per vector that fits
+    uint32_t lowCap  = kMinDrawnSteps;
+    uint32_t highCap = kMinDrawnSteps;
+    for (uint32_t i = 1; i < m_numDisplayListVectors; ++i)
+    {
+        const uint32_t numSteps = m_pDisplayListVectors[i].numSteps;
+        highCap                 = (numSteps > highCap) ? numSteps : highCap;
+    }
+    while (lowCap < highCap)
+    {
+        const uint32_t cap      = (lowCap + highCap + 1) >> 1;
+        uint32_t       numWords = 0;
+        for (uint32_t i = 1; i < m_numDisplayListVectors; ++i)
+        {
+            const uint32_t numSteps = m_pDisplayListVectors[i].numSteps;
+            numWords += (numSteps > cap) ? cap : numSteps;
+        }
+        if (numWords <= budgetWords)
+        {
+            lowCap = cap;
+        }
+        else
+        {
+            highCap = cap - 1;
+        }
+    }
+
+    m_numVectorWords = 0;
+    for (uint32_t i = 1; i < m_numDisplayListVectors; ++i)
+    {
+        Vector& vector = m_pDisplayListVectors[i];
+        if (vector.numSteps > lowCap)
+        {
+            vector.numSteps = (uint16_t)lowCap;
+#if STEP_DIV_IN_DISPLAY_LIST
+            vector.stepX = divideBySteps(DisplayListIntermediate(vector.x - m_pDisplayListVectors[i - 1].x), lowCap);
+            vector.stepY = divideBySteps(DisplayListIntermediate(vector.y - m_pDisplayListVectors[i - 1].y), lowCap);
+#endif
+        }
+        m_numVectorWords += vector.numSteps;
+    }
+}
@@ -0,0 +1,215 @@
+// Static class for capturing and replaying DAC output frames
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+#include "framecapture.h"
+
+#include "dacout.h"
+#include "dacoutputsm.h"
+#include "log.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+volatile FrameCapture::State FrameCapture::s_state = FrameCapture::State::eIdle;
+uint32_t*          FrameCapture::s_pBuffer               = nullptr;
+uint32_t           FrameCapture::s_numBytes              = 0;
+uint32_t           FrameCapture::s_numBytesInWholeFrames = 0;
+uint32_t           FrameCapture::s_numFramesToCapture    = 0;
+uint32_t           FrameCapture::s_numFramesCaptured     = 0;
+const uint8_t*     FrameCapture::s_pReplaySource         = nullptr;
+uint32_t           FrameCapture::s_replaySourceNumBytes  = 0;
+FrameCaptureReader FrameCapture::s_replayReader(nullptr, 0);
+bool               FrameCapture::s_isReplaying = false;
+
+static LogChannel FrameCaptureEvents(true);
+
+// Bytes per line of hex when dumping
+static constexpr uint32_t kNumBytesPerDumpLine = 32;
+
+void FrameCapture::Start(uint32_t numFrames)
+{
+    if (s_isReplaying || (numFrames == 0))
+    {
+        return;
+    }
+    if (s_pBuffer == nullptr)
+    {
+        s_pBuffer = (uint32_t*)malloc(kMaxCaptureBytes);
+        if (s_pBuffer == nullptr)
+        {
+            LOG_INFO(FrameCaptureEvents, "Not enough memory to capture\n");
+            return;
+        }
+    }
+    s_numFramesToCapture = numFrames;
+    s_state              = State::eArmed;
+    LOG_INFO(FrameCaptureEvents, "Capturing %d frames\n", numFrames);
+}
+
+void FrameCapture::recordChunk(uint32_t programId, const uint32_t* pWords, uint32_t numWords, bool endOfFrame)
+{
+    if (s_state == State::eArmed)
+    {
+        // Start with a whole frame
+        if (endOfFrame)
+        {
+            FrameCaptureHeader& header = *(FrameCaptureHeader*)s_pBuffer;
+            header.m_magic             = FrameCaptureHeader::kMagic;
+            header.m_version           = FrameCaptureHeader::kVersion;
+            header.m_numHeaderBytes    = sizeof(FrameCaptureHeader);
+            s_numBytes                 = sizeof(FrameCaptureHeader);
+            s_numBytesInWholeFrames    = s_numBytes;
+            s_numFramesCaptured        = 0;
+            s_state                    = State::eCapturing;
+        }
+        return;
+    }
+
+    const uint32_t numBytes = sizeof(FrameCaptureChunk) + (numWords * sizeof(uint32_t));
+    if (numBytes > (kMaxCaptureBytes - s_numBytes))
+    {
+        // Out of room, so just keep the frames we've got
+        LOG_INFO(FrameCaptureEvents, "Capture full with %d frames left\n", s_numFramesToCapture);
+        s_numBytes = s_numBytesInWholeFrames;
+        s_state    = State::eComplete;
+        return;
+    }
+
+    uint8_t*           pOutput = (uint8_t*)s_pBuffer + s_numBytes;
+    FrameCaptureChunk& chunk   = *(FrameCaptureChunk*)pOutput;
+    chunk.m_programId          = (uint8_t)programId;
+    chunk.m_flags              = endOfFrame ? FrameCaptureChunk::kEndOfFrame : 0;
+    chunk.m_reserved           = 0;
+    chunk.m_numWords           = numWords;
+    if (numWords > 0)
+    {
+        memcpy(pOutput + sizeof(FrameCaptureChunk), pWords, numWords * sizeof(uint32_t));
+    }
+    s_numBytes += numBytes;
+
+    if (endOfFrame)
+    {
+        s_numBytesInWholeFrames = s_numBytes;
+        ++s_numFramesCaptured;
+        if (--s_numFramesToCapture == 0)
+        {
+            s_state = State::eComplete;
+        }
+    }
+}
+
+void FrameCapture::DumpToSerial()
+{
+    // tools/piosim picks out the CAP lines, so other logging can be mixed in
+    if (s_numFramesToCapture > 0)
+    {
+        LOG_INFO(FrameCaptureEvents, "Capture ran out of room after %d frames, with %d left.  The limit is %d bytes\n",
+                 s_numFramesCaptured, s_numFramesToCapture, kMaxCaptureBytes);
+    }
+    const uint8_t* pBytes = (const uint8_t*)s_pBuffer;
+    printf("CAPTURE BEGIN %u\n", s_numBytes);
+    for (uint32_t i = 0; i < s_numBytes; i += kNumBytesPerDumpLine)
+    {
+        const uint32_t numBytesInLine
+            = ((s_numBytes - i) < kNumBytesPerDumpLine) ? (s_numBytes - i) : kNumBytesPerDumpLine;
+        printf("CAP ");
+        for (uint32_t j = 0; j < numBytesInLine; ++j)
+        {
+            printf("%02x", pBytes[i + j]);
+        }
+        printf("\n");
+    }
+    printf("CAPTURE END\n");
+    s_state = State::eIdle;
+}
+
+void FrameCapture::SetReplaySource(const uint8_t* pData, uint32_t numBytes)
+{
+    s_pReplaySource        = pData;
+    s_replaySourceNumBytes = numBytes;
+}
+
+bool FrameCapture::StartReplay()
+{
+    if ((s_state == State::eArmed) || (s_state == State::eCapturing))
+    {
+        // The capture buffer is in use
+        return false;
+    }
+    s_replayReader = (s_pReplaySource != nullptr) ? FrameCaptureReader(s_pReplaySource, s_replaySourceNumBytes)
+                                                  : FrameCaptureReader((const uint8_t*)s_pBuffer, s_numBytes);
+    s_isReplaying  = s_replayReader.IsValid();
+    LOG_INFO(FrameCaptureEvents, "Replay: %b\n", s_isReplaying);
+    return s_isReplaying;
+}
+
+void FrameCapture::StopReplay()
+{
+    s_isReplaying = false;
+
+    // DacOutput would otherwise repeat the replayed frame, if the DisplayList
+    // hasn't changed since before the replay started.
+    DacOutput::ForgetPreviousFrame();
+    LOG_INFO(FrameCaptureEvents, "Replay: %b\n", s_isReplaying);
+}
+
+void FrameCapture::ReplayNextFrame()
+{
+    bool                      hasRewound = false;
+    FrameCaptureReader::Chunk chunk;
+    while (true)
+    {
+        if (!s_replayReader.NextChunk(chunk))
+        {
+            if (hasRewound)
+            {
+                // There isn't a whole frame in there
+                StopReplay();
+                return;
+            }
+            s_replayReader.Rewind();
+            hasRewound = true;
+            continue;
+        }
+
+        const DacOutputPioSmConfig* pConfig = DacOutputPioSm::FromId(chunk.m_programId);
+        if ((pConfig != nullptr) && (chunk.m_numWords > 0))
+        {
+            DacOutput::SetCurrentPioSm(*pConfig);
+            const uint32_t* pWords            = chunk.m_pWords;
+            uint32_t        numWordsRemaining = chunk.m_numWords;
+            while (numWordsRemaining > 0)
+            {
+                uint32_t  numWords;
+                uint32_t* pOutput = DacOutput::AllocateBufferSpace(numWordsRemaining, numWords);
+                memcpy(pOutput, pWords, numWords * sizeof(uint32_t));
+                pWords += numWords;
+                numWordsRemaining -= numWords;
+            }
+        }
+        // One Flush per chunk, like when it was captured
+        DacOutput::Flush(chunk.m_endOfFrame);
+        if (chunk.m_endOfFrame)
+        {
+            return;
+        }
+    }
+}
@@ -0,0 +1,103 @@
+// Static class for capturing and replaying DAC output frames
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// This is an internal header for picovectorscope.
+//
+// Send a 'c' over serial to capture the next frame.  It's printed over serial
+// as hex once it's done, and tools/piosim can read the log back in.
+// Send a 'C' to keep replaying the captured frame instead of the demo, which
+// is handy for reproducing a stall or a glitch.
+//
+// See framecaptureformat.h for the format.
+
+#pragma once
+#include "dacout.h"
+#include "framecaptureformat.h"
+#include <cstdint>
+
+class FrameCapture
+{
+public:
+    // Capture the next numFrames whole frames that go out to the DACs.
+    // This is ignored while replaying.
+    static void Start(uint32_t numFrames = 1);
+
+    // True once the frames have been captured, until they're dumped
+    static bool IsComplete() { return s_state == State::eComplete; }
+
+    // Print the capture over serial, as hex
+    static void DumpToSerial();
+
+    // Called by DacOutput::Flush with each buffer that it sends
+    static inline void RecordChunk(uint32_t programId, const uint32_t* pWords, uint32_t numWords, bool endOfFrame)
+    {
+        if ((s_state == State::eArmed) || (s_state == State::eCapturing))
+        {
+            recordChunk(programId, pWords, numWords, endOfFrame);
+        }
+    }
+
+    // Replay from a capture that's somewhere else, like one built into the
+    // firmware.  By default it's the most recent capture.
+    static void SetReplaySource(const uint8_t* pData, uint32_t numBytes);
+
+    // Returns false if there's nothing to replay
+    static bool StartReplay();
+    static void StopReplay();
+    static bool IsReplaying() { return s_isReplaying; }
+
+    // Send the next captured frame to the DACs, in place of the DisplayList.
+    // It goes back to the first frame after the last one.
+    static void ReplayNextFrame();
+
+    // Captures are kept in RAM until they're dumped.  The memory isn't allocated
+    // until the first capture is started, so it costs nothing if it's never
+    // used, but it's kept after that for replaying.  There's room for a frame
+    // as big as DacOutput's buffers, like the ones that DacOutput can replay,
+    // with a few chunks per buffer for the flushes when the PIO program changes.
+    static constexpr uint32_t kMaxChunksPerBuffer = 4;
+    static constexpr uint32_t kMaxCaptureBytes
+        = sizeof(FrameCaptureHeader)
+          + (DacOutput::kNumBuffers
+             * ((DacOutput::kNumEntriesPerBuffer * sizeof(uint32_t)) + (kMaxChunksPerBuffer * sizeof(FrameCaptureChunk))));
+
+private:
+    enum class State
+    {
+        eIdle,
+        eArmed,     //< Waiting for the current frame to end
+        eCapturing,
+        eComplete,
+    };
+
+    static void recordChunk(uint32_t programId, const uint32_t* pWords, uint32_t numWords, bool endOfFrame);
+
+private:
+    static volatile State     s_state;
+    static uint32_t*          s_pBuffer;
+    static uint32_t           s_numBytes;
+    static uint32_t           s_numBytesInWholeFrames;
+    static uint32_t           s_numFramesToCapture;
+    static uint32_t           s_numFramesCaptured;
+    static const uint8_t*     s_pReplaySource;
+    static uint32_t           s_replaySourceNumBytes;
+    static FrameCaptureReader s_replayReader;
+    static bool               s_isReplaying;
+};
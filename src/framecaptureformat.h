@@ -0,0 +1,122 @@
+// The file format for captured DAC output frames
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// This is an internal header for picovectorscope.
+// It doesn't depend on the Pico SDK, so the host tools can use it too.
+//
+// A capture is a header, followed by one chunk per DacOutput::Flush, in the
+// order they were flushed:
+//
+//   FrameCaptureHeader
+//   FrameCaptureChunk, then m_numWords DAC words
+//   FrameCaptureChunk, then m_numWords DAC words
+//   ...
+//
+// The words are exactly what went to the DMA, for the PIO program given by
+// m_programId (DacOutputPioSmConfig::m_id).  The last chunk of each frame has
+// kEndOfFrame set, and may have no words, if the frame's final Flush had
+// nothing left to send.  Everything is little-endian, like the RP2040.
+
+#pragma once
+#include <cstdint>
+
+struct FrameCaptureHeader
+{
+    static constexpr uint32_t kMagic   = 0x43465650; // "PVFC"
+    static constexpr uint16_t kVersion = 1;
+
+    uint32_t m_magic;
+    uint16_t m_version;
+    uint16_t m_numHeaderBytes; // So that fields can be added later
+};
+
+struct FrameCaptureChunk
+{
+    static constexpr uint8_t kEndOfFrame = 1 << 0;
+
+    uint8_t  m_programId;
+    uint8_t  m_flags;
+    uint16_t m_reserved;
+    uint32_t m_numWords;
+};
+
+// Walks through the chunks of a capture in memory.
+// The data needs to be 4-byte aligned.
+class FrameCaptureReader
+{
+public:
+    struct Chunk
+    {
+        uint32_t        m_programId;
+        bool            m_endOfFrame;
+        const uint32_t* m_pWords;
+        uint32_t        m_numWords;
+    };
+
+    FrameCaptureReader(const uint8_t* pData, uint32_t numBytes)
+    : m_pData(pData)
+    , m_numBytes(numBytes)
+    , m_firstChunkOffset(0)
+    , m_offset(0)
+    {
+        if (numBytes >= sizeof(FrameCaptureHeader))
+        {
+            const FrameCaptureHeader& header = *(const FrameCaptureHeader*)pData;
+            if ((header.m_magic == FrameCaptureHeader::kMagic) && (header.m_version == FrameCaptureHeader::kVersion)
+                && (header.m_numHeaderBytes >= sizeof(FrameCaptureHeader)) && (header.m_numHeaderBytes <= numBytes))
+            {
+                m_firstChunkOffset = header.m_numHeaderBytes;
+                m_offset           = m_firstChunkOffset;
+            }
+        }
+    }
+
+    bool IsValid() const { return m_firstChunkOffset != 0; }
+
+    // Back to the first chunk
+    void Rewind() { m_offset = m_firstChunkOffset; }
+
+    // False at the end of the capture, or if the rest of it is truncated
+    bool NextChunk(Chunk& outChunk)
+    {
+        if (!IsValid() || ((m_numBytes - m_offset) < sizeof(FrameCaptureChunk)))
+        {
+            return false;
+        }
+        const FrameCaptureChunk& chunk  = *(const FrameCaptureChunk*)(m_pData + m_offset);
+        const uint32_t           offset = m_offset + sizeof(FrameCaptureChunk);
+        if (chunk.m_numWords > ((m_numBytes - offset) / sizeof(uint32_t)))
+        {
+            return false;
+        }
+        outChunk.m_programId  = chunk.m_programId;
+        outChunk.m_endOfFrame = (chunk.m_flags & FrameCaptureChunk::kEndOfFrame) != 0;
+        outChunk.m_pWords     = (const uint32_t*)(m_pData + offset);
+        outChunk.m_numWords   = chunk.m_numWords;
+        m_offset              = offset + (chunk.m_numWords * sizeof(uint32_t));
+        return true;
+    }
+
+private:
+    const uint8_t* m_pData;
+    uint32_t       m_numBytes;
+    uint32_t       m_firstChunkOffset;
+    uint32_t       m_offset;
+};
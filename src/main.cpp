@@ -16,12 +16,14 @@
 // COPYING.txt in the root of this project.
 // If not, see <https://www.gnu.org/licenses/>.
 
+#include "benchmarks.h"
 #include "buttons.h"
 #include "dacout.h"
 #include "dacoutputsm.h"
 #include "demo.h"
 #include "displaylist.h"
 #include "fixedpoint.h"
+#include "framecapture.h"
 #include "ledstatus.h"
 #include "log.h"
 #include "math.h"
@@ -30,6 +32,7 @@
 #include "pico/stdlib.h"
 #include "pico/time.h"
 #include "serial.h"
+#include "telemetry.h"
 
 // Which core (0 or 1) to run the DAC output on
 #define DAC_OUTPUT_CORE 1
@@ -41,6 +44,12 @@ static uint32_t      s_displayListIdx       = 1; //< Which are we currently fill
 static volatile bool s_dacOutputRunning     = false;
 static uint32_t      s_demoIdx              = 0;
 static bool          s_singleStepMode       = false;
+static bool          s_optimiseBeamPath     = false;
+static volatile bool s_runBenchmarks        = false;
+static volatile bool s_dumpTelemetry        = false;
+static bool          s_preGenerateVectors   = false;
+static uint32_t      s_preGenerateUs        = 0; //< Time taken by PreGenerateVectors on the update core
+static DisplayList::FrameBudgetPolicy s_frameBudgetPolicy = DisplayList::FrameBudgetPolicy::eNone;
 
 static uint64_t s_numMicrosBetweenFrames = 1000000 / 60; // FPS
 static float    s_dt                     = (float)s_numMicrosBetweenFrames / 1000000.f;
@@ -48,6 +57,11 @@ static float    s_dt                     = (float)s_numMicrosBetweenFrames / 100
 static LogChannel FrameSynchronisation(false);
 static LogChannel Events(false);
 static LogChannel ButtonFeedback(false);
+static LogChannel BeamPathStats(false);
+static LogChannel FrameReuseStats(false);
+static LogChannel CoreLoadStats(false);
+static LogChannel FrameBudgetStats(false);
+static LogChannel UnderrunStats(false);
 
 constexpr uint kMaxDemos          = 16;
 static Demo*   s_demos[kMaxDemos] = {};
@@ -126,6 +140,55 @@ void checkButton()
         LOG_INFO(Events, "Single step mode: %b\n", s_singleStepMode);
         Serial::ClearLastCharIn();
         break;
+
+    case 'o':
+        s_optimiseBeamPath = !s_optimiseBeamPath;
+        LOG_INFO(Events, "Optimise beam path: %b\n", s_optimiseBeamPath);
+        Serial::ClearLastCharIn();
+        break;
+
+    case 'p':
+        s_preGenerateVectors = !s_preGenerateVectors;
+        LOG_INFO(Events, "Pre-generate vectors: %b\n", s_preGenerateVectors);
+        Serial::ClearLastCharIn();
+        break;
+
+    case 'g':
+        // Cycle through the frame budget policies
+        s_frameBudgetPolicy = (DisplayList::FrameBudgetPolicy)(((int)s_frameBudgetPolicy + 1)
+                                                               % ((int)DisplayList::FrameBudgetPolicy::eReduceStepDensity + 1));
+        LOG_INFO(Events, "Frame budget policy: %d\n", (int)s_frameBudgetPolicy);
+        Serial::ClearLastCharIn();
+        break;
+
+    case 'b':
+        // They're run from the update loop
+        s_runBenchmarks = true;
+        Serial::ClearLastCharIn();
+        break;
+
+    case 't':
+        // It's dumped from the DAC output loop, between frames
+        s_dumpTelemetry = true;
+        Serial::ClearLastCharIn();
+        break;
+
+    case 'c':
+        FrameCapture::Start();
+        Serial::ClearLastCharIn();
+        break;
+
+    case 'C':
+        if (FrameCapture::IsReplaying())
+        {
+            FrameCapture::StopReplay();
+        }
+        else
+        {
+            FrameCapture::StartReplay();
+        }
+        Serial::ClearLastCharIn();
+        break;
     }
 }
 
@@ -139,11 +202,16 @@ void dacOutputLoop()
     if (frameDuration < s_numMicrosBetweenFrames)
     {
         /*next*/ frameStart += s_numMicrosBetweenFrames;
+#if DAC_OUTPUT_DMA_IRQ
+        // The DMA IRQ takes care of the rest of the previous frame
+        sleep_until(from_us_since_boot(frameStart));
+#else
         while(time_us_64() < frameStart)
         {
             DacOutput::Poll();
             sleep_us(50);
         }
+#endif
     }
     else
     {
@@ -155,11 +223,14 @@ void dacOutputLoop()
     // Lock the mutex for the next frame's DisplayList
     uint32_t nextDisplayListIdx = 1 - s_outputDisplayListIdx;
     LOG_INFO(FrameSynchronisation, "DO W: %d\n", nextDisplayListIdx);
-    //mutex_enter_blocking(s_displayListMutex + nextDisplayListIdx);
+#if DAC_OUTPUT_DMA_IRQ
+    mutex_enter_blocking(s_displayListMutex + nextDisplayListIdx);
+#else
     while(!mutex_try_enter(s_displayListMutex + nextDisplayListIdx, nullptr))
     {
         DacOutput::Poll();
     }
+#endif
     // Only then do we release this frame's DisplayList
     mutex_exit(s_displayListMutex + s_outputDisplayListIdx);
     s_outputDisplayListIdx = nextDisplayListIdx;
@@ -171,12 +242,55 @@ void dacOutputLoop()
                                              * (1.f / s_numMicrosBetweenFrames)),
                        400);
     uint64_t dacOutStart = time_us_64();
-    s_pDisplayList[s_outputDisplayListIdx]->OutputToDACs();
+    static uint64_t dacOutEnd = 0;
+    if (dacOutEnd != 0)
+    {
+        Telemetry::Record(Telemetry::Stage::eIdle, (uint32_t)(dacOutStart - dacOutEnd));
+    }
+    if (FrameCapture::IsReplaying())
+    {
+        FrameCapture::ReplayNextFrame();
+    }
+    else
+    {
+        s_pDisplayList[s_outputDisplayListIdx]->OutputToDACs();
+    }
+    const uint64_t dacOutDuration = time_us_64() - dacOutStart;
+    Telemetry::EndDacOutputFrame((uint32_t)dacOutDuration);
+    if (s_dumpTelemetry)
+    {
+        // This holds up the DAC output too
+        s_dumpTelemetry = false;
+        Telemetry::DumpToSerial();
+    }
+    if (FrameCapture::IsComplete())
+    {
+        // This holds up the DAC output for a while
+        FrameCapture::DumpToSerial();
+    }
+    const DisplayList::FrameReuseStats& reuseStats = DisplayList::GetFrameReuseStats();
+    if ((reuseStats.numFrames & 255) == 0)
+    {
+        LOG_INFO(FrameReuseStats, "Frame reuse: %d of %d frames replayed\n", reuseStats.numReplayed,
+                 reuseStats.numFrames);
+    }
+    if ((reuseStats.numFrames & 63) == 0)
+    {
+        // Headroom is how much of the frame the DAC output core has to spare
+        LOG_INFO(CoreLoadStats, "DAC output %d us, headroom %d us, pre-generate %d us\n", (uint32_t)dacOutDuration,
+                 (int32_t)s_numMicrosBetweenFrames - (int32_t)dacOutDuration, s_preGenerateUs);
+        // The DMA running dry mid-frame, because the DAC output fell behind
+        const DacOutput::UnderrunStats& underruns = DacOutput::GetUnderrunStats();
+        LOG_INFO(UnderrunStats, "Underruns %d, starved %d us, longest %d us, last during %s %d\n",
+                 underruns.numUnderruns, (uint32_t)underruns.totalStarvedUs, underruns.longestStarvedUs,
+                 DacOutput::GetProducerStageName(underruns.lastStage), underruns.lastItemIdx);
+    }
     LedStatus::SetStep(
         4,
-        LedStatus::Brightness((float)(time_us_64() - dacOutStart) * (1.f / s_numMicrosBetweenFrames)),
+        LedStatus::Brightness((float)dacOutDuration * (1.f / s_numMicrosBetweenFrames)),
         400);
     LOG_INFO(FrameSynchronisation, "DO E %d\n", s_outputDisplayListIdx);
+    dacOutEnd = time_us_64();
 }
 
 void displayListUpdateLoop()
@@ -197,6 +311,12 @@ void displayListUpdateLoop()
         Serial::ClearLastCharIn();
     }
 
+    if (s_runBenchmarks)
+    {
+        s_runBenchmarks = false;
+        Benchmarks::Run();
+    }
+
     uint64_t frameStart = time_us_64();
 
     // Fill in the DisplayList
@@ -205,7 +325,43 @@ void displayListUpdateLoop()
 
     Buttons::Update();
 
+    const uint64_t updateAndRenderStart = time_us_64();
     s_demos[s_demoIdx]->UpdateAndRender(displayList, s_dt);
+    Telemetry::Record(Telemetry::Stage::eUpdateAndRender, (uint32_t)(time_us_64() - updateAndRenderStart));
+
+    // Leave a little of the frame for switching between PIO programs and the like
+    displayList.ApplyFrameBudget((uint32_t)(s_numMicrosBetweenFrames * 15) / 16, s_frameBudgetPolicy);
+    const DisplayList::FrameBudgetStats& budgetStats = displayList.GetFrameBudgetStats();
+    if (budgetStats.governedUs != budgetStats.predictedUs)
+    {
+        LOG_INFO(FrameBudgetStats, "Frame budget: %d us -> %d us\n", budgetStats.predictedUs, budgetStats.governedUs);
+    }
+
+    if (s_optimiseBeamPath)
+    {
+        displayList.OptimiseBeamPath();
+        const DisplayList::BeamPathStats& stats = displayList.GetBeamPathStats();
+        LOG_INFO(BeamPathStats, "Beam path: %d strokes, jumps %d -> %d\n", stats.numStrokes,
+                 stats.jumpLengthBefore, stats.jumpLengthAfter);
+    }
+
+    if (s_preGenerateVectors)
+    {
+        const uint64_t preGenerateStart = time_us_64();
+        displayList.PreGenerateVectors();
+        s_preGenerateUs = (uint32_t)(time_us_64() - preGenerateStart);
+    }
+    else
+    {
+        s_preGenerateUs = 0;
+    }
+
+    // So that OutputToDACs draws in priority order.  If there isn't the memory
+    // to sort, then it's drawn in the order it was pushed.
+    if (!displayList.SortByPriority())
+    {
+        LOG_INFO(FrameSynchronisation, "Out of memory sorting by priority\n");
+    }
 
     // Unlock it so that the display output knows it's ready
     LOG_INFO(FrameSynchronisation, "Fill E: %d\n", s_displayListIdx);
@@ -220,6 +376,8 @@ void displayListUpdateLoop()
 
 void dacOutputTask()
 {
+    // On this core, so that this is where the DMA IRQ is handled
+    DacOutput::Init(DacOutputPioSm::Idle());
     mutex_enter_blocking(s_displayListMutex + s_outputDisplayListIdx);
     s_dacOutputRunning = true;
     while (true)
@@ -258,7 +416,6 @@ int main()
     TestFixedPoint();
 
     DacOutputPioSm::Init();
-    DacOutput::Init(DacOutputPioSm::Idle());
     mutex_init(s_displayListMutex + 0);
     mutex_init(s_displayListMutex + 1);
 
@@ -0,0 +1,193 @@
+// Priority classes for the things in a DisplayList
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// Things are pushed in whatever order the application draws them, but they're
+// output in priority order.  Rather than keeping separate lists for each
+// priority, the priority is packed into the spare bits of each Vector's step count.
+// Whenever the priority changes, a new run of vectors is started with a jump,
+// so the runs can be shuffled around without changing what they draw.
+//
+// Most applications never change the priority, so the DisplayList keeps track of
+// whether anything has been pushed out of order, and only sorts it if it has.
+
+#include "displaylist.h"
+
+#include <cstdlib>
+
+void DisplayList::SetPriority(Priority priority)
+{
+    if (priority != m_priority)
+    {
+        hashContent(0x20000 | (uint32_t)priority);
+        m_priority = priority;
+    }
+}
+
+// Start a new run of vectors at the current priority, with a jump to where the
+// beam already is.
+bool DisplayList::startPriorityRun()
+{
+    if (m_numDisplayListVectors >= (m_maxDisplayListVectors - 2)) // Leave space for a vector, and the Terminator
+    {
+        return false;
+    }
+    const Vector& previous = m_pDisplayListVectors[m_numDisplayListVectors - 1];
+    if ((m_numDisplayListVectors > 1) && ((uint32_t)m_priority < previous.priority))
+    {
+        m_isSortedByPriority = false;
+    }
+    Vector& jump  = m_pDisplayListVectors[m_numDisplayListVectors++];
+    jump.x        = previous.x;
+    jump.y        = previous.y;
+    jump.numSteps = 1;
+    jump.priority = (uint16_t)m_priority;
+#if STEP_DIV_IN_DISPLAY_LIST
+    jump.stepX = 0;
+    jump.stepY = 0;
+#endif
+    ++m_numVectorWords;
+    m_previousIntensity = 0;
+    return true;
+}
+
+// A stable sort of the vectors and points into priority order.
+// Returns false if there wasn't the memory to do it.
+bool DisplayList::sortByPriority()
+{
+    if (m_isSortedByPriority)
+    {
+        return true;
+    }
+    if (m_pScratchVectors == nullptr)
+    {
+        m_pScratchVectors = (Vector*)malloc(m_maxDisplayListVectors * sizeof(Vector));
+    }
+    if (m_pScratchPoints == nullptr)
+    {
+        m_pScratchPoints = (Point*)malloc(m_maxDisplayListPoints * sizeof(Point));
+    }
+    if ((m_pScratchVectors == nullptr) || (m_pScratchPoints == nullptr))
+    {
+        return false;
+    }
+
+    // One pass for each priority.  The first vector stays where it is.
+    Vector* pOutVector = m_pScratchVectors;
+    *(pOutVector++)    = m_pDisplayListVectors[0];
+    Point* pOutPoint   = m_pScratchPoints;
+    for (uint32_t priority = 0; priority < (uint32_t)Priority::eCount; ++priority)
+    {
+        for (uint32_t i = 1; i < m_numDisplayListVectors; ++i)
+        {
+            if (m_pDisplayListVectors[i].priority == priority)
+            {
+                *(pOutVector++) = m_pDisplayListVectors[i];
+            }
+        }
+        for (uint32_t i = 0; i < m_numDisplayListPoints; ++i)
+        {
+            if ((uint32_t)m_pDisplayListPoints[i].priority == priority)
+            {
+                *(pOutPoint++) = m_pDisplayListPoints[i];
+            }
+        }
+    }
+
+    // Swap the buffers over rather than copying back
+    Vector* pTempVectors  = m_pDisplayListVectors;
+    m_pDisplayListVectors = m_pScratchVectors;
+    m_pScratchVectors     = pTempVectors;
+    Point* pTempPoints    = m_pDisplayListPoints;
+    m_pDisplayListPoints  = m_pScratchPoints;
+    m_pScratchPoints      = pTempPoints;
+
+    m_isSortedByPriority = true;
+    return true;
+}
+
+// The DisplayList is full of vectors.  Throw out anything less important than
+// the current priority to make room.
+void DisplayList::evictVectors()
+{
+    // Not while a segment is being recorded, or after PreGenerateVectors
+    if ((m_firstMergeableVectorIdx != 1) || (m_numDisplayListVectors < 2))
+    {
+        return;
+    }
+    const Vector& previous = m_pDisplayListVectors[m_numDisplayListVectors - 1];
+    if (m_isSortedByPriority && (previous.priority <= (uint32_t)m_priority))
+    {
+        // Nothing less important to throw out
+        return;
+    }
+    const DisplayListScalar beamX = previous.x;
+    const DisplayListScalar beamY = previous.y;
+    if (!sortByPriority())
+    {
+        return;
+    }
+
+    uint32_t numVectors = m_numDisplayListVectors;
+    while ((numVectors > 1) && (m_pDisplayListVectors[numVectors - 1].priority > (uint32_t)m_priority))
+    {
+        m_numVectorWords -= m_pDisplayListVectors[--numVectors].numSteps;
+    }
+    m_numDisplayListVectors = numVectors;
+
+    // The beam might not be where the next vector starts any more.  There's always
+    // room for this, because we're called before the DisplayList is completely full.
+    const Vector& last = m_pDisplayListVectors[numVectors - 1];
+    if ((last.x != beamX) || (last.y != beamY))
+    {
+        if ((uint32_t)m_priority < last.priority)
+        {
+            m_isSortedByPriority = false;
+        }
+        Vector& jump  = m_pDisplayListVectors[m_numDisplayListVectors++];
+        jump.x        = beamX;
+        jump.y        = beamY;
+        jump.numSteps = 1;
+        jump.priority = (uint16_t)m_priority;
+#if STEP_DIV_IN_DISPLAY_LIST
+        jump.stepX = jump.x - last.x;
+        jump.stepY = jump.y - last.y;
+#endif
+        ++m_numVectorWords;
+        m_previousIntensity = 0;
+    }
+}
+
+// The DisplayList is full of points.  Throw out anything less important than
+// the current priority to make room.
+void DisplayList::evictPoints()
+{
+    if (m_isSortedByPriority && (m_pDisplayListPoints[m_numDisplayListPoints - 1].priority <= m_priority))
+    {
+        return;
+    }
+    if (!sortByPriority())
+    {
+        return;
+    }
+    while ((m_numDisplayListPoints > 0) && (m_pDisplayListPoints[m_numDisplayListPoints - 1].priority > m_priority))
+    {
+        m_numPointCycles -= pointCycles(pointDelayBits(m_pDisplayListPoints[--m_numDisplayListPoints].brightness));
+    }
+}
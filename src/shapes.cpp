@@ -22,29 +22,262 @@
 #include "sintable.h"
 #include "transform2d.h"
 
+#include <alloca.h>
+
 static constexpr uint kBurnFadeLength = 8;
 static constexpr BurnLength kBurnBoostMultiplier = 3.f / kBurnFadeLength;
 
-static inline void pushVector(DisplayList& displayList, const FixedTransform2D::Vector2Type& point, Intensity intensity)
+// Cohen-Sutherland clipping against the viewport, which is 0 to 1 on both axes.
+// Anything off screen costs no steps at all, and lines that are partly on
+// screen only spend steps on the part that's visible.
+enum class ClipEdge
+{
+    Left,
+    Right,
+    Bottom,
+    Top,
+};
+static const uint32_t kClipFlagLeft   = (1 << (int) ClipEdge::Left);
+static const uint32_t kClipFlagRight  = (1 << (int) ClipEdge::Right);
+static const uint32_t kClipFlagBottom = (1 << (int) ClipEdge::Bottom);
+static const uint32_t kClipFlagTop    = (1 << (int) ClipEdge::Top);
+
+typedef ShapeVector2::ScalarType ShapeScalar;
+
+static inline uint32_t clipPoint(const ShapeVector2& p)
+{
+    uint32_t clipFlags = 0;
+    if(p.x < 0.f) clipFlags |= kClipFlagLeft;
+    if(p.x > 1.f) clipFlags |= kClipFlagRight;
+    if(p.y < 0.f) clipFlags |= kClipFlagBottom;
+    if(p.y > 1.f) clipFlags |= kClipFlagTop;
+    return clipFlags;
+}
+
+static inline DisplayListVector2 toDisplayPoint(const ShapeVector2& p)
+{
+    // Clipped points can still be a rounding error outside the viewport
+    return DisplayListVector2(saturate(p.x), saturate(p.y));
+}
+
+// Move a along the line towards b until it's on an edge.  da and db are the
+// distances of a and b from the edge, which are negative on the outside.
+static void clipToEdge(ShapeVector2& a, const ShapeVector2& b, int32_t da, int32_t db)
+{
+    const int64_t denominator = (int64_t)da - db;
+    const int64_t deltaX      = (int64_t)b.x.getStorage() - a.x.getStorage();
+    const int64_t deltaY      = (int64_t)b.y.getStorage() - a.y.getStorage();
+    a.x = ShapeScalar((int32_t)(a.x.getStorage() + ((deltaX * da) / denominator)));
+    a.y = ShapeScalar((int32_t)(a.y.getStorage() + ((deltaY * da) / denominator)));
+}
+
+// Clip the line from a to b to the viewport.
+// Returns false if none of it is visible.
+static bool clipLine(ShapeVector2& a, ShapeVector2& b, uint32_t clipFlagsA, uint32_t clipFlagsB)
+{
+    const int32_t kOne         = ShapeScalar(1.f).getStorage();
+    uint32_t      edgesClipped = 0;
+    while((clipFlagsA | clipFlagsB) != 0)
+    {
+        if((clipFlagsA & clipFlagsB) != 0)
+        {
+            // Both points are outside the same edge, so definitely off screen
+            return false;
+        }
+        const bool          clipA     = (clipFlagsA != 0);
+        ShapeVector2&       p         = clipA ? a : b;
+        const ShapeVector2& q         = clipA ? b : a;
+        uint32_t&           clipFlags = clipA ? clipFlagsA : clipFlagsB;
+        if(clipFlags & kClipFlagLeft)
+        {
+            clipToEdge(p, q, p.x.getStorage(), q.x.getStorage());
+            edgesClipped |= kClipFlagLeft;
+        }
+        else if(clipFlags & kClipFlagRight)
+        {
+            clipToEdge(p, q, kOne - p.x.getStorage(), kOne - q.x.getStorage());
+            edgesClipped |= kClipFlagRight;
+        }
+        else if(clipFlags & kClipFlagBottom)
+        {
+            clipToEdge(p, q, p.y.getStorage(), q.y.getStorage());
+            edgesClipped |= kClipFlagBottom;
+        }
+        else
+        {
+            clipToEdge(p, q, kOne - p.y.getStorage(), kOne - q.y.getStorage());
+            edgesClipped |= kClipFlagTop;
+        }
+        // Don't let rounding send us back to an edge we've already done
+        clipFlags = clipPoint(p) & ~edgesClipped;
+    }
+    return true;
+}
+
+static void pushClippedVector(DisplayList& displayList, const ShapeVector2& from, const ShapeVector2& to, Intensity intensity)
 {
-    DisplayListVector2 displayPoint(saturate(point.x), saturate(point.y));
-    displayList.PushVector(displayPoint, intensity);
+    ShapeVector2 a = from;
+    ShapeVector2 b = to;
+    if(clipLine(a, b, clipPoint(a), clipPoint(b)))
+    {
+        // The jump is dropped by the DisplayList if the beam is already there
+        displayList.PushVector(toDisplayPoint(a), 0);
+        displayList.PushVector(toDisplayPoint(b), intensity);
+    }
+}
+
+// The visible parts of the shape go into the DisplayList as polylines
+static void pushClippedPolyline(DisplayList& displayList,
+                                const ShapeVector2* points,
+                                uint32_t numPoints,
+                                Intensity intensity,
+                                bool closed,
+                                ShapeVisibility visibility = ShapeVisibility::ePartlyOnScreen)
+{
+    if(numPoints == 0)
+    {
+        return;
+    }
+    if(visibility == ShapeVisibility::eOnScreen)
+    {
+        // The bounds say that it's all on screen, so there's no need to check each point
+        DisplayListVector2* displayPoints = (DisplayListVector2*) alloca(sizeof(DisplayListVector2) * numPoints);
+        for (uint32_t i = 0; i < numPoints; ++i)
+        {
+            displayPoints[i] = toDisplayPoint(points[i]);
+        }
+        displayList.PushPolyline(displayPoints, numPoints, intensity, closed);
+        return;
+    }
+    uint32_t* clipFlags    = (uint32_t*) alloca(sizeof(uint32_t) * numPoints);
+    uint32_t  anyClipFlags = 0;
+    uint32_t  allClipFlags = ~0u;
+    for (uint32_t i = 0; i < numPoints; ++i)
+    {
+        clipFlags[i] = clipPoint(points[i]);
+        anyClipFlags |= clipFlags[i];
+        allClipFlags &= clipFlags[i];
+    }
+    if(allClipFlags != 0)
+    {
+        // All of it is off the same side of the screen
+        return;
+    }
+
+    DisplayListVector2* run = (DisplayListVector2*) alloca(sizeof(DisplayListVector2) * (numPoints + 1));
+    if(anyClipFlags == 0)
+    {
+        // All of it is on screen
+        for (uint32_t i = 0; i < numPoints; ++i)
+        {
+            run[i] = DisplayListVector2(points[i].x, points[i].y);
+        }
+        displayList.PushPolyline(run, numPoints, intensity, closed);
+        return;
+    }
+
+    // Each unbroken run of visible lines goes in its own polyline
+    const uint32_t numLines  = closed ? numPoints : (numPoints - 1);
+    uint32_t       runLength = 0;
+    for (uint32_t i = 0; i < numLines; ++i)
+    {
+        const uint32_t next = (i + 1 == numPoints) ? 0 : (i + 1);
+        ShapeVector2   a    = points[i];
+        ShapeVector2   b    = points[next];
+        const bool     visible = clipLine(a, b, clipFlags[i], clipFlags[next]);
+        if(visible && ((runLength == 0) || (clipFlags[i] != 0)))
+        {
+            if(runLength > 1)
+            {
+                displayList.PushPolyline(run, runLength, intensity, false);
+            }
+            run[0]    = toDisplayPoint(a);
+            runLength = 1;
+        }
+        if(visible)
+        {
+            run[runLength++] = toDisplayPoint(b);
+        }
+        if(!visible || (clipFlags[next] != 0))
+        {
+            if(runLength > 1)
+            {
+                displayList.PushPolyline(run, runLength, intensity, false);
+            }
+            runLength = 0;
+        }
+    }
+    if(runLength > 1)
+    {
+        displayList.PushPolyline(run, runLength, intensity, false);
+    }
 }
 
 void PushShapeToDisplayList(
     DisplayList& displayList, const ShapeVector2* points, uint32_t numPoints, Intensity intensity, bool closed)
 {
-    pushVector(displayList, points[0], Intensity(0.f));
+    pushClippedPolyline(displayList, points, numPoints, intensity, closed);
+}
+
+void CalcShapeBounds(const ShapeVector2* points, uint32_t numPoints, ShapeBounds& outBounds)
+{
+    if(numPoints == 0)
+    {
+        outBounds.min = ShapeVector2(0.f, 0.f);
+        outBounds.max = ShapeVector2(0.f, 0.f);
+        return;
+    }
+    outBounds.min = points[0];
+    outBounds.max = points[0];
     for (uint32_t i = 1; i < numPoints; ++i)
     {
-        pushVector(displayList, points[i], intensity);
+        const ShapeVector2& point = points[i];
+        outBounds.min.x = (point.x < outBounds.min.x) ? point.x : outBounds.min.x;
+        outBounds.min.y = (point.y < outBounds.min.y) ? point.y : outBounds.min.y;
+        outBounds.max.x = (point.x > outBounds.max.x) ? point.x : outBounds.max.x;
+        outBounds.max.y = (point.y > outBounds.max.y) ? point.y : outBounds.max.y;
     }
-    if (closed)
+}
+
+// The transformed points won't be exactly where the transformed bounds say,
+// so don't trust the bounds to be on screen when they're this close to the edge.
+static constexpr float kOnScreenMargin = 1.f / 1024.f;
+
+ShapeVisibility CalcShapeVisibility(const ShapeBounds& bounds, const FixedTransform2D& transform)
+{
+    // Transform the centre, and then find the extents of the rotated box around it
+    ShapeVector2 centre((bounds.min.x + bounds.max.x) * 0.5f, (bounds.min.y + bounds.max.y) * 0.5f);
+    ShapeVector2 halfSize((bounds.max.x - bounds.min.x) * 0.5f, (bounds.max.y - bounds.min.y) * 0.5f);
+    ShapeVector2 transformedCentre;
+    transform.transformVector(transformedCentre, centre);
+    const ShapeScalar extentX = (Abs(transform.m[0][0]) * halfSize.x) + (Abs(transform.m[1][0]) * halfSize.y);
+    const ShapeScalar extentY = (Abs(transform.m[0][1]) * halfSize.x) + (Abs(transform.m[1][1]) * halfSize.y);
+
+    const ShapeScalar minX = transformedCentre.x - extentX;
+    const ShapeScalar maxX = transformedCentre.x + extentX;
+    const ShapeScalar minY = transformedCentre.y - extentY;
+    const ShapeScalar maxY = transformedCentre.y + extentY;
+    if((maxX < 0.f) || (minX > 1.f) || (maxY < 0.f) || (minY > 1.f))
     {
-        pushVector(displayList, points[0], intensity);
+        return ShapeVisibility::eOffScreen;
     }
+    if((minX >= kOnScreenMargin) && (maxX <= (1.f - kOnScreenMargin))
+       && (minY >= kOnScreenMargin) && (maxY <= (1.f - kOnScreenMargin)))
+    {
+        return ShapeVisibility::eOnScreen;
+    }
+    return ShapeVisibility::ePartlyOnScreen;
 }
 
+static void pushTransformedShape(DisplayList& displayList,
+                                 const ShapeVector2* points,
+                                 uint32_t numPoints,
+                                 Intensity intensity,
+                                 bool closed,
+                                 const FixedTransform2D& transform,
+                                 BurnLength burnLength,
+                                 ShapeVisibility visibility);
+
 void PushShapeToDisplayList(DisplayList& displayList,
                             const ShapeVector2* points,
                             uint32_t numPoints,
@@ -53,9 +286,51 @@ void PushShapeToDisplayList(DisplayList& displayList,
                             const FixedTransform2D& transform,
                             BurnLength burnLength)
 {
+    pushTransformedShape(displayList, points, numPoints, intensity, closed, transform, burnLength,
+                         ShapeVisibility::ePartlyOnScreen);
+}
+
+void PushShapeToDisplayList(DisplayList& displayList,
+                            const ShapeVector2* points,
+                            uint32_t numPoints,
+                            Intensity intensity,
+                            bool closed,
+                            const FixedTransform2D& transform,
+                            const ShapeBounds& bounds,
+                            BurnLength burnLength)
+{
+    const ShapeVisibility visibility = CalcShapeVisibility(bounds, transform);
+    if(visibility == ShapeVisibility::eOffScreen)
+    {
+        return;
+    }
+    pushTransformedShape(displayList, points, numPoints, intensity, closed, transform, burnLength, visibility);
+}
+
+static void pushTransformedShape(DisplayList& displayList,
+                                 const ShapeVector2* points,
+                                 uint32_t numPoints,
+                                 Intensity intensity,
+                                 bool closed,
+                                 const FixedTransform2D& transform,
+                                 BurnLength burnLength,
+                                 ShapeVisibility visibility)
+{
+    const bool burning = (burnLength != 0) && (burnLength <= BurnLength((uint) numPoints + kBurnFadeLength));
+    if (!burning)
+    {
+        // None of it is burning, so it can all go in polylines
+        ShapeVector2* transformedPoints = (ShapeVector2*) alloca(sizeof(ShapeVector2) * numPoints);
+        for (uint32_t i = 0; i < numPoints; ++i)
+        {
+            transform.transformVector(transformedPoints[i], points[i]);
+        }
+        pushClippedPolyline(displayList, transformedPoints, numPoints, intensity, closed, visibility);
+        return;
+    }
+
     FixedTransform2D::Vector2Type point0;
     transform.transformVector(point0, points[0]);
-    pushVector(displayList, point0, Intensity(0.f));
     BurnLength burnBoost = 0;
     FixedTransform2D::Vector2Type previousPoint = point0;
     for (uint i = 1; i < numPoints; ++i)
@@ -80,16 +355,19 @@ void PushShapeToDisplayList(DisplayList& displayList,
                 point.x = (point.x - previousPoint.x) * fraction + previousPoint.x;
                 point.y = (point.y - previousPoint.y) * fraction + previousPoint.y;
 
-                DisplayListVector2 displayPoint(saturate(point.x), saturate(point.y));
-                displayList.PushPoint(displayPoint.x, displayPoint.y, Intensity(1.f));
+                if(clipPoint(point) == 0)
+                {
+                    DisplayListVector2 displayPoint = toDisplayPoint(point);
+                    displayList.PushPoint(displayPoint.x, displayPoint.y, Intensity(1.f));
+                }
             }
         }
-        pushVector(displayList, point, intensity + (burnBoost * kBurnBoostMultiplier));
+        pushClippedVector(displayList, previousPoint, point, intensity + (burnBoost * kBurnBoostMultiplier));
         previousPoint = point;
     }
     if (closed)
     {
-        pushVector(displayList, point0, intensity);
+        pushClippedVector(displayList, previousPoint, point0, intensity);
     }
 }
 
@@ -139,32 +417,36 @@ uint32_t FragmentShape(const ShapeVector2* points,
                        Fragment* outFragments,
                        uint32_t outFragmentsCapacity)
 {
-    if(outFragmentsCapacity == 0)
+    if((outFragmentsCapacity == 0) || (numPoints == 0))
     {
         return 0;
     }
     uint32_t numFragments = 0;
 
-    FixedTransform2D::Vector2Type fPoint;
-    transform.transformVector(fPoint, points[0]);
-    DisplayListVector2 point0(saturate(fPoint.x), saturate(fPoint.y));
-    DisplayListVector2 previousPoint = point0;
-    for (uint i = 1; i < numPoints; ++i)
+    // Only the visible parts of the shape are fragmented
+    ShapeVector2 point0;
+    transform.transformVector(point0, points[0]);
+    ShapeVector2 previousPoint = point0;
+    const uint32_t numLines = closed ? numPoints : (numPoints - 1);
+    for (uint i = 1; i <= numLines; ++i)
     {
-        transform.transformVector(fPoint, points[i]);
-        DisplayListVector2 point(saturate(fPoint.x), saturate(fPoint.y));
-        (*outFragments++).Init(previousPoint, point);
-        if(++numFragments == outFragmentsCapacity)
+        ShapeVector2 point = point0;
+        if(i < numPoints)
         {
-            return numFragments;
+            transform.transformVector(point, points[i]);
         }
-
+        ShapeVector2 a = previousPoint;
+        ShapeVector2 b = point;
         previousPoint = point;
-    }
-    if (closed)
-    {
-        (*outFragments).Init(previousPoint, point0);
-        ++numFragments;
+        if(!clipLine(a, b, clipPoint(a), clipPoint(b)))
+        {
+            continue;
+        }
+        (*outFragments++).Init(toDisplayPoint(a), toDisplayPoint(b));
+        if(++numFragments == outFragmentsCapacity)
+        {
+            break;
+        }
     }
 
     return numFragments;
@@ -176,15 +458,12 @@ void PushFragmentsToDisplayList(DisplayList& displayList, const Fragment* fragme
     for(;fragments != endFragment; ++fragments)
     {
         const Fragment& fragment = *fragments;
-        DisplayListVector2 point;
-        DisplayListVector2 halfEdge;
+        ShapeVector2 halfEdge;
         halfEdge.x = fragment.m_normalisedLineDirection.x * fragment.m_length * 0.5f;
         halfEdge.y = fragment.m_normalisedLineDirection.y * fragment.m_length * 0.5f;
-        point.x = fragment.m_position.x - halfEdge.x;
-        point.y = fragment.m_position.y - halfEdge.y;
-        displayList.PushVector(point, 0.f);
-        point.x = fragment.m_position.x + halfEdge.x;
-        point.y = fragment.m_position.y + halfEdge.y;
-        displayList.PushVector(point, fragment.m_intensity);
+        // Fragments fly off the screen, so they need clipping too
+        const ShapeVector2 a(fragment.m_position.x - halfEdge.x, fragment.m_position.y - halfEdge.y);
+        const ShapeVector2 b(fragment.m_position.x + halfEdge.x, fragment.m_position.y + halfEdge.y);
+        pushClippedVector(displayList, a, b, fragment.m_intensity);
     }
 }
@@ -0,0 +1,34 @@
+// Division-free splitting of vectors into DAC steps
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+#include "stepreciprocal.h"
+
+StepReciprocal::StepReciprocal()
+{
+    m_reciprocals[0] = 0;
+    m_reciprocals[1] = 0xffffffff;
+    for (uint32_t i = 2; i < kNumReciprocals; ++i)
+    {
+        // Round to nearest.  This is done once at start-up, so the 64-bit divide doesn't matter.
+        m_reciprocals[i] = (uint32_t)(((1ull << 32) + (i >> 1)) / i);
+    }
+}
+
+StepReciprocal StepReciprocal::s_stepReciprocal;
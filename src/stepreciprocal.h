@@ -0,0 +1,78 @@
+// Division-free splitting of vectors into DAC steps
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// This is an internal header for picovectorscope.
+//
+// Every vector that's drawn needs its dx and dy dividing by its number of steps.
+// For short vectors (like text), those two divisions are a good chunk of the
+// per-vector cost.  So instead we multiply by a 0.32 reciprocal from a table
+// indexed by the number of steps, and keep the top 32 bits of the product.
+//
+// The Cortex-M0+ only has a 32x32->32 multiply, so the high word is built
+// from three 16x16 partial products.  The low*low product is dropped, which
+// costs at most 2 LSBs of the 28 fractional bits in each step.  Even summed over
+// the maximum number of steps that's under an eighth of a DAC LSB, and the beam
+// snaps to the true end of each vector anyway.
+
+#pragma once
+#include "dacout.h"
+#include "displaylist.h"
+
+class StepReciprocal
+{
+public:
+    StepReciprocal();
+
+    // Returns delta / numSteps, rounded towards zero like an integer divide.
+    // |delta| must be less than 4, which it always is for the difference
+    // between two DisplayListScalars.
+    static inline DisplayListIntermediate Divide(DisplayListIntermediate delta, uint32_t numSteps)
+    {
+        const int32_t  storage    = delta.getStorage();
+        const uint32_t numerator  = (uint32_t)((storage < 0) ? -storage : storage);
+        const uint32_t reciprocal = s_stepReciprocal.m_reciprocals[numSteps];
+        const uint32_t numHi      = numerator >> 16;
+        const uint32_t numLo      = numerator & 0xffff;
+        const uint32_t recipHi    = reciprocal >> 16;
+        const uint32_t recipLo    = reciprocal & 0xffff;
+        const uint32_t quotient   = (numHi * recipHi) + (((numHi * recipLo) + (numLo * recipHi)) >> 16);
+        return DisplayListIntermediate((int32_t)((storage < 0) ? -quotient : quotient));
+    }
+
+    // One entry for every possible step count in a single vector
+    static constexpr uint32_t kNumReciprocals = DacOutput::kMaxStepsPerVector + 1;
+
+private:
+    // m_reciprocals[n] = 2^32 / n.  Entries 0 and 1 aren't valid, because
+    // vectors with fewer than 2 steps don't need dividing.
+    uint32_t m_reciprocals[kNumReciprocals];
+
+    static StepReciprocal s_stepReciprocal;
+};
+
+// delta / numSteps, with the reciprocal table if it's enabled
+static inline DisplayListIntermediate divideBySteps(DisplayListIntermediate delta, uint32_t numSteps)
+{
+#if STEP_RECIPROCAL_TABLE
+    return StepReciprocal::Divide(delta, numSteps);
+#else
+    return delta / (int)numSteps;
+#endif
+}
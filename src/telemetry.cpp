@@ -0,0 +1,125 @@
+// Per-frame timings of each stage of getting a frame out to the DACs
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+#include "telemetry.h"
+#include "log.h"
+
+#include <algorithm>
+
+uint16_t          Telemetry::s_values[(int)Stage::eCount][kNumFrames];
+uint32_t          Telemetry::s_numValues[(int)Stage::eCount] = {};
+uint32_t          Telemetry::s_flushWaitUs                   = 0;
+volatile uint32_t Telemetry::s_numPioSwitches                = 0;
+uint32_t          Telemetry::s_numPioSwitchesAtFrameStart    = 0;
+volatile uint32_t Telemetry::s_starvedUs                     = 0;
+uint32_t          Telemetry::s_starvedUsAtFrameStart         = 0;
+
+static LogChannel TelemetryResults(true);
+
+static const char* const kStageNames[] = {
+    "UpdateAndRender",
+    "OutputToDACs",
+    "Flush wait",
+    "DMA active",
+    "DMA starved",
+    "PIO switches",
+    "Idle",
+};
+static_assert(sizeof(kStageNames) / sizeof(kStageNames[0]) == (int)Telemetry::Stage::eCount, "A name for each Stage");
+
+static constexpr uint32_t kNumHistogramBuckets = 8;
+static constexpr uint32_t kHistogramWidth      = 32;
+
+void Telemetry::Record(Stage stage, uint32_t value)
+{
+    // Each stage is only ever recorded from one core
+    const int stageIdx = (int)stage;
+    s_values[stageIdx][s_numValues[stageIdx] % kNumFrames] = (value < 0xffff) ? (uint16_t)value : 0xffff;
+    ++s_numValues[stageIdx];
+}
+
+void Telemetry::EndDacOutputFrame(uint32_t dacOutputUs)
+{
+    const uint32_t flushWaitUs = (s_flushWaitUs < dacOutputUs) ? s_flushWaitUs : dacOutputUs;
+    Record(Stage::eOutputToDACs, dacOutputUs - flushWaitUs);
+    Record(Stage::eFlushWait, flushWaitUs);
+    s_flushWaitUs = 0;
+
+    // These are counted from DacOutput's IRQ, so don't reset them
+    const uint32_t numPioSwitches = s_numPioSwitches;
+    Record(Stage::ePioSwitches, numPioSwitches - s_numPioSwitchesAtFrameStart);
+    s_numPioSwitchesAtFrameStart = numPioSwitches;
+    const uint32_t starvedUs = s_starvedUs;
+    Record(Stage::eDmaStarved, starvedUs - s_starvedUsAtFrameStart);
+    s_starvedUsAtFrameStart = starvedUs;
+}
+
+void Telemetry::DumpToSerial()
+{
+    LOG_INFO(TelemetryResults, "Telemetry over the last %d frames...\n", kNumFrames);
+    for (int stageIdx = 0; stageIdx < (int)Stage::eCount; ++stageIdx)
+    {
+        const uint32_t numValues = (s_numValues[stageIdx] < kNumFrames) ? s_numValues[stageIdx] : kNumFrames;
+        const char*    pUnit     = (stageIdx == (int)Stage::ePioSwitches) ? "" : " us";
+        if (numValues == 0)
+        {
+            LOG_INFO(TelemetryResults, "  %-16s -\n", kStageNames[stageIdx]);
+            continue;
+        }
+
+        // Sort a copy, for the percentile.  The other core might still be
+        // recording, but a frame or so out won't matter.
+        uint16_t values[kNumFrames];
+        uint32_t total = 0;
+        for (uint32_t i = 0; i < numValues; ++i)
+        {
+            values[i] = s_values[stageIdx][i];
+            total += values[i];
+        }
+        std::sort(values, values + numValues);
+        const uint32_t minValue = values[0];
+        const uint32_t maxValue = values[numValues - 1];
+        LOG_INFO(TelemetryResults, "  %-16s min %5d%s, avg %5d%s, p99 %5d%s, max %5d%s\n", kStageNames[stageIdx],
+                 minValue, pUnit, total / numValues, pUnit, values[(numValues * 99) / 100], pUnit, maxValue, pUnit);
+
+        // And a histogram, from the min to the max
+        const uint32_t bucketSize = ((maxValue - minValue) / kNumHistogramBuckets) + 1;
+        const uint32_t numBuckets = ((maxValue - minValue) / bucketSize) + 1;
+        uint32_t       buckets[kNumHistogramBuckets] = {};
+        uint32_t       maxBucket = 0;
+        for (uint32_t i = 0; i < numValues; ++i)
+        {
+            uint32_t& bucket = buckets[(values[i] - minValue) / bucketSize];
+            maxBucket        = std::max(maxBucket, ++bucket);
+        }
+        for (uint32_t i = 0; i < numBuckets; ++i)
+        {
+            char bar[kHistogramWidth + 1];
+            const uint32_t barLength = (buckets[i] * kHistogramWidth + maxBucket - 1) / maxBucket;
+            for (uint32_t j = 0; j < kHistogramWidth; ++j)
+            {
+                bar[j] = (j < barLength) ? '#' : ' ';
+            }
+            bar[kHistogramWidth] = 0;
+            LOG_INFO(TelemetryResults, "    < %5d%s |%s| %d\n", minValue + ((i + 1) * bucketSize), pUnit, bar,
+                     buckets[i]);
+        }
+    }
+}
@@ -0,0 +1,80 @@
+// Per-frame timings of each stage of getting a frame out to the DACs
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// This is an internal header for picovectorscope.
+//
+// Send a 't' over serial to print the min, average and 99th percentile of
+// each stage over the last kNumFrames frames, along with a histogram of each.
+// Whichever stage is closest to the frame period is what's limiting the
+// frame rate.
+
+#pragma once
+#include <cstdint>
+
+class Telemetry
+{
+public:
+    enum class Stage
+    {
+        eUpdateAndRender, //< The Demo filling in the DisplayList, on the update core
+        eOutputToDACs,    //< Generating the DAC output, not counting eFlushWait
+        eFlushWait,       //< Waiting for the DMA to free up some buffer space
+        eDmaActive,       //< From the DMA starting the frame, to it finishing
+        eDmaStarved,      //< The DMA waiting for data in the middle of the frame
+        ePioSwitches,     //< How many times the PIO SM program was changed
+        eIdle,            //< The DAC output core waiting for the next frame
+
+        eCount
+    };
+
+    // Each stage is recorded once per frame
+    static void Record(Stage stage, uint32_t value);
+
+    // Called by DacOutput whenever it's had to wait for the DMA.  They're
+    // added up over the frame, and recorded by EndDacOutputFrame.
+    static inline void AddFlushWaitUs(uint32_t us) { s_flushWaitUs += us; }
+    // Called by DacOutput, possibly from its IRQ handler
+    static inline void CountPioSwitch() { s_numPioSwitches = s_numPioSwitches + 1; }
+    static inline void AddStarvedUs(uint32_t us) { s_starvedUs = s_starvedUs + us; }
+    // Called by DacOutput when the DMA has sent the last of a frame, possibly
+    // from its IRQ handler.  Nothing else records eDmaActive.
+    static inline void EndDmaFrame(uint32_t dmaActiveUs) { Record(Stage::eDmaActive, dmaActiveUs); }
+
+    // Call this on the DAC output core at the end of each frame, with how
+    // long the output took, including the waiting.
+    static void EndDacOutputFrame(uint32_t dacOutputUs);
+
+    // Print everything over serial
+    static void DumpToSerial();
+
+    static constexpr uint32_t kNumFrames = 256;
+
+private:
+    // The most recent kNumFrames values for each stage, in microseconds
+    // (apart from ePioSwitches), saturated at 65535.
+    static uint16_t s_values[(int)Stage::eCount][kNumFrames];
+    static uint32_t s_numValues[(int)Stage::eCount];
+
+    static uint32_t s_flushWaitUs;
+    static volatile uint32_t s_numPioSwitches;
+    static uint32_t s_numPioSwitchesAtFrameStart;
+    static volatile uint32_t s_starvedUs;
+    static uint32_t s_starvedUsAtFrameStart;
+};
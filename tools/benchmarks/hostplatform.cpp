@@ -0,0 +1,115 @@
+// Host stand-ins for the parts of picovectorscope that talk to the hardware
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+#include "hostplatform.h"
+
+#include "dacout.h"
+#include "dacoutputsm.h"
+#include "pico/time.h"
+
+#include <chrono>
+
+uint64_t time_us_64()
+{
+    static const std::chrono::steady_clock::time_point s_start = std::chrono::steady_clock::now();
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - s_start)
+        .count();
+}
+
+// The configs are only ever compared by address, or looked up by m_id, on the host
+DacOutputPioSmConfig DacOutputPioSm::s_configs[(int)DacOutputPioSm::SmID::eCount] = {};
+
+void DacOutputPioSm::Init()
+{
+    for (uint32_t i = 0; i < (uint32_t)SmID::eCount; ++i)
+    {
+        s_configs[i].m_id = i;
+    }
+}
+
+// DacOutput fills its buffers just as it does on the Pico, but a Flush just
+// counts the words and starts again, rather than sending them anywhere.
+uint32_t                    DacOutput::s_buffers[kNumBuffers][kNumEntriesPerBuffer];
+uint32_t                    DacOutput::s_currentBufferIdx       = 0;
+uint32_t                    DacOutput::s_currentEntryIdx        = 0;
+uint32_t                    DacOutput::s_currentBufferSize      = kNumEntriesPerBuffer;
+uint32_t                    DacOutput::s_numPreviousFrameChunks = 0; // So frames are never replayed
+const DacOutputPioSmConfig* DacOutput::s_currentPioConfig       = nullptr;
+volatile uint32_t           DacOutput::s_producerItem           = 0; // The DMA never underruns
+
+static uint64_t                    s_numWordsFlushed = 0;
+static HostPlatform::FlushCallback s_flushCallback   = nullptr;
+
+void DacOutput::Init(const DacOutputPioSmConfig&) {}
+
+void DacOutput::Flush(bool)
+{
+    s_numWordsFlushed += s_currentEntryIdx;
+    if ((s_flushCallback != nullptr) && (s_currentEntryIdx > 0))
+    {
+        s_flushCallback(s_currentPioConfig, s_buffers[s_currentBufferIdx], s_currentEntryIdx);
+    }
+    if (++s_currentBufferIdx == kNumBuffers)
+    {
+        s_currentBufferIdx = 0;
+    }
+    s_currentEntryIdx = 0;
+}
+
+void DacOutput::FlushWithoutWaiting(bool finalFlushForFrame)
+{
+    Flush(finalFlushForFrame);
+}
+
+void DacOutput::SetWaitCallback(WaitCallback, void*) {}
+
+void DacOutput::ReplayPreviousFrame() {}
+
+void DacOutput::SetCurrentPioSm(const DacOutputPioSmConfig& config)
+{
+    if (s_currentPioConfig != &config)
+    {
+        Flush();
+        s_currentPioConfig = &config;
+    }
+}
+
+void DacOutput::Poll() {}
+
+bool DacOutput::checkDmaStatus() { return false; }
+
+// The buffers are always free
+bool DacOutput::tryAcquireBuffer() { return true; }
+
+bool DacOutput::tryMakeSpace(uint32_t)
+{
+    Flush();
+    return true;
+}
+
+uint64_t HostPlatform::GetNumDacWordsFlushed()
+{
+    return s_numWordsFlushed;
+}
+
+void HostPlatform::SetFlushCallback(FlushCallback callback)
+{
+    s_flushCallback = callback;
+}
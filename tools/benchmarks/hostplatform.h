@@ -0,0 +1,40 @@
+// Host stand-ins for the parts of picovectorscope that talk to the hardware
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// hostplatform.cpp replaces dacout.cpp and dacoutputsm.cpp, so that
+// DisplayList::OutputToDACs can run on the host without any DMA or PIO.
+
+#pragma once
+#include <cstdint>
+
+struct DacOutputPioSmConfig;
+
+class HostPlatform
+{
+public:
+    // How many words DacOutput would have sent to the DACs so far
+    static uint64_t GetNumDacWordsFlushed();
+
+    // For tools that want to see the words, rather than just count them.
+    // This is called with each buffer as it's flushed, along with the PIO
+    // program it's for.
+    typedef void (*FlushCallback)(const DacOutputPioSmConfig* pConfig, const uint32_t* pWords, uint32_t numWords);
+    static void SetFlushCallback(FlushCallback callback);
+};
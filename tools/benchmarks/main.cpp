@@ -0,0 +1,327 @@
+// Host benchmarks for the rendering hot paths
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// benchmarks [--repeats n] [--csv results.csv] [--compare baseline.csv] [--tolerance percent]
+//
+// Times each of the hot paths on a representative scene, and prints the cost
+// per item.  Then it runs the same Benchmarks as sending 'b' to the Pico does.
+//
+//   --repeats <n>         How many times to repeat each scene.  Default 200
+//   --csv <results.csv>   Write the results out, to use as a baseline later
+//   --compare <base.csv>  Compare against a baseline, and return non-zero if
+//                         anything has got slower by more than...
+//   --tolerance <n>       ...this many percent.  Default 10
+//
+// These are host timings, so only compare them with other host timings from
+// the same machine.
+
+#include "hostplatform.h"
+
+#include "benchmarks.h"
+#include "displaylist.h"
+#include "extras/camera.h"
+#include "extras/shapes3d.h"
+#include "log.h"
+#include "pico/time.h"
+#include "text.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static uint32_t s_numRepeats = 200;
+
+// Somewhere for the results to go, so that the compiler can't optimise the work away
+static volatile int32_t s_sink = 0;
+
+struct Result
+{
+    std::string m_name;
+    double      m_nsPerItem;
+};
+static std::vector<Result> s_results;
+
+static void report(const char* pName, uint64_t durationUs, uint64_t numItems, const char* pUnit)
+{
+    const double nsPerItem = (numItems > 0) ? ((double)durationUs * 1000.0 / (double)numItems) : 0.0;
+    printf("  %-24s %10.1f ns/%s\n", pName, nsPerItem, pUnit);
+    s_results.push_back({pName, nsPerItem});
+}
+
+// The same pseudo-random numbers every time, so the scenes don't change between runs
+static uint32_t s_randomSeed = 1;
+static float random01()
+{
+    s_randomSeed = (s_randomSeed * 1664525) + 1013904223;
+    return (float)((s_randomSeed >> 8) & 0xffff) / 65536.f;
+}
+
+// A mix of long and short strokes, a bit like a game screen
+static void makeVectorScene(std::vector<DisplayListVector2>& outPoints)
+{
+    constexpr uint32_t kNumVectors = 2000;
+    float              x = 0.5f, y = 0.5f;
+    for (uint32_t i = 0; i < kNumVectors; ++i)
+    {
+        const float length = ((i & 7) == 0) ? 0.3f : 0.02f;
+        x += (random01() - 0.5f) * length;
+        y += (random01() - 0.5f) * length;
+        x = (x < 0.f) ? 0.f : ((x > 0.99f) ? 0.99f : x);
+        y = (y < 0.f) ? 0.f : ((y > 0.99f) ? 0.99f : y);
+        outPoints.push_back(DisplayListVector2(x, y));
+    }
+}
+
+static void pushVectors(DisplayList& displayList, const std::vector<DisplayListVector2>& points)
+{
+    displayList.Clear();
+    displayList.PushVector(points[0], 0);
+    for (uint32_t i = 1; i < points.size(); ++i)
+    {
+        displayList.PushVector(points[i], 1.f);
+    }
+}
+
+static void benchmarkVectors(DisplayList& displayList)
+{
+    std::vector<DisplayListVector2> points;
+    makeVectorScene(points);
+
+    uint64_t start = time_us_64();
+    for (uint32_t i = 0; i < s_numRepeats; ++i)
+    {
+        pushVectors(displayList, points);
+    }
+    report("PushVector", time_us_64() - start, (uint64_t)points.size() * s_numRepeats, "vector");
+
+    // The step generation, into DacOutput's buffers
+    const uint64_t numWordsBefore = HostPlatform::GetNumDacWordsFlushed();
+    start                         = time_us_64();
+    for (uint32_t i = 0; i < s_numRepeats; ++i)
+    {
+        displayList.OutputToDACs();
+    }
+    const uint64_t durationUs = time_us_64() - start;
+    report("OutputToDACs (vectors)", durationUs, HostPlatform::GetNumDacWordsFlushed() - numWordsBefore, "step");
+}
+
+static void benchmarkText(DisplayList& displayList)
+{
+    static const char* const kMessage = "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG 0123456789";
+    uint32_t                 numGlyphs = 0;
+    for (const char* pChar = kMessage; *pChar != 0; ++pChar)
+    {
+        numGlyphs += (*pChar != ' ') ? 1 : 0;
+    }
+    FixedTransform2D transform;
+    CalcTextTransform(DisplayListVector2(0.05f, 0.5f), 0.02f, transform);
+
+    const uint64_t start = time_us_64();
+    for (uint32_t i = 0; i < s_numRepeats; ++i)
+    {
+        displayList.Clear();
+        TextPrint(displayList, transform, kMessage, 1.f);
+    }
+    report("TextPrint", time_us_64() - start, (uint64_t)numGlyphs * s_numRepeats, "glyph");
+}
+
+static void benchmarkShape3D(DisplayList& displayList)
+{
+    // A cube, spinning in front of the camera
+    static const StandardFixedTranslationVector kPoints[] = {
+        {-1.f, -1.f, -1.f}, {1.f, -1.f, -1.f}, {1.f, 1.f, -1.f}, {-1.f, 1.f, -1.f},
+        {-1.f, -1.f, 1.f},  {1.f, -1.f, 1.f},  {1.f, 1.f, 1.f},  {-1.f, 1.f, 1.f},
+    };
+    static const Shape3D::Edge kEdges[] = {
+        {0, 1}, {1, 2}, {2, 3}, {3, 0}, {4, 5}, {5, 6}, {6, 7}, {7, 4}, {0, 4}, {1, 5}, {2, 6}, {3, 7},
+    };
+    static const Shape3D kCube = SHAPE_3D(kPoints, kEdges);
+    constexpr uint32_t   kNumEdges = sizeof(kEdges) / sizeof(kEdges[0]);
+
+    // Close enough that some of the edges need clipping
+    constexpr uint32_t kNumCubes = 16;
+    Camera             camera;
+    FixedTransform3D   modelToWorld;
+
+    const uint64_t start = time_us_64();
+    for (uint32_t i = 0; i < s_numRepeats; ++i)
+    {
+        displayList.Clear();
+        for (uint32_t j = 0; j < kNumCubes; ++j)
+        {
+            const float angle = (float)(i + j) * 0.05f;
+            modelToWorld.setRotationXYZ(angle, angle * 0.7f, angle * 0.3f);
+            modelToWorld.setTranslation(StandardFixedTranslationVector(((float)j - 7.5f) * 0.5f, 0.f, 3.f));
+            kCube.Draw(displayList, modelToWorld, camera);
+        }
+    }
+    report("Shape3D::Draw", time_us_64() - start, (uint64_t)kNumEdges * kNumCubes * s_numRepeats, "edge");
+}
+
+static void benchmarkFixedPoint()
+{
+    constexpr uint32_t                          kNumValues = 1024;
+    std::vector<StandardFixedTranslationScalar> values;
+    for (uint32_t i = 0; i < kNumValues; ++i)
+    {
+        values.push_back(0.01f + (random01() * 100.f));
+    }
+
+    uint64_t start = time_us_64();
+    for (uint32_t i = 0; i < s_numRepeats; ++i)
+    {
+        int32_t checksum = 0;
+        for (const StandardFixedTranslationScalar& value : values)
+        {
+            checksum += (int32_t)value.sqrt().getStorage();
+        }
+        s_sink = checksum;
+    }
+    report("FixedPoint sqrt", time_us_64() - start, (uint64_t)kNumValues * s_numRepeats, "op");
+
+    start = time_us_64();
+    for (uint32_t i = 0; i < s_numRepeats; ++i)
+    {
+        int32_t checksum = 0;
+        for (uint32_t j = 1; j < kNumValues; ++j)
+        {
+            const StandardFixedTranslationScalar quotient = values[j - 1] / values[j];
+            checksum += (int32_t)quotient.getStorage();
+        }
+        s_sink = checksum;
+    }
+    report("FixedPoint divide", time_us_64() - start, (uint64_t)(kNumValues - 1) * s_numRepeats, "op");
+}
+
+static bool writeCsv(const char* pFilename)
+{
+    FILE* pFile = fopen(pFilename, "w");
+    if (pFile == nullptr)
+    {
+        printf("Can't open %s\n", pFilename);
+        return false;
+    }
+    for (const Result& result : s_results)
+    {
+        fprintf(pFile, "%s,%.1f\n", result.m_name.c_str(), result.m_nsPerItem);
+    }
+    fclose(pFile);
+    return true;
+}
+
+// Returns the number of results that have got slower
+static int compare(const char* pFilename, float tolerancePercent)
+{
+    FILE* pFile = fopen(pFilename, "r");
+    if (pFile == nullptr)
+    {
+        printf("Can't open %s\n", pFilename);
+        return 1;
+    }
+    int  numRegressions = 0;
+    char line[256];
+    printf("Compared with %s:\n", pFilename);
+    while (fgets(line, sizeof(line), pFile) != nullptr)
+    {
+        char* pComma = strrchr(line, ',');
+        if (pComma == nullptr)
+        {
+            continue;
+        }
+        *pComma                 = 0;
+        const double baselineNs = atof(pComma + 1);
+        for (const Result& result : s_results)
+        {
+            if ((result.m_name == line) && (baselineNs > 0.0))
+            {
+                const double changePercent = ((result.m_nsPerItem / baselineNs) - 1.0) * 100.0;
+                const bool   isRegression  = changePercent > tolerancePercent;
+                printf("  %-24s %+7.1f%%%s\n", line, changePercent, isRegression ? "  SLOWER" : "");
+                numRegressions += isRegression ? 1 : 0;
+            }
+        }
+    }
+    fclose(pFile);
+    return numRegressions;
+}
+
+static void usage()
+{
+    printf("Usage: benchmarks [--repeats n] [--csv results.csv] [--compare baseline.csv] [--tolerance percent]\n");
+}
+
+int main(int argc, char** argv)
+{
+    const char* pCsvFilename      = nullptr;
+    const char* pBaselineFilename = nullptr;
+    float       tolerancePercent  = 10.f;
+    for (int i = 1; i < argc; ++i)
+    {
+        const bool hasValue = (i + 1) < argc;
+        if ((strcmp(argv[i], "--repeats") == 0) && hasValue)
+        {
+            s_numRepeats = (uint32_t)atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--csv") == 0) && hasValue)
+        {
+            pCsvFilename = argv[++i];
+        }
+        else if ((strcmp(argv[i], "--compare") == 0) && hasValue)
+        {
+            pBaselineFilename = argv[++i];
+        }
+        else if ((strcmp(argv[i], "--tolerance") == 0) && hasValue)
+        {
+            tolerancePercent = (float)atof(argv[++i]);
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if (s_numRepeats == 0)
+    {
+        usage();
+        return 1;
+    }
+
+    Log::Init();
+    DisplayList displayList(8192, 16);
+    printf("Rendering hot paths, %u repeats:\n", s_numRepeats);
+    benchmarkVectors(displayList);
+    benchmarkText(displayList);
+    benchmarkShape3D(displayList);
+    benchmarkFixedPoint();
+
+    Benchmarks::Run();
+
+    if ((pCsvFilename != nullptr) && !writeCsv(pCsvFilename))
+    {
+        return 1;
+    }
+    if ((pBaselineFilename != nullptr) && (compare(pBaselineFilename, tolerancePercent) != 0))
+    {
+        return 1;
+    }
+    return 0;
+}
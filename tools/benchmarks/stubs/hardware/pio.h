@@ -0,0 +1,42 @@
+// Host stand-in for the Pico SDK header, for tools/benchmarks
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// Just the types that the DacOutput headers mention.
+
+#pragma once
+#include "pico/types.h"
+
+struct pio_hw_t;
+typedef pio_hw_t* PIO;
+
+struct pio_program_t
+{
+    const uint16_t* instructions;
+    uint8_t         length;
+    int8_t          origin;
+};
+
+struct pio_sm_config
+{
+    uint32_t clkdiv;
+    uint32_t execctrl;
+    uint32_t shiftctrl;
+    uint32_t pinctrl;
+};
@@ -0,0 +1,381 @@
+// Host harness for DacOutput's ring buffer backend
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// dacoutsim [seed] [dma rate]
+//
+// Runs src/dacoutring.cpp against a stand-in DMA channel, which wraps its
+// read address around the ring just like the RP2040's does.  Random frames
+// are pushed through DacOutput, with chunks of all sizes, all of the ways of
+// allocating buffer space, and changes of PIO SM program.  Each time the DMA
+// moves, it sends up to "dma rate" words, so a low rate keeps the producer
+// waiting for space, and a high rate keeps the DMA running dry.
+//
+// Every word is numbered, so it fails if any word is lost, repeated, sent to
+// the wrong program, or sent before it was written.  That checks...
+//   - That a chunk which ran off the end of the ring is copied back to the start
+//   - That the free space in the ring never includes anything still to be sent
+//   - That the start of a frame waits for enough to be queued up before the
+//     DMA is started, but never leaves the producer waiting for a DMA that
+//     hasn't been started
+
+#include "dacout.h"
+#include "dacoutputsm.h"
+#include "log.h"
+#include "pico/time.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static constexpr uint32_t kNumFrames = 200;
+
+// The same as in dacoutring.cpp
+static constexpr uint32_t kNumEntriesToQueueAtFrameStart
+    = ((DacOutput::kNumRingEntries / 2) < (DacOutput::kNumRingEntries - 1 - DacOutput::kNumEntriesPerBuffer))
+    ? (DacOutput::kNumRingEntries / 2) : (DacOutput::kNumRingEntries - 1 - DacOutput::kNumEntriesPerBuffer);
+
+// This many waits without a word being sent means the DMA is never going to move
+static constexpr uint32_t kMaxWaitsWithoutProgress = 1000000;
+
+static dma_hw_t s_dmaHw;
+dma_hw_t*       dma_hw = &s_dmaHw;
+static pio_hw_t s_pio0;
+pio_hw_t*       pio0 = &s_pio0;
+
+DacOutputPioSmConfig DacOutputPioSm::s_configs[(int)DacOutputPioSm::SmID::eCount] = {};
+
+void DacOutputPioSm::Init()
+{
+    for (uint32_t i = 0; i < (uint32_t)SmID::eCount; ++i)
+    {
+        s_configs[i].m_pio          = pio0;
+        s_configs[i].m_stateMachine = i;
+        s_configs[i].m_id           = i;
+    }
+}
+
+// Set when DacOutput switches to the idle program at the end of a frame,
+// after which it has to wait for kNumEntriesToQueueAtFrameStart again
+static bool s_isIdle = true;
+
+void DacOutputPioSmConfig::SetEnabled(bool enabled) const
+{
+    if (enabled && (this == &DacOutputPioSm::Idle()))
+    {
+        s_isIdle = true;
+    }
+}
+
+// The stand-in DMA channel
+static const int          kDmaChannelIdx     = 0;
+static uint               s_ringSizeBits     = 0;
+static volatile uint32_t* s_pWriteAddr       = nullptr;
+static uint32_t           s_numTransfersLeft = 0;
+static bool               s_dmaIsRunning     = false;
+static uint32_t           s_dmaRate          = 4;
+static uint64_t           s_timeUs           = 1;
+
+// What the producer has written, and what the DMA has sent
+struct Frame
+{
+    uint32_t m_firstWord;
+    bool     m_isFinalFlushed;
+};
+static std::vector<Frame>                       s_frames;
+static uint32_t                                 s_numFramesStarted        = 0;
+static std::vector<const DacOutputPioSmConfig*> s_wordPioConfigs;
+static uint32_t                                 s_numWordsSent            = 0;
+static uint32_t                                 s_numRingWraps            = 0;
+static uint32_t                                 s_numWaits                = 0;
+static uint32_t                                 s_numWaitsWithoutProgress = 0;
+
+static void fail(const char* message)
+{
+    printf("FAIL after %u of %u words: %s\n", s_numWordsSent, (uint32_t)s_wordPioConfigs.size(), message);
+    exit(1);
+}
+
+uint64_t time_us_64()
+{
+    return s_timeUs;
+}
+
+int dma_claim_unused_channel(bool)
+{
+    return kDmaChannelIdx;
+}
+
+void channel_config_set_ring(dma_channel_config*, bool write, uint sizeBits)
+{
+    if (write)
+    {
+        fail("The ring should wrap the read address");
+    }
+    s_ringSizeBits = sizeBits;
+}
+
+void dma_channel_configure(uint, const dma_channel_config*, volatile void* writeAddr, const volatile void* readAddr,
+                           uint transferCount, bool trigger)
+{
+    dma_hw->ch[kDmaChannelIdx].read_addr = (uintptr_t)readAddr;
+    s_pWriteAddr = (volatile uint32_t*)writeAddr;
+    s_numTransfersLeft = transferCount;
+    s_dmaIsRunning = trigger && (transferCount > 0);
+}
+
+void dma_channel_set_write_addr(uint, volatile void* writeAddr, bool)
+{
+    s_pWriteAddr = (volatile uint32_t*)writeAddr;
+}
+
+void dma_channel_set_trans_count(uint, uint32_t transCount, bool trigger)
+{
+    if (s_dmaIsRunning)
+    {
+        fail("The DMA was started again while it was still running");
+    }
+    if (trigger && (transCount > 0))
+    {
+        if ((s_numFramesStarted < s_frames.size()) && (s_numWordsSent == s_frames[s_numFramesStarted].m_firstWord))
+        {
+            // The start of a frame.  If the DMA has gone idle since the last
+            // one, then either enough has been queued up, or all of it has.
+            // Otherwise it carries straight on from the last frame.
+            const Frame&   frame          = s_frames[s_numFramesStarted];
+            const uint32_t numWordsQueued = (uint32_t)s_wordPioConfigs.size() - frame.m_firstWord;
+            if (s_isIdle && !frame.m_isFinalFlushed && (numWordsQueued < kNumEntriesToQueueAtFrameStart))
+            {
+                fail("The frame was started before enough was queued up");
+            }
+            ++s_numFramesStarted;
+        }
+        else if (s_isIdle)
+        {
+            fail("The DMA was started from idle in the middle of a frame");
+        }
+        s_isIdle = false;
+        if ((s_numWordsSent + transCount) > s_wordPioConfigs.size())
+        {
+            fail("The DMA was asked to send more than has been written");
+        }
+    }
+    s_numTransfersLeft = transCount;
+    s_dmaIsRunning = trigger && (transCount > 0);
+}
+
+// Sends up to s_dmaRate words, checking each one
+static void stepDma()
+{
+    ++s_timeUs;
+    uint32_t numWords = (uint32_t)rand() % (s_dmaRate + 1);
+    while (s_dmaIsRunning && (numWords-- > 0))
+    {
+        const uintptr_t readAddr = dma_hw->ch[kDmaChannelIdx].read_addr;
+        const uint32_t  word     = *(const uint32_t*)readAddr;
+        if (word != s_numWordsSent)
+        {
+            fail("The DMA read the wrong word from the ring");
+        }
+        const DacOutputPioSmConfig* pPioConfig = s_wordPioConfigs[word];
+        if (s_pWriteAddr != &pPioConfig->m_pio->txf[pPioConfig->m_stateMachine])
+        {
+            fail("A word was sent to the wrong PIO SM program");
+        }
+        ++s_numWordsSent;
+        s_numWaitsWithoutProgress = 0;
+
+        // Wrap the read address within the ring, like the hardware does
+        const uintptr_t ringMask     = ((uintptr_t)1 << s_ringSizeBits) - 1;
+        const uintptr_t nextReadAddr = (readAddr & ~ringMask) | ((readAddr + sizeof(uint32_t)) & ringMask);
+        if (nextReadAddr < readAddr)
+        {
+            ++s_numRingWraps;
+        }
+        dma_hw->ch[kDmaChannelIdx].read_addr = nextReadAddr;
+
+        if (--s_numTransfersLeft == 0)
+        {
+            s_dmaIsRunning = false;
+            dma_hw->intr.m_bits |= 1u << kDmaChannelIdx;
+        }
+    }
+}
+
+// DacOutput calls this while it's waiting for the DMA
+static void waitCallback(void*)
+{
+    ++s_numWaits;
+    if (++s_numWaitsWithoutProgress == kMaxWaitsWithoutProgress)
+    {
+        fail("DacOutput is waiting for the DMA, but the DMA isn't going anywhere");
+    }
+    stepDma();
+}
+
+static uint32_t randomNumWords()
+{
+    return (rand() % 3 == 0) ? (rand() % 3000) + 1 : (rand() % 100) + 1;
+}
+
+static void writeWords(uint32_t* pWords, uint32_t numWords, const DacOutputPioSmConfig& pioConfig)
+{
+    for (uint32_t i = 0; i < numWords; ++i)
+    {
+        pWords[i] = (uint32_t)s_wordPioConfigs.size();
+        s_wordPioConfigs.push_back(&pioConfig);
+    }
+}
+
+static void pushRandomChunk()
+{
+    // Mostly vectors, with the odd change of program
+    const DacOutputPioSmConfig* pPrograms[] = {&DacOutputPioSm::Vector(), &DacOutputPioSm::Points(),
+                                               &DacOutputPioSm::Raster()};
+    const DacOutputPioSmConfig& pioConfig = (rand() % 4 == 0) ? *pPrograms[rand() % 3] : DacOutputPioSm::Vector();
+    DacOutput::SetCurrentPioSm(pioConfig);
+
+    uint32_t numWords = randomNumWords();
+    switch (rand() % 3)
+    {
+    case 0:
+    {
+        // Do something else while waiting for space
+        if (numWords > DacOutput::kNumEntriesPerBuffer)
+        {
+            numWords = DacOutput::kNumEntriesPerBuffer;
+        }
+        uint32_t* pWords;
+        while ((pWords = DacOutput::TryAllocateBufferSpace(numWords)) == nullptr)
+        {
+            waitCallback(nullptr);
+        }
+        writeWords(pWords, numWords, pioConfig);
+        break;
+    }
+    case 1:
+    {
+        // Take what's there, and sometimes give some of it back
+        uint32_t       numAllocated;
+        uint32_t*      pWords = DacOutput::AllocateBufferSpace(numWords, numAllocated);
+        const uint32_t numUsed = ((numAllocated > 5) && (rand() % 3 == 0)) ? (numAllocated - 5) : numAllocated;
+        writeWords(pWords, numUsed, pioConfig);
+        DacOutput::GiveBackUnusedEntries(numAllocated - numUsed);
+        break;
+    }
+    default:
+    {
+        if (numWords > DacOutput::kNumEntriesPerBuffer)
+        {
+            numWords = DacOutput::kNumEntriesPerBuffer;
+        }
+        writeWords(DacOutput::AllocateBufferSpace(numWords), numWords, pioConfig);
+        break;
+    }
+    }
+
+    // Sometimes the producer is busy with something else for a while
+    if (rand() % 20 == 0)
+    {
+        const uint32_t numSteps = rand() % 3000;
+        for (uint32_t i = 0; i < numSteps; ++i)
+        {
+            stepDma();
+            DacOutput::Poll();
+        }
+    }
+    if (rand() % 10 == 0)
+    {
+        DacOutput::Flush();
+    }
+    else if (rand() % 10 == 0)
+    {
+        DacOutput::FlushWithoutWaiting();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const uint32_t seed = (argc > 1) ? (uint32_t)strtoul(argv[1], nullptr, 0) : 1;
+    s_dmaRate           = (argc > 2) ? (uint32_t)strtoul(argv[2], nullptr, 0) : 4;
+    if ((argc > 3) || (s_dmaRate == 0))
+    {
+        printf("Usage: dacoutsim [seed] [dma rate]\n");
+        return 1;
+    }
+    srand(seed);
+
+    Log::Init();
+    DacOutputPioSm::Init();
+    DacOutput::Init(DacOutputPioSm::Idle());
+    DacOutput::SetWaitCallback(waitCallback, nullptr);
+
+    for (uint32_t frameIdx = 0; frameIdx < kNumFrames; ++frameIdx)
+    {
+        s_frames.push_back({(uint32_t)s_wordPioConfigs.size(), false});
+        const uint32_t numChunks = (rand() % 60) + 1;
+        for (uint32_t i = 0; i < numChunks; ++i)
+        {
+            pushRandomChunk();
+        }
+
+        // A final flush with nothing in it doesn't end the DMA transfer, with
+        // either backend, so the next frame would carry on in the same one.
+        // Every frame here ends with something, so that its start can be checked.
+        DacOutput::SetCurrentPioSm(DacOutputPioSm::Vector());
+        writeWords(DacOutput::AllocateBufferSpace(1), 1, DacOutputPioSm::Vector());
+
+        // Both of these are checked against in dma_channel_set_trans_count
+        s_frames.back().m_isFinalFlushed = true;
+        if (rand() % 2)
+        {
+            DacOutput::Flush(true);
+        }
+        else
+        {
+            DacOutput::FlushWithoutWaiting(true);
+        }
+
+        const uint32_t numPolls = rand() % 50;
+        for (uint32_t i = 0; i < numPolls; ++i)
+        {
+            stepDma();
+            DacOutput::Poll();
+        }
+    }
+
+    // Let the DMA finish
+    while (s_numWordsSent < s_wordPioConfigs.size())
+    {
+        waitCallback(nullptr);
+        DacOutput::Poll();
+    }
+
+    if (s_numRingWraps == 0)
+    {
+        fail("The DMA never wrapped around the ring");
+    }
+    if (s_numFramesStarted != kNumFrames)
+    {
+        fail("Not every frame was started");
+    }
+    printf("OK %u words, %u ring wraps, %u waits, %u underruns\n", s_numWordsSent, s_numRingWraps, s_numWaits,
+           DacOutput::GetUnderrunStats().numUnderruns);
+    return 0;
+}
@@ -0,0 +1,81 @@
+// Host stand-in for the Pico SDK header, for tools/dacoutsim
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// Just what DacOutput's ring buffer backend needs.  The functions that do
+// anything are in main.cpp, which stands in for the DMA channel.
+
+#pragma once
+#include "pico/types.h"
+
+struct dma_channel_hw_t
+{
+    // A pointer, rather than 32 bits, so that it can point at the ring on the host
+    volatile uintptr_t read_addr;
+    volatile uintptr_t write_addr;
+    volatile uint32_t  transfer_count;
+    volatile uint32_t  ctrl_trig;
+};
+
+// Writing a 1 to a bit clears it, like the hardware's raw interrupt flags
+struct dma_intr_t
+{
+    uint32_t m_bits = 0;
+
+    dma_intr_t& operator=(uint32_t mask)
+    {
+        m_bits &= ~mask;
+        return *this;
+    }
+    operator uint32_t() const { return m_bits; }
+};
+
+struct dma_hw_t
+{
+    dma_channel_hw_t ch[12];
+    dma_intr_t       intr;
+};
+extern dma_hw_t* dma_hw;
+
+struct dma_channel_config
+{
+    uint32_t ctrl;
+};
+
+enum dma_channel_transfer_size
+{
+    DMA_SIZE_8,
+    DMA_SIZE_16,
+    DMA_SIZE_32
+};
+
+int  dma_claim_unused_channel(bool required);
+void dma_channel_configure(uint channel, const dma_channel_config* config, volatile void* write_addr,
+                           const volatile void* read_addr, uint transfer_count, bool trigger);
+void dma_channel_set_write_addr(uint channel, volatile void* write_addr, bool trigger);
+void dma_channel_set_trans_count(uint channel, uint32_t trans_count, bool trigger);
+void channel_config_set_ring(dma_channel_config* c, bool write, uint size_bits);
+
+static inline dma_channel_config dma_channel_get_default_config(uint) { return {}; }
+static inline void channel_config_set_transfer_data_size(dma_channel_config*, dma_channel_transfer_size) {}
+static inline void channel_config_set_read_increment(dma_channel_config*, bool) {}
+static inline void channel_config_set_write_increment(dma_channel_config*, bool) {}
+static inline void channel_config_set_dreq(dma_channel_config*, uint) {}
+static inline void dma_channel_set_config(uint, const dma_channel_config*, bool) {}
+static inline void dma_channel_set_irq0_enabled(uint, bool) {}
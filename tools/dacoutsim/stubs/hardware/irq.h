@@ -0,0 +1,33 @@
+// Host stand-in for the Pico SDK header, for tools/dacoutsim
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// The harness builds DacOutput with DAC_OUTPUT_DMA_IRQ set to 0, so the
+// interrupt is never used.
+
+#pragma once
+#include "pico/types.h"
+
+#define DMA_IRQ_0 11
+
+typedef void (*irq_handler_t)();
+
+static inline void irq_set_exclusive_handler(uint, irq_handler_t) {}
+static inline void irq_set_enabled(uint, bool) {}
+static inline void irq_set_pending(uint) {}
@@ -0,0 +1,50 @@
+// Host stand-in for the Pico SDK header, for tools/dacoutsim
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// Just what DacOutput's ring buffer backend needs.  The TX FIFOs are only
+// used for their addresses, to tell which program each word was sent to.
+
+#pragma once
+#include "pico/types.h"
+
+struct pio_hw_t
+{
+    volatile uint32_t txf[4];
+};
+typedef pio_hw_t* PIO;
+extern pio_hw_t* pio0;
+
+struct pio_program_t
+{
+    const uint16_t* instructions;
+    uint8_t         length;
+    int8_t          origin;
+};
+
+struct pio_sm_config
+{
+    uint32_t clkdiv;
+    uint32_t execctrl;
+    uint32_t shiftctrl;
+    uint32_t pinctrl;
+};
+
+static inline uint pio_get_dreq(PIO, uint, bool) { return 0; }
+static inline bool pio_sm_is_tx_fifo_empty(PIO, uint) { return true; }
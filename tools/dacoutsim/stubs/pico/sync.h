@@ -0,0 +1,29 @@
+// Host stand-in for the Pico SDK header, for tools/dacoutsim
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// The harness is single-threaded.  The DMA only moves when DacOutput waits
+// for it, or when the harness polls.
+
+#pragma once
+#include "pico/types.h"
+#include "pico/mutex.h"
+
+static inline void __dmb() {}
+static inline void tight_loop_contents() {}
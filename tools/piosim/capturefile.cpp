@@ -0,0 +1,147 @@
+// Reads frames captured by FrameCapture
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+#include "capturefile.h"
+#include "programs.h"
+
+#include "framecaptureformat.h"
+
+#include <cstdio>
+#include <cstring>
+
+static int hexDigit(char c)
+{
+    if ((c >= '0') && (c <= '9'))
+    {
+        return c - '0';
+    }
+    if ((c >= 'a') && (c <= 'f'))
+    {
+        return c - 'a' + 10;
+    }
+    if ((c >= 'A') && (c <= 'F'))
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Pick the CAP lines out of a serial log
+static void decodeHexLines(const std::vector<uint8_t>& text, std::vector<uint8_t>& outBytes)
+{
+    static const char kPrefix[]    = "CAP ";
+    const size_t      prefixLength = strlen(kPrefix);
+    size_t            lineStart    = 0;
+    while (lineStart < text.size())
+    {
+        size_t lineEnd = lineStart;
+        while ((lineEnd < text.size()) && (text[lineEnd] != '\n'))
+        {
+            ++lineEnd;
+        }
+        if (((lineEnd - lineStart) > prefixLength) && (memcmp(&text[lineStart], kPrefix, prefixLength) == 0))
+        {
+            for (size_t i = lineStart + prefixLength; (i + 1) < lineEnd; i += 2)
+            {
+                const int high = hexDigit((char)text[i]);
+                const int low  = hexDigit((char)text[i + 1]);
+                if ((high < 0) || (low < 0))
+                {
+                    break;
+                }
+                outBytes.push_back((uint8_t)((high << 4) | low));
+            }
+        }
+        lineStart = lineEnd + 1;
+    }
+}
+
+bool CaptureFile::Load(const char* pFilename, std::vector<uint8_t>& outBytes)
+{
+    FILE* pFile = fopen(pFilename, "rb");
+    if (pFile == nullptr)
+    {
+        printf("Can't open %s\n", pFilename);
+        return false;
+    }
+    std::vector<uint8_t> contents;
+    uint8_t              buffer[4096];
+    size_t               numBytesRead;
+    while ((numBytesRead = fread(buffer, 1, sizeof(buffer), pFile)) > 0)
+    {
+        contents.insert(contents.end(), buffer, buffer + numBytesRead);
+    }
+    fclose(pFile);
+
+    outBytes.clear();
+    uint32_t magic = 0;
+    if (contents.size() >= sizeof(magic))
+    {
+        memcpy(&magic, contents.data(), sizeof(magic));
+    }
+    if (magic == FrameCaptureHeader::kMagic)
+    {
+        outBytes.swap(contents);
+    }
+    else
+    {
+        decodeHexLines(contents, outBytes);
+    }
+    if (!FrameCaptureReader(outBytes.data(), (uint32_t)outBytes.size()).IsValid())
+    {
+        printf("%s isn't a frame capture\n", pFilename);
+        return false;
+    }
+    return true;
+}
+
+bool CaptureFile::LoadRuns(const char* pFilename, std::vector<Run>& outRuns)
+{
+    std::vector<uint8_t> bytes;
+    if (!Load(pFilename, bytes))
+    {
+        return false;
+    }
+    FrameCaptureReader        reader(bytes.data(), (uint32_t)bytes.size());
+    FrameCaptureReader::Chunk chunk;
+    while (reader.NextChunk(chunk))
+    {
+        if (chunk.m_numWords > 0)
+        {
+            const PioSim::Program* pProgram = PioPrograms::FromId(chunk.m_programId);
+            if (pProgram == nullptr)
+            {
+                printf("%s has words for unknown program %u\n", pFilename, chunk.m_programId);
+                return false;
+            }
+            if (outRuns.empty() || outRuns.back().m_endOfFrame || (outRuns.back().m_pProgram != pProgram))
+            {
+                outRuns.push_back({pProgram, std::vector<uint32_t>(), false});
+            }
+            outRuns.back().m_words.insert(outRuns.back().m_words.end(), chunk.m_pWords,
+                                          chunk.m_pWords + chunk.m_numWords);
+        }
+        if (chunk.m_endOfFrame && !outRuns.empty())
+        {
+            outRuns.back().m_endOfFrame = true;
+        }
+    }
+    return true;
+}
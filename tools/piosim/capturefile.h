@@ -0,0 +1,46 @@
+// Reads frames captured by FrameCapture
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+#pragma once
+#include "piosim.h"
+
+#include <cstdint>
+#include <vector>
+
+class CaptureFile
+{
+public:
+    // Words for one PIO program, as the DMA would have sent them without
+    // stopping the state machine.  Consecutive chunks for the same program
+    // are chained together on the Pico, so they're one run here too.
+    struct Run
+    {
+        const PioSim::Program* m_pProgram;
+        std::vector<uint32_t>  m_words;
+        bool                   m_endOfFrame;
+    };
+
+    // Either a binary capture (see src/framecaptureformat.h), or a serial log
+    // with the CAP lines that FrameCapture::DumpToSerial prints in it.
+    static bool Load(const char* pFilename, std::vector<uint8_t>& outBytes);
+
+    // Load, and split into runs
+    static bool LoadRuns(const char* pFilename, std::vector<Run>& outRuns);
+};
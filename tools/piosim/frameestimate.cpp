@@ -0,0 +1,166 @@
+// Checks DisplayList::EstimateFrameDurationUs against the PIO simulator
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// frameestimate [--tolerance percent]
+//
+// Fills in a DisplayList with points, vectors and a raster display, and
+// outputs it through the host DacOutput from tools/benchmarks.  The words
+// for each PIO program are run through the simulator, and the total is
+// compared with what EstimateFrameDurationUs said it would be.  Returns
+// non-zero if they differ by more than the tolerance, which is 2% by default.
+// Neither of them includes the time taken to switch between programs.
+
+#include "piosim.h"
+#include "programs.h"
+
+#include "dacoutputsm.h"
+#include "dacouttiming.h"
+#include "displaylist.h"
+#include "hostplatform.h"
+#include "log.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+struct ProgramRun
+{
+    const PioSim::Program* m_pProgram;
+    std::vector<uint32_t>  m_words;
+};
+
+static std::vector<ProgramRun> s_runs;
+
+// Consecutive buffers for the same program are chained together on the Pico,
+// so they're one run here too.
+static void onFlush(const DacOutputPioSmConfig* pConfig, const uint32_t* pWords, uint32_t numWords)
+{
+    const PioSim::Program* pProgram = PioPrograms::FromId(pConfig->m_id);
+    if (s_runs.empty() || (s_runs.back().m_pProgram != pProgram))
+    {
+        s_runs.push_back({pProgram, {}});
+    }
+    s_runs.back().m_words.insert(s_runs.back().m_words.end(), pWords, pWords + numWords);
+}
+
+static constexpr uint32_t kRasterWidth  = 64;
+static constexpr uint32_t kRasterHeight = 48;
+
+// A gradient, with some of it dark, so there's a mix of holds
+static const uint8_t* rasterScanline(uint32_t scanline, void*)
+{
+    static uint8_t s_pixels[kRasterWidth];
+    for (uint32_t x = 0; x < kRasterWidth; ++x)
+    {
+        s_pixels[x] = (x < scanline) ? 0 : (uint8_t)((x * 4) + scanline);
+    }
+    return s_pixels;
+}
+
+static void fillDisplayList(DisplayList& displayList)
+{
+    // A grid of points at different brightnesses
+    for (uint32_t i = 0; i < 64; ++i)
+    {
+        displayList.PushPoint(DisplayListScalar(0.1f + (float)(i & 7) * 0.1f),
+                              DisplayListScalar(0.1f + (float)(i >> 3) * 0.1f), Intensity((float)(i & 3) * 0.1f));
+    }
+
+    // Some polygons, with jumps between them and different intensities
+    for (uint32_t shape = 0; shape < 8; ++shape)
+    {
+        const float x = 0.05f + (float)shape * 0.11f;
+        const float y = 0.2f + (float)(shape & 3) * 0.15f;
+        displayList.PushVector(DisplayListScalar(x), DisplayListScalar(y), 0.f);
+        displayList.PushVector(DisplayListScalar(x + 0.1f), DisplayListScalar(y), 1.f);
+        displayList.PushVector(DisplayListScalar(x + 0.1f), DisplayListScalar(y + 0.3f), 0.75f);
+        displayList.PushVector(DisplayListScalar(x), DisplayListScalar(y + 0.05f), 1.5f);
+        displayList.PushVector(DisplayListScalar(x), DisplayListScalar(y), 1.f);
+    }
+
+    DisplayList::RasterDisplay rasterDisplay;
+    rasterDisplay.width            = kRasterWidth;
+    rasterDisplay.height           = kRasterHeight;
+    rasterDisplay.mode             = DisplayList::RasterDisplay::Mode::e8BitGamma;
+    rasterDisplay.topLeft          = DisplayListVector2(0.25f, 0.75f);
+    rasterDisplay.bottomRight      = DisplayListVector2(0.75f, 0.25f);
+    rasterDisplay.scanlineCallback = rasterScanline;
+    displayList.PushRasterDisplay(rasterDisplay);
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t tolerancePercent = 2;
+    for (int i = 1; i < argc; ++i)
+    {
+        if ((strcmp(argv[i], "--tolerance") == 0) && ((i + 1) < argc))
+        {
+            tolerancePercent = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        }
+        else
+        {
+            printf("Usage: frameestimate [--tolerance percent]\n");
+            return 1;
+        }
+    }
+
+    Log::Init();
+    DacOutputPioSm::Init();
+    HostPlatform::SetFlushCallback(onFlush);
+
+    DisplayList displayList(4096, 1024);
+    fillDisplayList(displayList);
+    displayList.SortByPriority();
+    const uint32_t estimatedUs = displayList.EstimateFrameDurationUs();
+    displayList.OutputToDACs();
+
+    uint64_t sysCycles = 0;
+    for (const ProgramRun& programRun : s_runs)
+    {
+        if (programRun.m_pProgram == &PioPrograms::Idle())
+        {
+            continue;
+        }
+        PioSim          sim(*programRun.m_pProgram);
+        PioSim::Results results;
+        sim.Run(programRun.m_words.data(), (uint32_t)programRun.m_words.size(), 100000000, results);
+        if (results.m_unsupported)
+        {
+            printf("FAIL: %s hit unsupported instruction 0x%04x\n", programRun.m_pProgram->m_name,
+                   results.m_unsupportedInstruction);
+            return 1;
+        }
+        printf("  %s: %u words, %llu us\n", programRun.m_pProgram->m_name, (uint32_t)programRun.m_words.size(),
+               (unsigned long long)(results.m_numSysCycles / DacOutTiming::kSysCyclesPerUs));
+        sysCycles += results.m_numSysCycles;
+    }
+
+    const uint32_t simulatedUs = (uint32_t)(sysCycles / DacOutTiming::kSysCyclesPerUs);
+    const uint32_t differenceUs
+        = (estimatedUs > simulatedUs) ? (estimatedUs - simulatedUs) : (simulatedUs - estimatedUs);
+    printf("Estimated %u us, simulated %u us\n", estimatedUs, simulatedUs);
+    if ((differenceUs * 100) > (simulatedUs * tolerancePercent))
+    {
+        printf("FAIL: The estimate is out by more than %u%%\n", tolerancePercent);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,327 @@
+// Host-side simulator for the DAC output PIO programs
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// piosim --check
+//     Runs test patterns through each program and checks that they take as
+//     long as DacOutTiming says they do.  Returns non-zero if they don't.
+//
+// piosim <idle|vector|points|raster> [words.bin] [--timeline out.csv] [--cycles n]
+//     Runs the words in words.bin (raw little-endian 32-bit DAC words, just as
+//     they'd go to the DMA) through the program, and reports how long they
+//     took.  The idle program doesn't take any words, so it just runs for
+//     --cycles state machine cycles.  The DAC timeline can be written out as CSV.
+//
+// piosim capture <capture>
+//     Runs each frame of a capture from FrameCapture, either the binary file or
+//     a serial log with the dump in it, and reports how long each one would
+//     take.  That doesn't include the time taken to switch between programs.
+
+#include "capturefile.h"
+#include "piosim.h"
+#include "programs.h"
+
+#include "dacouttiming.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+static const PioSim::Program& s_idle   = PioPrograms::Idle();
+static const PioSim::Program& s_vector = PioPrograms::Vector();
+static const PioSim::Program& s_points = PioPrograms::Points();
+static const PioSim::Program& s_raster = PioPrograms::Raster();
+
+// Plenty for any of the test patterns, and stops a broken program from running forever
+static constexpr uint64_t kDefaultMaxSmCycles = 100000000;
+
+static uint32_t s_numFailures = 0;
+
+static void expect(const char* what, uint64_t actual, uint64_t expected)
+{
+    if (actual != expected)
+    {
+        printf("FAIL: %s took %llu cycles, expected %llu\n", what, (unsigned long long)actual,
+               (unsigned long long)expected);
+        ++s_numFailures;
+    }
+}
+
+static void run(const PioSim::Program& program, const std::vector<uint32_t>& words, PioSim::Results& outResults,
+                uint64_t maxSmCycles = kDefaultMaxSmCycles)
+{
+    PioSim sim(program);
+    sim.Run(words.data(), (uint32_t)words.size(), maxSmCycles, outResults);
+    if (outResults.m_unsupported)
+    {
+        printf("FAIL: %s hit unsupported instruction 0x%04x\n", program.m_name, outResults.m_unsupportedInstruction);
+        ++s_numFailures;
+    }
+}
+
+static uint32_t xyWord(uint32_t x, uint32_t y)
+{
+    return (x & 0xfff) | ((y & 0xfff) << 12);
+}
+
+static void checkVector()
+{
+    // The Z register starts at 0, so only the first word changes Z
+    std::vector<uint32_t> words;
+    for (uint32_t i = 0; i < 64; ++i)
+    {
+        words.push_back(xyWord(i * 17, i * 31) | (0x80u << 24));
+    }
+    PioSim::Results results;
+    run(s_vector, words, results);
+    expect("vector with a Z change", results.m_cyclesPerWord[0],
+           DacOutTiming::kVectorCyclesPerWord + DacOutTiming::kVectorCyclesPerZChange);
+    for (uint32_t i = 1; i < results.m_cyclesPerWord.size(); ++i)
+    {
+        expect("vector", results.m_cyclesPerWord[i], DacOutTiming::kVectorCyclesPerWord);
+    }
+}
+
+static void checkPoints()
+{
+    for (uint32_t longDelay = 0; longDelay < 2; ++longDelay)
+    {
+        std::vector<uint32_t> words;
+        for (uint32_t count = 0; count < 128; ++count)
+        {
+            words.push_back(xyWord(count, count) | (longDelay << 24) | (count << 25));
+        }
+        PioSim::Results results;
+        run(s_points, words, results);
+        for (uint32_t i = 0; i < results.m_cyclesPerWord.size(); ++i)
+        {
+            expect(longDelay ? "point with long delay" : "point with short delay", results.m_cyclesPerWord[i],
+                   DacOutTiming::PointCycles(words[i] & 0xff000000));
+        }
+    }
+}
+
+// Raster commands are 16-bits, two to a word.  Each one is finished off by
+// fetching the next, so the stream is timed with and without some extra
+// commands, and the difference is how long the extra ones took.
+static uint64_t rasterStreamCycles(const std::vector<uint16_t>& commands)
+{
+    std::vector<uint32_t> words;
+    for (uint32_t i = 0; i < commands.size(); i += 2)
+    {
+        words.push_back(commands[i] | ((uint32_t)commands[i + 1] << 16));
+    }
+    PioSim::Results results;
+    run(s_raster, words, results);
+    return results.m_numSmCycles;
+}
+
+static void checkRaster()
+{
+    // Start the beam on a scanline
+    std::vector<uint16_t> commands = {0, 100};
+    const uint64_t        baseCycles = rasterStreamCycles(commands);
+
+    for (uint32_t hold = 0; hold < 16; ++hold)
+    {
+        std::vector<uint16_t> pixels = commands;
+        pixels.push_back((uint16_t)(1000 | (hold << 12)));
+        pixels.push_back((uint16_t)(2000 | (hold << 12)));
+        expect("raster pixels", rasterStreamCycles(pixels) - baseCycles, 2 * DacOutTiming::RasterPixelCycles(hold));
+    }
+
+    std::vector<uint16_t> scanline = commands;
+    scanline.push_back(0);
+    scanline.push_back(200);
+    expect("raster scanline", rasterStreamCycles(scanline) - baseCycles, DacOutTiming::kRasterCyclesPerScanline);
+}
+
+static void checkIdle()
+{
+    // It should visit all four corners
+    PioSim::Results results;
+    run(s_idle, std::vector<uint32_t>(), results, 1024);
+    uint32_t cornersSeen = 0;
+    uint32_t x = 0, y = 0;
+    for (const PioSim::DacEvent& event : results.m_timeline)
+    {
+        ((event.m_dac == PioSim::Dac::eX) ? x : y) = event.m_value;
+        cornersSeen |= 1 << (((x != 0) ? 1 : 0) + ((y != 0) ? 2 : 0));
+    }
+    if (cornersSeen != 0xf)
+    {
+        printf("FAIL: idle didn't visit all four corners\n");
+        ++s_numFailures;
+    }
+}
+
+static int check()
+{
+    checkVector();
+    checkPoints();
+    checkRaster();
+    checkIdle();
+    printf("%s\n", (s_numFailures == 0) ? "All timings match DacOutTiming" : "Timings don't match DacOutTiming");
+    return (s_numFailures == 0) ? 0 : 1;
+}
+
+static void report(const PioSim::Program& program, const PioSim::Results& results)
+{
+    printf("%s: %u words, %llu PIO cycles at divider %u, %llu system cycles (%llu us)\n", program.m_name,
+           results.m_numWordsPulled, (unsigned long long)results.m_numSmCycles, program.m_clockDivider,
+           (unsigned long long)results.m_numSysCycles,
+           (unsigned long long)(results.m_numSysCycles / DacOutTiming::kSysCyclesPerUs));
+    if (results.m_cyclesPerWord.empty())
+    {
+        return;
+    }
+
+    // How many words took each number of cycles
+    uint32_t maxCycles = 0;
+    for (uint32_t cycles : results.m_cyclesPerWord)
+    {
+        maxCycles = (cycles > maxCycles) ? cycles : maxCycles;
+    }
+    std::vector<uint32_t> histogram(maxCycles + 1, 0);
+    for (uint32_t cycles : results.m_cyclesPerWord)
+    {
+        ++histogram[cycles];
+    }
+    printf("PIO cycles per word:\n");
+    for (uint32_t cycles = 0; cycles <= maxCycles; ++cycles)
+    {
+        if (histogram[cycles] != 0)
+        {
+            printf("  %5u: %u\n", cycles, histogram[cycles]);
+        }
+    }
+}
+
+static int runCapture(const char* pFilename)
+{
+    std::vector<CaptureFile::Run> runs;
+    if (!CaptureFile::LoadRuns(pFilename, runs))
+    {
+        return 1;
+    }
+    uint32_t frameIdx       = 0;
+    uint64_t frameSysCycles = 0;
+    bool     isStartOfFrame = true;
+    for (uint32_t i = 0; i < runs.size(); ++i)
+    {
+        const CaptureFile::Run& captureRun = runs[i];
+        if (isStartOfFrame)
+        {
+            printf("Frame %u\n", frameIdx);
+            isStartOfFrame = false;
+        }
+        PioSim::Results results;
+        run(*captureRun.m_pProgram, captureRun.m_words, results);
+        printf("  %s: %u words, %llu us\n", captureRun.m_pProgram->m_name, (uint32_t)captureRun.m_words.size(),
+               (unsigned long long)(results.m_numSysCycles / DacOutTiming::kSysCyclesPerUs));
+        frameSysCycles += results.m_numSysCycles;
+        if (captureRun.m_endOfFrame || ((i + 1) == runs.size()))
+        {
+            printf("  Total: %llu us\n", (unsigned long long)(frameSysCycles / DacOutTiming::kSysCyclesPerUs));
+            frameSysCycles = 0;
+            isStartOfFrame = true;
+            ++frameIdx;
+        }
+    }
+    return (s_numFailures == 0) ? 0 : 1;
+}
+
+static bool writeTimeline(const char* pFilename, const PioSim::Results& results)
+{
+    FILE* pFile = fopen(pFilename, "w");
+    if (pFile == nullptr)
+    {
+        printf("Can't open %s\n", pFilename);
+        return false;
+    }
+    static const char* const s_dacNames[] = {"x", "y", "z"};
+    fprintf(pFile, "sys_cycle,dac,value\n");
+    for (const PioSim::DacEvent& event : results.m_timeline)
+    {
+        fprintf(pFile, "%llu,%s,%u\n", (unsigned long long)event.m_sysCycle, s_dacNames[(int)event.m_dac],
+                event.m_value);
+    }
+    fclose(pFile);
+    return true;
+}
+
+static void usage()
+{
+    printf("Usage: piosim --check\n");
+    printf("       piosim <idle|vector|points|raster> [words.bin] [--timeline out.csv] [--cycles n]\n");
+    printf("       piosim capture <capture>\n");
+}
+
+int main(int argc, char** argv)
+{
+    if ((argc == 2) && (strcmp(argv[1], "--check") == 0))
+    {
+        return check();
+    }
+    if ((argc == 3) && (strcmp(argv[1], "capture") == 0))
+    {
+        return runCapture(argv[2]);
+    }
+    if (argc < 2)
+    {
+        usage();
+        return 1;
+    }
+
+    const PioSim::Program* pProgram = PioPrograms::Find(argv[1]);
+    if (pProgram == nullptr)
+    {
+        usage();
+        return 1;
+    }
+
+    const char*           pTimelineFilename = nullptr;
+    uint64_t              maxSmCycles       = (pProgram == &s_idle) ? 1024 : kDefaultMaxSmCycles;
+    std::vector<uint32_t> words;
+    for (int i = 2; i < argc; ++i)
+    {
+        if ((strcmp(argv[i], "--timeline") == 0) && ((i + 1) < argc))
+        {
+            pTimelineFilename = argv[++i];
+        }
+        else if ((strcmp(argv[i], "--cycles") == 0) && ((i + 1) < argc))
+        {
+            maxSmCycles = strtoull(argv[++i], nullptr, 0);
+        }
+        else if (!PioSim::LoadWords(argv[i], words))
+        {
+            return 1;
+        }
+    }
+
+    PioSim::Results results;
+    run(*pProgram, words, results, maxSmCycles);
+    report(*pProgram, results);
+    if ((pTimelineFilename != nullptr) && !writeTimeline(pTimelineFilename, results))
+    {
+        return 1;
+    }
+    return (s_numFailures == 0) ? 0 : 1;
+}
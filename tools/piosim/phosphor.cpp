@@ -0,0 +1,357 @@
+// Renders DAC words as they'd look on the scope
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// phosphor [options] <program> <words.bin> [<program> <words.bin> ...]
+//
+// Runs each file of DAC words through the PIO program that was active for
+// them, in order, and adds up how long the beam spends at each pixel.  The
+// brightness of each pixel then comes from how long the beam dwelt there,
+// the way it does on a real phosphor, so the effects of the step counts and
+// point delays show up in the image.
+//
+// Instead of a program and its words, there can be "capture <capture>", for
+// all the frames in a capture from FrameCapture.
+//
+// Options...
+//   --out <image.pgm>      Where to write the image.  Default phosphor.pgm
+//   --size <n>             Image width and height.  Default 512
+//   --exposure <us>        Dwell time that gives about 63% brightness.
+//                          By default it's picked from the image itself.
+//   --persistence <us>     Phosphor decay time constant.  The default of 0
+//                          means no decay, so everything is equally bright.
+//   --compare <golden.pgm> Compare the image with a golden one, and return
+//                          non-zero if any pixel differs by more than...
+//   --tolerance <n>        ...this.  0 to 255, default 0.
+//
+// The Z DAC doesn't change the brightness here, because nothing drives it yet.
+
+#include "capturefile.h"
+#include "piosim.h"
+#include "programs.h"
+
+#include "dacouttiming.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+static constexpr uint32_t kDacMax = 0xfff;
+
+class PhosphorImage
+{
+public:
+    PhosphorImage(uint32_t size, float persistenceCycles)
+    : m_size(size)
+    , m_persistenceCycles(persistenceCycles)
+    , m_dwell(size * size, 0.f)
+    {
+    }
+
+    // Add the DAC timeline from one program's run.  The times are relative to
+    // the start of the run, which was at startCycle.
+    void AddTimeline(const PioSim::Results& results, uint64_t startCycle)
+    {
+        for (uint32_t i = 0; i < results.m_timeline.size(); ++i)
+        {
+            const PioSim::DacEvent& event = results.m_timeline[i];
+            if (event.m_dac == PioSim::Dac::eX)
+            {
+                m_beamX = event.m_value;
+            }
+            else if (event.m_dac == PioSim::Dac::eY)
+            {
+                m_beamY = event.m_value;
+            }
+            // The beam stays here until the next change, or the end of the run
+            const uint64_t endCycle = ((i + 1) < results.m_timeline.size()) ? results.m_timeline[i + 1].m_sysCycle
+                                                                            : results.m_numSysCycles;
+            if (endCycle > event.m_sysCycle)
+            {
+                m_events.push_back({startCycle + event.m_sysCycle, endCycle - event.m_sysCycle, m_beamX, m_beamY});
+            }
+        }
+    }
+
+    // Once all the timelines have been added
+    void Accumulate(uint64_t endCycle)
+    {
+        for (const Dwell& dwell : m_events)
+        {
+            float weight = (float)dwell.m_numCycles;
+            if (m_persistenceCycles > 0.f)
+            {
+                // How much it's faded by the end
+                const float age = (float)(endCycle - dwell.m_startCycle) - (0.5f * dwell.m_numCycles);
+                weight *= expf(-age / m_persistenceCycles);
+            }
+            splat(dwell.m_x, dwell.m_y, weight);
+        }
+    }
+
+    // Phosphor saturates, so 1 - e^(-dwell / exposure)
+    void Expose(float exposureCycles, std::vector<uint8_t>& outPixels) const
+    {
+        outPixels.resize(m_dwell.size());
+        for (uint32_t i = 0; i < m_dwell.size(); ++i)
+        {
+            const float brightness = 1.f - expf(-m_dwell[i] / exposureCycles);
+            outPixels[i]           = (uint8_t)((brightness * 255.f) + 0.5f);
+        }
+    }
+
+    // Something that makes the brightest parts of the image nearly saturated
+    float AutoExposure() const
+    {
+        std::vector<float> litPixels;
+        for (float dwell : m_dwell)
+        {
+            if (dwell > 0.f)
+            {
+                litPixels.push_back(dwell);
+            }
+        }
+        if (litPixels.empty())
+        {
+            return 1.f;
+        }
+        const size_t percentileIdx = (litPixels.size() * 99) / 100;
+        std::nth_element(litPixels.begin(), litPixels.begin() + percentileIdx, litPixels.end());
+        return litPixels[percentileIdx] * 0.5f;
+    }
+
+private:
+    struct Dwell
+    {
+        uint64_t m_startCycle;
+        uint64_t m_numCycles;
+        uint32_t m_x;
+        uint32_t m_y;
+    };
+
+    // Share the dwell between the four nearest pixels
+    void splat(uint32_t dacX, uint32_t dacY, float weight)
+    {
+        const float scale = (float)(m_size - 1) / (float)kDacMax;
+        const float x     = (dacX & kDacMax) * scale;
+        const float y     = (float)(m_size - 1) - ((dacY & kDacMax) * scale); // Y is up on the scope
+        const uint32_t x0 = (uint32_t)x;
+        const uint32_t y0 = (uint32_t)y;
+        const float    fx = x - x0;
+        const float    fy = y - y0;
+        add(x0, y0, weight * (1.f - fx) * (1.f - fy));
+        add(x0 + 1, y0, weight * fx * (1.f - fy));
+        add(x0, y0 + 1, weight * (1.f - fx) * fy);
+        add(x0 + 1, y0 + 1, weight * fx * fy);
+    }
+
+    void add(uint32_t x, uint32_t y, float weight)
+    {
+        if ((x < m_size) && (y < m_size))
+        {
+            m_dwell[(y * m_size) + x] += weight;
+        }
+    }
+
+    uint32_t           m_size;
+    float              m_persistenceCycles;
+    std::vector<float> m_dwell;
+    std::vector<Dwell> m_events;
+    uint32_t           m_beamX = 0;
+    uint32_t           m_beamY = 0;
+};
+
+static bool writePgm(const char* pFilename, uint32_t size, const std::vector<uint8_t>& pixels)
+{
+    FILE* pFile = fopen(pFilename, "wb");
+    if (pFile == nullptr)
+    {
+        printf("Can't open %s\n", pFilename);
+        return false;
+    }
+    fprintf(pFile, "P5\n%u %u\n255\n", size, size);
+    fwrite(pixels.data(), 1, pixels.size(), pFile);
+    fclose(pFile);
+    return true;
+}
+
+static bool readPgm(const char* pFilename, uint32_t& outSize, std::vector<uint8_t>& outPixels)
+{
+    FILE* pFile = fopen(pFilename, "rb");
+    if (pFile == nullptr)
+    {
+        printf("Can't open %s\n", pFilename);
+        return false;
+    }
+    uint32_t width, height, maxValue;
+    const bool ok = (fscanf(pFile, "P5 %u %u %u", &width, &height, &maxValue) == 3) && (width == height)
+                    && (maxValue == 255) && (fgetc(pFile) != EOF);
+    if (ok)
+    {
+        outSize = width;
+        outPixels.resize(width * height);
+        if (fread(outPixels.data(), 1, outPixels.size(), pFile) != outPixels.size())
+        {
+            fclose(pFile);
+            printf("%s is too short\n", pFilename);
+            return false;
+        }
+    }
+    else
+    {
+        printf("%s isn't a square 8-bit PGM\n", pFilename);
+    }
+    fclose(pFile);
+    return ok;
+}
+
+static void usage()
+{
+    printf("Usage: phosphor [--out image.pgm] [--size n] [--exposure us] [--persistence us]\n");
+    printf("                [--compare golden.pgm] [--tolerance n]\n");
+    printf("                <vector|points|raster|capture> <file> [<program> <file> ...]\n");
+}
+
+int main(int argc, char** argv)
+{
+    const char* pOutFilename    = "phosphor.pgm";
+    const char* pGoldenFilename = nullptr;
+    uint32_t    size            = 512;
+    float       exposureUs      = 0.f;
+    float       persistenceUs   = 0.f;
+    uint32_t    tolerance       = 0;
+
+    std::vector<CaptureFile::Run> runs;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const bool hasValue = (i + 1) < argc;
+        if ((strcmp(argv[i], "--out") == 0) && hasValue)
+        {
+            pOutFilename = argv[++i];
+        }
+        else if ((strcmp(argv[i], "--size") == 0) && hasValue)
+        {
+            size = (uint32_t)atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--exposure") == 0) && hasValue)
+        {
+            exposureUs = (float)atof(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--persistence") == 0) && hasValue)
+        {
+            persistenceUs = (float)atof(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--compare") == 0) && hasValue)
+        {
+            pGoldenFilename = argv[++i];
+        }
+        else if ((strcmp(argv[i], "--tolerance") == 0) && hasValue)
+        {
+            tolerance = (uint32_t)atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "capture") == 0) && hasValue)
+        {
+            if (!CaptureFile::LoadRuns(argv[++i], runs))
+            {
+                return 1;
+            }
+        }
+        else if (PioPrograms::Find(argv[i]) && (PioPrograms::Find(argv[i]) != &PioPrograms::Idle()) && hasValue)
+        {
+            runs.push_back({PioPrograms::Find(argv[i]), std::vector<uint32_t>(), true});
+            if (!PioSim::LoadWords(argv[++i], runs.back().m_words))
+            {
+                return 1;
+            }
+        }
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if (runs.empty() || (size < 2))
+    {
+        usage();
+        return 1;
+    }
+
+    // Run them all back to back
+    PhosphorImage image(size, persistenceUs * DacOutTiming::kSysCyclesPerUs);
+    uint64_t      cycle = 0;
+    for (const CaptureFile::Run& run : runs)
+    {
+        PioSim          sim(*run.m_pProgram);
+        PioSim::Results results;
+        sim.Run(run.m_words.data(), (uint32_t)run.m_words.size(), ~0ull, results);
+        if (results.m_unsupported)
+        {
+            printf("%s hit unsupported instruction 0x%04x\n", run.m_pProgram->m_name, results.m_unsupportedInstruction);
+            return 1;
+        }
+        image.AddTimeline(results, cycle);
+        cycle += results.m_numSysCycles;
+    }
+    image.Accumulate(cycle);
+
+    const float exposureCycles
+        = (exposureUs > 0.f) ? (exposureUs * DacOutTiming::kSysCyclesPerUs) : image.AutoExposure();
+    std::vector<uint8_t> pixels;
+    image.Expose(exposureCycles, pixels);
+    printf("%llu us of beam time, exposure %.3f us\n", (unsigned long long)(cycle / DacOutTiming::kSysCyclesPerUs),
+           exposureCycles / DacOutTiming::kSysCyclesPerUs);
+    if (!writePgm(pOutFilename, size, pixels))
+    {
+        return 1;
+    }
+
+    if (pGoldenFilename != nullptr)
+    {
+        uint32_t             goldenSize;
+        std::vector<uint8_t> goldenPixels;
+        if (!readPgm(pGoldenFilename, goldenSize, goldenPixels))
+        {
+            return 1;
+        }
+        if (goldenSize != size)
+        {
+            printf("%s is %u pixels, not %u\n", pGoldenFilename, goldenSize, size);
+            return 1;
+        }
+        uint32_t maxDifference   = 0;
+        uint64_t totalDifference = 0;
+        for (uint32_t i = 0; i < pixels.size(); ++i)
+        {
+            const uint32_t difference = (uint32_t)abs((int)pixels[i] - (int)goldenPixels[i]);
+            maxDifference             = (difference > maxDifference) ? difference : maxDifference;
+            totalDifference += difference;
+        }
+        printf("Difference from %s: max %u, mean %.3f\n", pGoldenFilename, maxDifference,
+               (float)totalDifference / pixels.size());
+        if (maxDifference > tolerance)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,427 @@
+// Host-side simulator for the DAC output PIO programs
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+#include "piosim.h"
+
+#include <cstdio>
+
+// The instruction encoding, from the RP2040 datasheet section 3.4
+enum class Opcode
+{
+    eJmp,
+    eWait,
+    eIn,
+    eOut,
+    ePushPull,
+    eMov,
+    eIrq,
+    eSet,
+};
+
+enum class JmpCondition
+{
+    eAlways,
+    eXZero,
+    eXPostDec,
+    eYZero,
+    eYPostDec,
+    eXNotEqualY,
+    ePin,
+    eOsrNotEmpty,
+};
+
+// OUT, MOV and SET destinations.  They mostly agree.
+enum class Destination
+{
+    ePins,
+    eX,
+    eY,
+    eNull,    // OUT only
+    ePinDirs, // OUT and SET
+    ePc,      // OUT and MOV
+    eIsr,     // OUT and MOV
+    eExec,    // OUT (and OSR for MOV)
+};
+static constexpr uint32_t kMovDestinationOsr = 7;
+
+enum class MovSource
+{
+    ePins,
+    eX,
+    eY,
+    eNull,
+    eReserved,
+    eStatus,
+    eIsr,
+    eOsr,
+};
+
+// Autopull threshold of 0 means 32 bits
+static constexpr uint32_t kPullThreshold = 32;
+
+PioSim::PioSim(const Program& program)
+: m_program(program)
+{
+}
+
+bool PioSim::LoadWords(const char* pFilename, std::vector<uint32_t>& outWords)
+{
+    FILE* pFile = fopen(pFilename, "rb");
+    if (pFile == nullptr)
+    {
+        printf("Can't open %s\n", pFilename);
+        return false;
+    }
+    uint8_t bytes[4];
+    while (fread(bytes, 1, 4, pFile) == 4)
+    {
+        outWords.push_back(bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24));
+    }
+    fclose(pFile);
+    return true;
+}
+
+void PioSim::Run(const uint32_t* pWords, uint32_t numWords, uint64_t maxSmCycles, Results& outResults)
+{
+    outResults = Results();
+
+    // As pio_sm_init leaves things
+    m_pc            = 0;
+    m_x             = 0;
+    m_y             = 0;
+    m_osr           = 0;
+    m_osrShiftCount = kPullThreshold;
+    m_pins          = 0;
+    m_sideset       = ~0u; // All the latches high
+    for (uint32_t& value : m_dacValues)
+    {
+        value = ~0u;
+    }
+    m_smCycle          = 0;
+    m_pWords           = pWords;
+    m_numWords         = numWords;
+    m_nextWordIdx      = 0;
+    m_wordStartSmCycle = 0;
+    m_haveStartedWord  = false;
+
+    const uint32_t numDelayBits = 5 - m_program.m_numSidesetPins;
+    while (m_smCycle < maxSmCycles)
+    {
+        const uint32_t instruction = m_program.m_pInstructions[m_pc];
+        const uint32_t delaySideset = (instruction >> 8) & 0x1f;
+        const uint32_t delay        = delaySideset & ((1u << numDelayBits) - 1);
+        const uint32_t operands     = instruction & 0xff;
+        uint32_t       nextPc       = (m_pc == m_program.m_wrap) ? m_program.m_wrapTarget : (m_pc + 1);
+        bool           stalled      = false;
+
+        // Side-set happens as soon as the instruction starts, whether it stalls or not
+        setSideset(delaySideset >> numDelayBits, outResults);
+
+        switch ((Opcode)(instruction >> 13))
+        {
+        case Opcode::eJmp:
+        {
+            bool taken = false;
+            switch ((JmpCondition)(operands >> 5))
+            {
+            case JmpCondition::eAlways:
+                taken = true;
+                break;
+            case JmpCondition::eXZero:
+                taken = (m_x == 0);
+                break;
+            case JmpCondition::eXPostDec:
+                taken = (m_x-- != 0);
+                break;
+            case JmpCondition::eYZero:
+                taken = (m_y == 0);
+                break;
+            case JmpCondition::eYPostDec:
+                taken = (m_y-- != 0);
+                break;
+            case JmpCondition::eXNotEqualY:
+                taken = (m_x != m_y);
+                break;
+            case JmpCondition::eOsrNotEmpty:
+                taken = (m_osrShiftCount < kPullThreshold);
+                break;
+            case JmpCondition::ePin:
+                outResults.m_unsupported = true;
+                break;
+            }
+            if (taken)
+            {
+                nextPc = operands & 0x1f;
+            }
+            break;
+        }
+
+        case Opcode::eOut:
+        {
+            // Autopull.  If there's nothing to pull then we stall here.
+            if ((m_osrShiftCount >= kPullThreshold) && !pull(outResults))
+            {
+                stalled = true;
+                break;
+            }
+            if (m_osrShiftCount == 0)
+            {
+                startWord(outResults);
+            }
+            const uint32_t numBits = ((operands & 0x1f) == 0) ? 32 : (operands & 0x1f);
+            const uint32_t value   = shiftOut(numBits);
+            switch ((Destination)(operands >> 5))
+            {
+            case Destination::ePins:
+                setPins(value, outResults);
+                break;
+            case Destination::eX:
+                m_x = value;
+                break;
+            case Destination::eY:
+                m_y = value;
+                break;
+            case Destination::eNull:
+            case Destination::ePinDirs:
+            case Destination::eIsr:
+                break;
+            case Destination::ePc:
+                nextPc = value & 0x1f;
+                break;
+            case Destination::eExec:
+                outResults.m_unsupported = true;
+                break;
+            }
+            // The OSR is refilled straight away if it's empty
+            if (m_osrShiftCount >= kPullThreshold)
+            {
+                pull(outResults);
+            }
+            break;
+        }
+
+        case Opcode::ePushPull:
+        {
+            if ((operands & 0x80) == 0)
+            {
+                // PUSH
+                outResults.m_unsupported = true;
+                break;
+            }
+            const bool ifEmpty = (operands & 0x40) != 0;
+            const bool block   = (operands & 0x20) != 0;
+            if (ifEmpty && (m_osrShiftCount < kPullThreshold))
+            {
+                break;
+            }
+            if (!pull(outResults))
+            {
+                if (block)
+                {
+                    stalled = true;
+                }
+                else
+                {
+                    m_osr           = m_x;
+                    m_osrShiftCount = 0;
+                }
+            }
+            break;
+        }
+
+        case Opcode::eMov:
+        {
+            uint32_t value = readSource(operands & 7);
+            switch ((operands >> 3) & 3)
+            {
+            case 1:
+                value = ~value;
+                break;
+            case 2:
+            {
+                uint32_t reversed = 0;
+                for (uint32_t i = 0; i < 32; ++i)
+                {
+                    reversed |= ((value >> i) & 1) << (31 - i);
+                }
+                value = reversed;
+                break;
+            }
+            default:
+                break;
+            }
+            const uint32_t destination = operands >> 5;
+            if (destination == kMovDestinationOsr)
+            {
+                m_osr           = value;
+                m_osrShiftCount = 0;
+                break;
+            }
+            switch ((Destination)destination)
+            {
+            case Destination::ePins:
+                setPins(value, outResults);
+                break;
+            case Destination::eX:
+                m_x = value;
+                break;
+            case Destination::eY:
+                m_y = value;
+                break;
+            case Destination::ePc:
+                nextPc = value & 0x1f;
+                break;
+            case Destination::eIsr:
+                break;
+            default:
+                outResults.m_unsupported = true;
+                break;
+            }
+            break;
+        }
+
+        case Opcode::eSet:
+        {
+            const uint32_t value = operands & 0x1f;
+            switch ((Destination)(operands >> 5))
+            {
+            case Destination::eX:
+                m_x = value;
+                break;
+            case Destination::eY:
+                m_y = value;
+                break;
+            case Destination::ePins:
+            case Destination::ePinDirs:
+                // We don't configure any SET pins
+                break;
+            default:
+                outResults.m_unsupported = true;
+                break;
+            }
+            break;
+        }
+
+        case Opcode::eWait:
+        case Opcode::eIn:
+        case Opcode::eIrq:
+            outResults.m_unsupported = true;
+            break;
+        }
+
+        if (outResults.m_unsupported)
+        {
+            outResults.m_unsupportedInstruction = instruction;
+            break;
+        }
+        if (stalled)
+        {
+            if (m_nextWordIdx >= m_numWords)
+            {
+                // Out of words.  That's the end of the last one.
+                startWord(outResults);
+                break;
+            }
+            ++m_smCycle;
+            continue;
+        }
+
+        // The delay happens after the instruction, whether a jump was taken or not
+        m_pc = nextPc;
+        m_smCycle += 1 + delay;
+    }
+
+    outResults.m_numSmCycles  = m_smCycle;
+    outResults.m_numSysCycles = m_smCycle * m_program.m_clockDivider;
+}
+
+bool PioSim::pull(Results& results)
+{
+    if (m_nextWordIdx >= m_numWords)
+    {
+        return false;
+    }
+    m_osr           = m_pWords[m_nextWordIdx++];
+    m_osrShiftCount = 0;
+    ++results.m_numWordsPulled;
+    return true;
+}
+
+// The first bits of a word are being shifted out, so that's the end of the previous one
+void PioSim::startWord(Results& results)
+{
+    if (m_haveStartedWord)
+    {
+        results.m_cyclesPerWord.push_back((uint32_t)(m_smCycle - m_wordStartSmCycle));
+    }
+    m_wordStartSmCycle = m_smCycle;
+    m_haveStartedWord  = true;
+}
+
+uint32_t PioSim::shiftOut(uint32_t numBits)
+{
+    // Shifting right, so the bits come out of the bottom
+    const uint32_t value = (numBits == 32) ? m_osr : (m_osr & ((1u << numBits) - 1));
+    m_osr                = (numBits == 32) ? 0 : (m_osr >> numBits);
+    m_osrShiftCount += numBits;
+    return value;
+}
+
+uint32_t PioSim::readSource(uint32_t source) const
+{
+    switch ((MovSource)source)
+    {
+    case MovSource::ePins:
+        return m_pins;
+    case MovSource::eX:
+        return m_x;
+    case MovSource::eY:
+        return m_y;
+    case MovSource::eOsr:
+        return m_osr;
+    default:
+        return 0;
+    }
+}
+
+void PioSim::setSideset(uint32_t sideset, Results& results)
+{
+    m_sideset = sideset;
+    updateDacs(results);
+}
+
+void PioSim::setPins(uint32_t value, Results& results)
+{
+    m_pins = value & kPinMask;
+    updateDacs(results);
+}
+
+void PioSim::updateDacs(Results& results)
+{
+    // Each side-set pin is the active-low chip select for one of the DACs
+    for (uint32_t i = 0; i < m_program.m_numSidesetPins; ++i)
+    {
+        if (((m_sideset >> i) & 1) == 0 && (m_dacValues[i] != m_pins))
+        {
+            m_dacValues[i] = m_pins;
+            results.m_timeline.push_back({m_smCycle * m_program.m_clockDivider, (Dac)i, (uint16_t)m_pins});
+        }
+    }
+}
@@ -0,0 +1,128 @@
+// Host-side simulator for the DAC output PIO programs
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+// Runs the instructions that pioasm generates from the .pio sources, one
+// state machine cycle at a time, the way the RP2040 would.  Only the parts
+// of the instruction set that make sense without a real GPIO bank are
+// supported; WAIT, IN, PUSH and IRQ stop the simulation.
+//
+// The state machine is configured the way DacOutputPioSm configures it:
+// 12 out pins, non-optional side-set for the DAC latches, the OSR shifting
+// right, and autopull at 32 bits.
+//
+// The DACs are AD767s, which are transparent while their chip select is
+// low, so the timeline records the value on the pins whenever it changes
+// while a latch is low.
+
+#pragma once
+#include <cstdint>
+#include <vector>
+
+class PioSim
+{
+public:
+    struct Program
+    {
+        const char*     m_name;
+        const uint16_t* m_pInstructions;
+        uint32_t        m_length;
+        uint32_t        m_wrapTarget;
+        uint32_t        m_wrap;
+        uint32_t        m_numSidesetPins;
+        uint32_t        m_clockDivider;
+    };
+
+    // Which latch each side-set bit drives
+    enum class Dac : uint8_t
+    {
+        eX,
+        eY,
+        eZ,
+
+        eCount
+    };
+
+    // A change to the value a DAC is outputting
+    struct DacEvent
+    {
+        uint64_t m_sysCycle;
+        Dac      m_dac;
+        uint16_t m_value;
+    };
+
+    struct Results
+    {
+        uint64_t m_numSmCycles            = 0;
+        uint64_t m_numSysCycles           = 0;
+        uint32_t m_numWordsPulled         = 0;
+        bool     m_unsupported            = false; // Hit an instruction we can't simulate
+        uint32_t m_unsupportedInstruction = 0;
+
+        // State machine cycles from the first bits of each word being shifted
+        // out until the first bits of the next one are wanted.
+        std::vector<uint32_t> m_cyclesPerWord;
+        std::vector<DacEvent> m_timeline;
+    };
+
+    explicit PioSim(const Program& program);
+
+    // Appends the words in a file of raw little-endian 32-bit DAC words, just as
+    // they'd go to the DMA.
+    static bool LoadWords(const char* pFilename, std::vector<uint32_t>& outWords);
+
+    // Feed the words through the program until it's waiting for a word that
+    // isn't there, or until maxSmCycles have passed, whichever is first.
+    // The FIFO is always kept full, so this measures what the PIO can do, not
+    // what the DMA can keep up with.
+    void Run(const uint32_t* pWords, uint32_t numWords, uint64_t maxSmCycles, Results& outResults);
+
+private:
+    bool     pull(Results& results);
+    void     startWord(Results& results);
+    uint32_t shiftOut(uint32_t numBits);
+    void     setSideset(uint32_t sideset, Results& results);
+    void     setPins(uint32_t value, Results& results);
+    void     updateDacs(Results& results);
+    uint32_t readSource(uint32_t source) const;
+
+private:
+    static constexpr uint32_t kNumOutPins = 12;
+    static constexpr uint32_t kPinMask    = (1u << kNumOutPins) - 1;
+
+    const Program& m_program;
+
+    // State machine registers
+    uint32_t m_pc;
+    uint32_t m_x;
+    uint32_t m_y;
+    uint32_t m_osr;
+    uint32_t m_osrShiftCount;
+
+    uint32_t m_pins;
+    uint32_t m_sideset;
+    uint32_t m_dacValues[(int)Dac::eCount];
+    uint64_t m_smCycle;
+
+    const uint32_t* m_pWords;
+    uint32_t        m_numWords;
+    uint32_t        m_nextWordIdx;
+    uint64_t        m_wordStartSmCycle;
+    bool            m_haveStartedWord;
+};
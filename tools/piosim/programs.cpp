@@ -0,0 +1,68 @@
+// The PIO programs, as the simulator sees them
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+#include "programs.h"
+
+#include "dacouttiming.h"
+
+// Generated by pioasm
+#include "idle.pio.h"
+#include "points.pio.h"
+#include "raster.pio.h"
+#include "vector.pio.h"
+
+#include <cstring>
+
+#define NUM_INSTRUCTIONS(instructions) (sizeof(instructions) / sizeof(instructions[0]))
+
+// These match s_programInfo in src/dacoutputsm.cpp, in the same order so that
+// the index is the SmID
+static const PioSim::Program s_programs[] = {
+    {"idle", idle_program_instructions, NUM_INSTRUCTIONS(idle_program_instructions), idle_wrap_target, idle_wrap, 2,
+     DacOutTiming::kIdleClockDivider},
+    {"vector", vector_program_instructions, NUM_INSTRUCTIONS(vector_program_instructions), vector_wrap_target,
+     vector_wrap, 3, DacOutTiming::kVectorClockDivider},
+    {"points", points_program_instructions, NUM_INSTRUCTIONS(points_program_instructions), points_wrap_target,
+     points_wrap, 2, DacOutTiming::kPointsClockDivider},
+    {"raster", raster_program_instructions, NUM_INSTRUCTIONS(raster_program_instructions), raster_wrap_target,
+     raster_wrap, 2, DacOutTiming::kRasterClockDivider},
+};
+
+const PioSim::Program& PioPrograms::Idle() { return s_programs[0]; }
+const PioSim::Program& PioPrograms::Vector() { return s_programs[1]; }
+const PioSim::Program& PioPrograms::Points() { return s_programs[2]; }
+const PioSim::Program& PioPrograms::Raster() { return s_programs[3]; }
+
+const PioSim::Program* PioPrograms::FromId(uint32_t id)
+{
+    return (id < (sizeof(s_programs) / sizeof(s_programs[0]))) ? &s_programs[id] : nullptr;
+}
+
+const PioSim::Program* PioPrograms::Find(const char* pName)
+{
+    for (const PioSim::Program& program : s_programs)
+    {
+        if (strcmp(pName, program.m_name) == 0)
+        {
+            return &program;
+        }
+    }
+    return nullptr;
+}
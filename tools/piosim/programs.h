@@ -0,0 +1,39 @@
+// The PIO programs, as the simulator sees them
+//
+// Copyright (C) 2022 Oli Wright
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// A copy of the GNU General Public License can be found in the file
+// LICENSE.txt in the root of this project.
+// If not, see <https://www.gnu.org/licenses/>.
+//
+// oli.wright.github@gmail.com
+
+#pragma once
+#include "piosim.h"
+
+// The DAC output programs, assembled by pioasm, and configured the same way
+// as DacOutputPioSm configures them.
+class PioPrograms
+{
+public:
+    static const PioSim::Program& Idle();
+    static const PioSim::Program& Vector();
+    static const PioSim::Program& Points();
+    static const PioSim::Program& Raster();
+
+    // By name; "idle", "vector", "points" or "raster".  Null if there isn't one.
+    static const PioSim::Program* Find(const char* pName);
+
+    // By DacOutputPioSmConfig::m_id, as they're recorded in frame captures
+    static const PioSim::Program* FromId(uint32_t id);
+};
@@ -26,18 +26,26 @@ pico_generate_pio_header(${PROJECT_NAME} ${CMAKE_CURRENT_LIST_DIR}/src/raster.pi
 include_directories(${CMAKE_CURRENT_LIST_DIR}/include)
 
 target_sources(${PROJECT_NAME} PRIVATE
+        ${CMAKE_CURRENT_LIST_DIR}/src/beampath.cpp
+        ${CMAKE_CURRENT_LIST_DIR}/src/benchmarks.cpp
         ${CMAKE_CURRENT_LIST_DIR}/src/buttons.cpp
         ${CMAKE_CURRENT_LIST_DIR}/src/dacout.cpp
+        ${CMAKE_CURRENT_LIST_DIR}/src/dacoutring.cpp
         ${CMAKE_CURRENT_LIST_DIR}/src/dacoutputsm.cpp
         ${CMAKE_CURRENT_LIST_DIR}/src/fixedpoint.cpp
         ${CMAKE_CURRENT_LIST_DIR}/src/displaylist.cpp
+        ${CMAKE_CURRENT_LIST_DIR}/src/framebudget.cpp
+        ${CMAKE_CURRENT_LIST_DIR}/src/framecapture.cpp
         ${CMAKE_CURRENT_LIST_DIR}/src/ledstatus.cpp
         ${CMAKE_CURRENT_LIST_DIR}/src/log.cpp
         ${CMAKE_CURRENT_LIST_DIR}/src/lookuptable.cpp
         ${CMAKE_CURRENT_LIST_DIR}/src/main.cpp
+        ${CMAKE_CURRENT_LIST_DIR}/src/priority.cpp
         ${CMAKE_CURRENT_LIST_DIR}/src/serial.cpp
         ${CMAKE_CURRENT_LIST_DIR}/src/shapes.cpp
         ${CMAKE_CURRENT_LIST_DIR}/src/sintable.cpp
+        ${CMAKE_CURRENT_LIST_DIR}/src/stepreciprocal.cpp
+        ${CMAKE_CURRENT_LIST_DIR}/src/telemetry.cpp
         ${CMAKE_CURRENT_LIST_DIR}/src/testcard.cpp
         ${CMAKE_CURRENT_LIST_DIR}/src/text.cpp
         ${CMAKE_CURRENT_LIST_DIR}/src/transform2d.cpp